@@ -0,0 +1,457 @@
+/*
+ * Benchmark suite of the shell.
+ *
+ *   bench/bench SHELL [BASELINE]
+ *
+ * In-process benchmarks time the parser, the formatter and the job table.
+ * The other ones drive SHELL (and BASELINE, usually bash) from outside:
+ * script throughput, launch latency of a command and of pipelines, and
+ * pipe throughput. Every result is one tab separated line
+ *
+ *   suite  name  shell  value  unit
+ *
+ * and with a baseline, a `compare` line gives SHELL / BASELINE for each
+ * external benchmark. BENCH_SCALE (default 1) scales the iteration counts.
+ */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "parse.h"
+#include "job.h"
+
+#define MAX_RESULTS 64
+#define MARKER      "__bench_done__"
+
+typedef struct {
+    const char* suite;
+    char name[48];
+    double value;
+    const char* unit;
+} Result;
+
+/* results of the shell under test, to compare the baseline with */
+Result results[MAX_RESULTS];
+int result_count = 0;
+
+double scale = 1.0;
+
+double now_seconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int scaled(int count)
+{
+    int n = (int)(count * scale);
+
+    return n > 0 ? n : 1;
+}
+
+void report(const char* suite, const char* name, const char* shell, double value, const char* unit, bool baseline)
+{
+    int i;
+
+    printf("%s\t%s\t%s\t%.3f\t%s\n", suite, name, shell, value, unit);
+
+    if (!baseline) {
+        if (result_count < MAX_RESULTS) {
+            results[result_count].suite = suite;
+            strncpy(results[result_count].name, name, sizeof(results[result_count].name) - 1);
+            results[result_count].value = value;
+            results[result_count].unit = unit;
+            result_count++;
+        }
+        return;
+    }
+
+    for (i = 0; i < result_count; i++) {
+        if (strcmp(results[i].suite, suite) == 0 && strcmp(results[i].name, name) == 0 && value > 0) {
+            printf("compare\t%s/%s\tratio\t%.3f\t%s\n", suite, name, results[i].value / value, unit);
+        }
+    }
+    fflush(stdout);
+}
+
+int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+
+    return (x > y) - (x < y);
+}
+
+double percentile(double* sorted, int count, double p)
+{
+    int idx = (int)(p * (count - 1) + 0.5);
+
+    return sorted[idx];
+}
+
+
+/******************************************************************************
+ * Parser and formatter
+ *****************************************************************************/
+/* the synthetic lines: many arguments, many stages, long quoted tokens */
+char* make_line(const char* kind)
+{
+    char* line = (char*)malloc(65536);
+    int i, len = 0;
+
+    line[0] = '\0';
+    if (strcmp(kind, "args") == 0) {
+        len += sprintf(line + len, "cmd");
+        for (i = 0; i < 200; i++) {
+            len += sprintf(line + len, " arg%d", i);
+        }
+        sprintf(line + len, " < in > out");
+    } else if (strcmp(kind, "stages") == 0) {
+        for (i = 0; i < MAX_CMDS; i++) {
+            len += sprintf(line + len, "%sstage%d -x %d", i > 0 ? " | " : "", i, i);
+        }
+    } else {
+        len += sprintf(line + len, "echo \"");
+        for (i = 0; i < 4000; i++) {
+            line[len++] = (i % 97 == 0) ? ' ' : 'a' + i % 26;
+        }
+        len += sprintf(line + len, "\" 'single\\quoted' back\\ slash");
+    }
+
+    return line;
+}
+
+void bench_parser()
+{
+    const char* kinds[] = {"args", "stages", "tokens", NULL};
+    Arena arena;
+    int k;
+
+    arena_init(&arena);
+
+    for (k = 0; kinds[k] != NULL; k++) {
+        char* source = make_line(kinds[k]);
+        size_t size = strlen(source) + 1;
+        char* line = (char*)malloc(size);
+        char* formatted = NULL;
+        CommandLine command_line;
+        int i, iterations = scaled(20000);
+        double start, parse_time = 0, format_time = 0;
+
+        init_command_line(&command_line, &arena);
+        for (i = 0; i < iterations; i++) {
+            /* the lexer works in place, so every round parses a fresh copy */
+            memcpy(line, source, size);
+            arena_reset(&arena);
+
+            start = now_seconds();
+            parse_command_line(&command_line, line);
+            parse_time += now_seconds() - start;
+
+            if (formatted == NULL) {
+                formatted = (char*)malloc(format_command_line(NULL, &command_line, true) + 1);
+            }
+            start = now_seconds();
+            format_command_line(formatted, &command_line, true);
+            format_time += now_seconds() - start;
+        }
+
+        report("parse", kinds[k], "-", iterations / parse_time, "ops/s", false);
+        report("format", kinds[k], "-", iterations / format_time, "ops/s", false);
+
+        free(formatted);
+        free(line);
+        free(source);
+    }
+
+    arena_free(&arena);
+}
+
+
+/******************************************************************************
+ * Job table: thousands of jobs appended, reaped one pid at a time, listed
+ * by spec and removed
+ *****************************************************************************/
+void bench_job_table()
+{
+    JobList list;
+    Arena arena;
+    CommandLine command_line;
+    char line[] = "sleep 100 | cat";
+    int i, jobs = scaled(10000);
+    double start, elapsed;
+    pid_t pids[2];
+
+    arena_init(&arena);
+    init_command_line(&command_line, &arena);
+    parse_command_line(&command_line, line);
+    init_job_list(&list);
+
+    start = now_seconds();
+    for (i = 0; i < jobs; i++) {
+        pids[0] = 100000 + 2 * i;
+        pids[1] = 100001 + 2 * i;
+        append_job_list(&list, pids, 2, &command_line, "~");
+    }
+    elapsed = now_seconds() - start;
+    report("jobs", "append", "-", jobs / elapsed, "ops/s", false);
+
+    start = now_seconds();
+    for (i = 0; i < jobs; i++) {
+        char spec[16];
+
+        sprintf(spec, "%%%d", i + 1);
+        find_job_spec(&list, spec);
+    }
+    elapsed = now_seconds() - start;
+    report("jobs", "find_spec", "-", jobs / elapsed, "ops/s", false);
+
+    /* reap in an order unrelated to the launch order */
+    start = now_seconds();
+    for (i = 0; i < 2 * jobs; i++) {
+        int n = (int)((i * 7919L) % (2 * jobs));
+
+        record_job_status(&list, 100000 + n, 0, NULL);
+    }
+    elapsed = now_seconds() - start;
+    report("jobs", "record_status", "-", 2 * jobs / elapsed, "ops/s", false);
+
+    start = now_seconds();
+    for (i = list.top; i >= 0; i--) {
+        remove_job_list(&list, i);
+    }
+    elapsed = now_seconds() - start;
+    report("jobs", "remove", "-", jobs / elapsed, "ops/s", false);
+
+    free_job_list(&list);
+    arena_free(&arena);
+}
+
+
+/******************************************************************************
+ * External benchmarks: the shell reads lines from a pipe, each one followed
+ * by `echo MARKER`, and a line is done once the marker comes back
+ *****************************************************************************/
+typedef struct {
+    pid_t pid;
+    int to;
+    int from;
+} Session;
+
+bool start_session(Session* session, const char* shell)
+{
+    int in_pfds[2], out_pfds[2];
+
+    if (pipe(in_pfds) < 0 || pipe(out_pfds) < 0) {
+        return false;
+    }
+
+    session->pid = fork();
+    if (session->pid == 0) {
+        dup2(in_pfds[0], STDIN_FILENO);
+        dup2(out_pfds[1], STDOUT_FILENO);
+        close(in_pfds[0]);
+        close(in_pfds[1]);
+        close(out_pfds[0]);
+        close(out_pfds[1]);
+        signal(SIGPIPE, SIG_DFL);
+        setenv("PS1", "", 1);
+        setenv("SIMPLEBASH_HISTORY", "", 1);  /* keep the runs out of ~/.simplebash_history */
+        execlp(shell, shell, (char*)NULL);
+        _exit(127);
+    }
+
+    close(in_pfds[0]);
+    close(out_pfds[1]);
+    session->to = in_pfds[1];
+    session->from = out_pfds[0];
+
+    return session->pid > 0;
+}
+
+void stop_session(Session* session)
+{
+    int stats;
+
+    close(session->to);
+    close(session->from);
+    waitpid(session->pid, &stats, 0);
+}
+
+/* run one line, return its wall time in seconds or a negative value when the shell died */
+double session_run(Session* session, const char* line)
+{
+    char buf[4096];
+    size_t used = 0, marker_len = strlen(MARKER);
+    double start = now_seconds();
+
+    if (write(session->to, line, strlen(line)) < 0 || write(session->to, "\necho " MARKER "\n", marker_len + 7) < 0) {
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t count = read(session->from, buf + used, sizeof(buf) - used - 1);
+
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return -1;
+        }
+        used += count;
+        buf[used] = '\0';
+        if (strstr(buf, MARKER "\n") != NULL) {
+            break;
+        }
+        if (used > sizeof(buf) - 64) {
+            /* keep the tail, the marker may straddle two reads */
+            memmove(buf, buf + used - marker_len, marker_len);
+            used = marker_len;
+        }
+    }
+
+    return now_seconds() - start;
+}
+
+void bench_latency(const char* shell, const char* name, const char* line, int iterations, bool baseline)
+{
+    Session session;
+    double* samples = (double*)malloc(sizeof(double) * iterations);
+    char full_name[40];
+    int i;
+
+    if (!start_session(&session, shell)) {
+        free(samples);
+        return;
+    }
+
+    session_run(&session, line);  /* warm up the hash table and caches */
+    for (i = 0; i < iterations; i++) {
+        samples[i] = session_run(&session, line) * 1e6;
+        if (samples[i] < 0) {
+            fprintf(stderr, "bench: %s died running %s\n", shell, line);
+            break;
+        }
+    }
+    stop_session(&session);
+
+    if (i == iterations) {
+        const double points[] = {0.5, 0.9, 0.99};
+        const char* labels[] = {"p50", "p90", "p99"};
+        int p;
+
+        qsort(samples, iterations, sizeof(double), compare_doubles);
+        for (p = 0; p < 3; p++) {
+            sprintf(full_name, "%s_%s", name, labels[p]);
+            report("latency", full_name, shell, percentile(samples, iterations, points[p]), "us", baseline);
+        }
+    }
+    free(samples);
+}
+
+/* run a generated script of trivial builtins */
+void bench_script(const char* shell, bool baseline)
+{
+    char path[] = "/tmp/simplebash_bench_XXXXXX";
+    int fd = mkstemp(path), i, lines = scaled(20000);
+    FILE* script;
+    double start, elapsed;
+    pid_t pid;
+    int stats;
+
+    if (fd < 0) {
+        return;
+    }
+    script = fdopen(fd, "w");
+    for (i = 0; i < lines; i++) {
+        fputs(i % 2 == 0 ? "true\n" : "test 1 -eq 1\n", script);
+    }
+    fclose(script);
+
+    start = now_seconds();
+    pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        execlp(shell, shell, path, (char*)NULL);
+        _exit(127);
+    }
+    waitpid(pid, &stats, 0);
+    elapsed = now_seconds() - start;
+    unlink(path);
+
+    report("script", "builtin_lines", shell, lines / elapsed, "lines/s", baseline);
+}
+
+void bench_throughput(const char* shell, bool baseline)
+{
+    Session session;
+    char line[128];
+    int megabytes = scaled(512), i;
+    double best = -1;
+
+    if (!start_session(&session, shell)) {
+        return;
+    }
+    sprintf(line, "head -c %ld /dev/zero | cat | cat > /dev/null", (long)megabytes * 1024 * 1024);
+    for (i = 0; i < 3; i++) {
+        double elapsed = session_run(&session, line);
+
+        if (elapsed > 0 && (best < 0 || elapsed < best)) {
+            best = elapsed;
+        }
+    }
+    stop_session(&session);
+
+    if (best > 0) {
+        report("pipe", "throughput_3stage", shell, megabytes / best, "MiB/s", baseline);
+    }
+}
+
+void bench_shell(const char* shell, bool baseline)
+{
+    int iterations = scaled(300);
+
+    bench_script(shell, baseline);
+    bench_latency(shell, "command", "/bin/true", iterations, baseline);
+    bench_latency(shell, "pipeline4", "/bin/true | /bin/true | /bin/true | /bin/true", iterations, baseline);
+    bench_latency(shell, "pipeline8", "/bin/true | /bin/true | /bin/true | /bin/true | /bin/true | /bin/true | /bin/true | /bin/true",
+        iterations / 2 > 0 ? iterations / 2 : 1, baseline);
+    bench_throughput(shell, baseline);
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s SHELL [BASELINE]\n", argv[0]);
+        return 2;
+    }
+    if (getenv("BENCH_SCALE") != NULL && atof(getenv("BENCH_SCALE")) > 0) {
+        scale = atof(getenv("BENCH_SCALE"));
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("# suite\tname\tshell\tvalue\tunit\n");
+    bench_parser();
+    bench_job_table();
+    fflush(stdout);
+
+    bench_shell(argv[1], false);
+    if (argc > 2) {
+        bench_shell(argv[2], true);
+    }
+
+    return 0;
+}
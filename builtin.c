@@ -0,0 +1,663 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* copy_file_range, splice */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "builtin.h"
+
+/******************************************************************************
+ * Backslash escapes shared by echo -e and printf
+ *****************************************************************************/
+/*
+ * Print the escape sequence starting at the backslash p, return the last
+ * character consumed. \c sets stop. echo reads octal as \0nnn, printf as \nnn.
+ */
+const char* put_escape(const char* p, bool echo_style, bool* stop)
+{
+    int value, digits;
+
+    switch (*++p) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case 'c': *stop = true; break;
+        case '\0':  /* a trailing backslash stays */
+            putchar('\\');
+            return p - 1;
+        default:
+            if ((echo_style && *p == '0') || (!echo_style && *p >= '0' && *p <= '7')) {
+                if (echo_style) {
+                    p++;
+                }
+                for (value = 0, digits = 0; digits < 3 && *p >= '0' && *p <= '7'; digits++, p++) {
+                    value = value * 8 + (*p - '0');
+                }
+                putchar(value);
+                return p - 1;
+            }
+            putchar('\\');
+            putchar(*p);
+            break;
+    }
+
+    return p;
+}
+
+void put_escaped(const char* str, bool echo_style, bool* stop)
+{
+    const char* p;
+
+    for (p = str; *p != '\0' && !*stop; p++) {
+        if (*p == '\\') {
+            p = put_escape(p, echo_style, stop);
+        } else {
+            putchar(*p);
+        }
+    }
+}
+
+
+/* a reader that went away turns into a failed builtin, as in bash */
+int flush_output(const char* name, int status)
+{
+    if (fflush(stdout) == EOF || ferror(stdout)) {
+        fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return status;
+}
+
+
+/******************************************************************************
+ * echo [-neE] [arg ...]
+ *****************************************************************************/
+int echo_builtin(int argc, char* argv[])
+{
+    bool newline = true, escapes = false, stop = false;
+    int i = 1;
+
+    /* options only count while every letter is one of n, e and E */
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        const char* opt = argv[i] + 1;
+
+        if (strspn(opt, "neE") != strlen(opt)) {
+            break;
+        }
+        for (; *opt != '\0'; opt++) {
+            if (*opt == 'n') {
+                newline = false;
+            } else {
+                escapes = (*opt == 'e');
+            }
+        }
+    }
+
+    for (; i < argc && !stop; i++) {
+        if (escapes) {
+            put_escaped(argv[i], true, &stop);
+        } else {
+            fputs(argv[i], stdout);
+        }
+        if (i < argc - 1 && !stop) {
+            putchar(' ');
+        }
+    }
+
+    if (newline && !stop) {
+        putchar('\n');
+    }
+
+    return flush_output("echo", EXIT_SUCCESS);
+}
+
+
+/******************************************************************************
+ * printf format [arguments ...]
+ *****************************************************************************/
+/* numeric argument, 'c or "c give the character code */
+bool printf_number(const char* arg, long* value)
+{
+    char* end;
+
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *value = (unsigned char)arg[1];
+        return true;
+    }
+
+    errno = 0;
+    *value = strtol(arg, &end, 0);
+    if (*arg == '\0') {
+        *value = 0;
+        return true;
+    }
+    if (errno != 0 || *end != '\0') {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        return false;
+    }
+
+    return true;
+}
+
+int printf_builtin(int argc, char* argv[])
+{
+    const char* format;
+    char** args;
+    int argn, status = EXIT_SUCCESS;
+    bool stop = false;
+
+    if (argc < 2) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    format = argv[1];
+    args = argv + 2;
+    argn = argc - 2;
+
+    /* the format is reused as long as arguments are left */
+    do {
+        const char* p;
+        int consumed = 0;
+
+        for (p = format; *p != '\0' && !stop; p++) {
+            char spec[64];
+            int len = 0;
+            const char* arg;
+            long number;
+
+            if (*p == '\\') {
+                p = put_escape(p, false, &stop);
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            /* copy flags, width and precision, filling in * from the arguments */
+            spec[len++] = '%';
+            for (p++; *p != '\0' && strchr("-+ #0123456789.*", *p) != NULL && len < 40; p++) {
+                if (*p == '*') {
+                    long width = 0;
+
+                    if (consumed < argn && !printf_number(args[consumed++], &width)) {
+                        status = EXIT_FAILURE;
+                    }
+                    len += sprintf(spec + len, "%ld", width);
+                } else {
+                    spec[len++] = *p;
+                }
+            }
+
+            arg = (consumed < argn) ? args[consumed++] : "";
+
+            switch (*p) {
+                case 'd':
+                case 'i':
+                    spec[len++] = 'l';
+                    spec[len++] = 'd';
+                    spec[len] = '\0';
+                    if (!printf_number(arg, &number)) {
+                        status = EXIT_FAILURE;
+                    }
+                    printf(spec, number);
+                    break;
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X':
+                    spec[len++] = 'l';
+                    spec[len++] = *p;
+                    spec[len] = '\0';
+                    if (!printf_number(arg, &number)) {
+                        status = EXIT_FAILURE;
+                    }
+                    printf(spec, (unsigned long)number);
+                    break;
+                case 'c':
+                    if (*arg != '\0') {
+                        putchar(*arg);
+                    }
+                    break;
+                case 's':
+                    spec[len++] = 's';
+                    spec[len] = '\0';
+                    printf(spec, arg);
+                    break;
+                case 'b':
+                    put_escaped(arg, true, &stop);
+                    break;
+                default:
+                    fprintf(stderr, "printf: `%c': invalid format character\n", *p);
+                    return EXIT_FAILURE;
+            }
+
+            if (*p == '\0') {
+                break;
+            }
+        }
+
+        if (consumed == 0) {
+            break;
+        }
+        args += consumed;
+        argn -= consumed;
+    } while (argn > 0 && !stop);
+
+    return flush_output("printf", status);
+}
+
+
+/******************************************************************************
+ * test expression, [ expression ]
+ *****************************************************************************/
+typedef struct {
+    char** argv;
+    int argc;
+    int pos;
+    bool error;
+} TestParser;
+
+bool test_integer(TestParser* parser, const char* arg, long* value)
+{
+    char* end;
+
+    errno = 0;
+    *value = strtol(arg, &end, 10);
+    while (isspace((unsigned char)*end)) {
+        end++;
+    }
+    if (*arg == '\0' || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        parser->error = true;
+        return false;
+    }
+
+    return true;
+}
+
+bool is_unary_op(const char* op)
+{
+    return op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("bcdefghLnprsStuwxz", op[1]) != NULL;
+}
+
+bool is_binary_op(const char* op)
+{
+    const char* ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+    int i;
+
+    for (i = 0; ops[i] != NULL; i++) {
+        if (strcmp(ops[i], op) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool test_unary(const char* op, const char* arg)
+{
+    struct stat st;
+
+    switch (op[1]) {
+        case 'n': return *arg != '\0';
+        case 'z': return *arg == '\0';
+        case 't': return isatty(atoi(arg));
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+        case 'h':
+        case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        default: break;
+    }
+
+    if (stat(arg, &st) != 0) {
+        return false;
+    }
+
+    switch (op[1]) {
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'f': return S_ISREG(st.st_mode);
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        default: return true;  /* -e */
+    }
+}
+
+bool test_binary(TestParser* parser, const char* left, const char* op, const char* right)
+{
+    long l, r;
+    struct stat lst, rst;
+
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+        return strcmp(left, right) == 0;
+    } else if (strcmp(op, "!=") == 0) {
+        return strcmp(left, right) != 0;
+    } else if (strcmp(op, "<") == 0) {
+        return strcmp(left, right) < 0;
+    } else if (strcmp(op, ">") == 0) {
+        return strcmp(left, right) > 0;
+    } else if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        bool lok = stat(left, &lst) == 0, rok = stat(right, &rst) == 0;
+
+        if (op[1] == 'e') {
+            return lok && rok && lst.st_dev == rst.st_dev && lst.st_ino == rst.st_ino;
+        } else if (op[1] == 'n') {
+            return lok && (!rok || lst.st_mtime > rst.st_mtime);
+        }
+        return rok && (!lok || lst.st_mtime < rst.st_mtime);
+    }
+
+    if (!test_integer(parser, left, &l) || !test_integer(parser, right, &r)) {
+        return false;
+    }
+
+    if (strcmp(op, "-eq") == 0) return l == r;
+    if (strcmp(op, "-ne") == 0) return l != r;
+    if (strcmp(op, "-lt") == 0) return l < r;
+    if (strcmp(op, "-le") == 0) return l <= r;
+    if (strcmp(op, "-gt") == 0) return l > r;
+    return l >= r;  /* -ge */
+}
+
+bool test_or(TestParser* parser);
+
+/* primary: ( expr ) | unary-op arg | arg binary-op arg | arg */
+bool test_primary(TestParser* parser)
+{
+    char** argv = parser->argv;
+    int left = parser->argc - parser->pos;
+    const char* arg;
+
+    if (left <= 0) {
+        fprintf(stderr, "test: argument expected\n");
+        parser->error = true;
+        return false;
+    }
+
+    arg = argv[parser->pos];
+
+    if (left >= 3 && is_binary_op(argv[parser->pos + 1])) {
+        parser->pos += 3;
+        return test_binary(parser, arg, argv[parser->pos - 2], argv[parser->pos - 1]);
+    }
+
+    if (strcmp(arg, "(") == 0 && left >= 2) {
+        bool result;
+
+        parser->pos++;
+        result = test_or(parser);
+        if (parser->pos >= parser->argc || strcmp(argv[parser->pos], ")") != 0) {
+            fprintf(stderr, "test: `)' expected\n");
+            parser->error = true;
+            return false;
+        }
+        parser->pos++;
+        return result;
+    }
+
+    if (left >= 2 && is_unary_op(arg)) {
+        parser->pos += 2;
+        return test_unary(arg, argv[parser->pos - 1]);
+    }
+
+    parser->pos++;
+    return *arg != '\0';
+}
+
+bool test_not(TestParser* parser)
+{
+    if (parser->pos < parser->argc - 1 && strcmp(parser->argv[parser->pos], "!") == 0) {
+        parser->pos++;
+        return !test_not(parser);
+    }
+
+    return test_primary(parser);
+}
+
+bool test_and(TestParser* parser)
+{
+    bool result = test_not(parser);
+
+    while (parser->pos < parser->argc && strcmp(parser->argv[parser->pos], "-a") == 0) {
+        bool right;
+
+        parser->pos++;
+        right = test_not(parser);
+        result = result && right;
+    }
+
+    return result;
+}
+
+bool test_or(TestParser* parser)
+{
+    bool result = test_and(parser);
+
+    while (parser->pos < parser->argc && strcmp(parser->argv[parser->pos], "-o") == 0) {
+        bool right;
+
+        parser->pos++;
+        right = test_and(parser);
+        result = result || right;
+    }
+
+    return result;
+}
+
+int test_builtin(int argc, char* argv[])
+{
+    TestParser parser;
+    bool result;
+
+    if (strcmp(argv[0], "[") == 0) {
+        if (strcmp(argv[argc - 1], "]") != 0) {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    parser.argv = argv + 1;
+    parser.argc = argc - 1;
+    parser.pos = 0;
+    parser.error = false;
+
+    if (parser.argc == 0) {
+        return EXIT_FAILURE;
+    }
+
+    result = test_or(&parser);
+
+    if (!parser.error && parser.pos < parser.argc) {
+        fprintf(stderr, "test: %s: unexpected argument\n", parser.argv[parser.pos]);
+        parser.error = true;
+    }
+
+    if (parser.error) {
+        return 2;
+    }
+
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/******************************************************************************
+ * cat file ...: the shell only runs it for plain files, copying them in the
+ * kernel where it can
+ *****************************************************************************/
+#define COPY_CHUNK      (1 << 30)
+#define COPY_BUF_SIZE   (128 * 1024)
+
+#ifdef __linux__
+/*
+ * Move everything left in in_fd to out_fd without a user space copy:
+ * copy_file_range between files, splice into pipes and sendfile to anything
+ * else. Returns -1 with errno set, 0 when done, 1 when this kind of copy is
+ * not supported for the pair, leaving the rest to read/write.
+ */
+int copy_in_kernel(int in_fd, int out_fd, struct stat* out_st)
+{
+    int flags = fcntl(out_fd, F_GETFL), result = 1;
+    ssize_t count;
+
+    /*
+     * copy_file_range and splice refuse O_APPEND, and the description may be
+     * shared with other writers: only write() appends atomically
+     */
+    if (flags < 0 || (flags & O_APPEND)) {
+        return 1;
+    }
+
+    for (;;) {
+        if (S_ISREG(out_st->st_mode)) {
+            count = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+        } else if (S_ISFIFO(out_st->st_mode)) {
+            count = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            count = sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+        }
+
+        if (count > 0) {
+            result = 0;  /* whatever comes next, the fallback continues from the offsets */
+            continue;
+        }
+        if (count == 0) {
+            result = 0;
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF) {
+            result = 1;
+        } else {
+            result = -1;
+        }
+        break;
+    }
+
+    return result;
+}
+#endif
+
+/* copy in_fd to out_fd until EOF, false with errno set on failure */
+bool copy_fd(int in_fd, int out_fd)
+{
+    static char* buf = NULL;
+    struct stat out_st;
+    ssize_t count;
+
+    if (fstat(out_fd, &out_st) < 0) {
+        return false;
+    }
+
+#ifdef __linux__
+    switch (copy_in_kernel(in_fd, out_fd, &out_st)) {
+        case 0: return true;
+        case -1: return false;
+        default: break;
+    }
+#endif
+
+    if (buf == NULL) {
+        buf = (char*)malloc(COPY_BUF_SIZE);
+    }
+
+    while ((count = read(in_fd, buf, COPY_BUF_SIZE)) != 0) {
+        char* p = buf;
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0) {
+            ssize_t written = write(out_fd, p, count);
+
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            p += written;
+            count -= written;
+        }
+    }
+
+    return true;
+}
+
+/* the files are copied to stdout in order, stdin when none is given */
+int cat_builtin(int argc, char* argv[])
+{
+    struct stat out_st, in_st;
+    int i, status = EXIT_SUCCESS;
+    bool out_is_file = (fstat(STDOUT_FILENO, &out_st) == 0 && S_ISREG(out_st.st_mode));
+
+    for (i = (argc > 1) ? 1 : 0; i < argc; i++) {
+        const char* name = (i == 0) ? "-" : argv[i];
+        int fd = (i == 0) ? STDIN_FILENO : open(name, O_RDONLY);
+
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+
+        if (out_is_file && fstat(fd, &in_st) == 0 && in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino
+            && in_st.st_size > 0) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            status = EXIT_FAILURE;
+        } else if (!copy_fd(fd, STDOUT_FILENO)) {
+            if (errno == EPIPE) {
+                /* the real cat would have died of SIGPIPE, quietly */
+                status = 128 + SIGPIPE;
+                i = argc;
+            } else {
+                fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+                status = EXIT_FAILURE;
+            }
+        }
+
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,15 @@
+#ifndef _BUILTIN_H_
+#define _BUILTIN_H_
+
+#include "parse.h"
+
+/******************************************************************************
+ * Utility builtins: run inside the shell process, write to stdout and
+ * return the exit status
+ *****************************************************************************/
+int echo_builtin(int argc, char* argv[]);
+int printf_builtin(int argc, char* argv[]);
+int test_builtin(int argc, char* argv[]);
+int cat_builtin(int argc, char* argv[]);
+
+#endif /* _BUILTIN_H_ */
@@ -0,0 +1,704 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "editor.h"
+
+/******************************************************************************
+ * Command index
+ *****************************************************************************/
+void init_command_index(CommandIndex* index)
+{
+    memset(index, 0, sizeof(CommandIndex));
+}
+
+void clear_command_names(CommandIndex* index)
+{
+    int i;
+
+    for (i = 0; i < index->count; i++) {
+        free(index->names[i]);
+    }
+    index->count = 0;
+}
+
+void free_command_index(CommandIndex* index)
+{
+    clear_command_names(index);
+    free(index->names);
+    free(index->mtimes);
+    free(index->path);
+    init_command_index(index);
+}
+
+int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* copy directory i of path to dir, false past the last one */
+int split_path(const char* path, char* dir, int i)
+{
+    const char* start = path;
+    size_t len;
+
+    for (; i > 0 && start != NULL; i--) {
+        start = strchr(start, ':');
+        start = (start != NULL) ? start + 1 : NULL;
+    }
+    if (start == NULL) {
+        return false;
+    }
+
+    len = strcspn(start, ":");
+    len = (len < BUF_SIZE - 1) ? len : BUF_SIZE - 1;
+    memcpy(dir, start, len);
+    dir[len] = '\0';
+    if (len == 0) {
+        strcpy(dir, ".");  /* an empty entry is the current directory */
+    }
+
+    return true;
+}
+
+/* whether the directories of path still have the modification times seen at the last build */
+bool command_index_current(CommandIndex* index, const char* path)
+{
+    char dir[BUF_SIZE];
+    int i;
+
+    if (index->path == NULL || strcmp(index->path, path) != 0) {
+        return false;
+    }
+    for (i = 0; i < index->dirc && split_path(path, dir, i); i++) {
+        struct stat st;
+
+        if (stat(dir, &st) < 0) {
+            memset(&st.st_mtim, 0, sizeof(st.st_mtim));
+        }
+        if (st.st_mtim.tv_sec != index->mtimes[i].tv_sec || st.st_mtim.tv_nsec != index->mtimes[i].tv_nsec) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void add_command_name(CommandIndex* index, const char* name)
+{
+    if (index->count == index->capacity) {
+        index->capacity = (index->capacity == 0) ? 1024 : index->capacity * 2;
+        index->names = (char**)realloc(index->names, sizeof(char*) * index->capacity);
+    }
+    index->names[index->count] = (char*)malloc(strlen(name) + 1);
+    strcpy(index->names[index->count++], name);
+}
+
+/* read every directory of $PATH again if anything changed since the last build */
+void refresh_command_index(CommandIndex* index)
+{
+    const char* path = getenv("PATH");
+    char dir[BUF_SIZE];
+    int i, unique;
+
+    path = (path != NULL) ? path : "";
+    if (command_index_current(index, path)) {
+        return;
+    }
+
+    clear_command_names(index);
+    free(index->path);
+    index->path = (char*)malloc(strlen(path) + 1);
+    strcpy(index->path, path);
+
+    for (index->dirc = 0; split_path(path, dir, index->dirc); index->dirc++) {
+        /* count the directories */
+    }
+    free(index->mtimes);
+    index->mtimes = (struct timespec*)calloc(index->dirc + 1, sizeof(struct timespec));
+
+    for (i = 0; i < index->dirc && split_path(path, dir, i); i++) {
+        struct dirent* entry;
+        struct stat st;
+        DIR* d;
+
+        /* the time is taken before reading, so an entry added meanwhile triggers another build */
+        if (stat(dir, &st) < 0 || (d = opendir(dir)) == NULL) {
+            continue;
+        }
+        index->mtimes[i] = st.st_mtim;
+
+        while ((entry = readdir(d)) != NULL) {
+            if (entry->d_name[0] == '.' || entry->d_type == DT_DIR) {
+                continue;
+            }
+            if (entry->d_type != DT_REG && (fstatat(dirfd(d), entry->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))) {
+                continue;
+            }
+            if (faccessat(dirfd(d), entry->d_name, X_OK, 0) == 0) {
+                add_command_name(index, entry->d_name);
+            }
+        }
+        closedir(d);
+    }
+
+    qsort(index->names, index->count, sizeof(char*), compare_names);
+    for (i = 0, unique = 0; i < index->count; i++) {
+        if (unique > 0 && strcmp(index->names[unique - 1], index->names[i]) == 0) {
+            free(index->names[i]);
+        } else {
+            index->names[unique++] = index->names[i];
+        }
+    }
+    index->count = unique;
+}
+
+/* the first name not sorting before prefix */
+int lower_bound_name(CommandIndex* index, const char* prefix)
+{
+    int low = 0, high = index->count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (strcmp(index->names[mid], prefix) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+
+/******************************************************************************
+ * Terminal and screen
+ *****************************************************************************/
+#define CTRL_KEY(KEY) ((KEY) & 0x1f)
+#define KEY_ESC 27
+#define KEY_BACKSPACE 127
+
+struct termios saved_termios;
+
+bool enable_raw_mode()
+{
+    struct termios raw;
+
+    if (tcgetattr(STDIN_FILENO, &saved_termios) < 0) {
+        return false;
+    }
+
+    /* bytes one at a time, no echo, and ^C/^Z/^\ arrive as keys */
+    raw = saved_termios;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    return tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == 0;
+}
+
+void disable_raw_mode()
+{
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved_termios);
+}
+
+/* a byte of input, -1 at the end of it */
+int read_key()
+{
+    unsigned char ch;
+    ssize_t count;
+
+    while ((count = read(STDIN_FILENO, &ch, 1)) < 0 && errno == EINTR) {
+        /* a child exited */
+    }
+
+    return count == 1 ? ch : -1;
+}
+
+int terminal_columns()
+{
+    struct winsize ws;
+
+    return (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0) ? ws.ws_col : 80;
+}
+
+/*
+ * Redraw the line from where its first character is on the screen. The
+ * cursor only ever moves within the line, so lines wider than the terminal
+ * are not handled.
+ */
+void refresh_line(Editor* editor)
+{
+    if (editor->shown > 0) {
+        printf("\033[%luD", (unsigned long)editor->shown);
+    }
+    fwrite(editor->buf, 1, editor->len, stdout);
+    fputs("\033[K", stdout);
+    if (editor->len > editor->pos) {
+        printf("\033[%luD", (unsigned long)(editor->len - editor->pos));
+    }
+    editor->shown = editor->pos;
+    fflush(stdout);
+}
+
+
+/******************************************************************************
+ * Editing
+ *****************************************************************************/
+void init_editor(Editor* editor, History* history, const char** builtins, void (*prompt)())
+{
+    memset(editor, 0, sizeof(Editor));
+    editor->capacity = BUF_SIZE;
+    editor->buf = (char*)malloc(editor->capacity);
+    editor->buf[0] = '\0';
+    editor->history = history;
+    editor->builtins = builtins;
+    editor->prompt = prompt;
+    init_command_index(&editor->commands);
+}
+
+void free_editor(Editor* editor)
+{
+    free(editor->buf);
+    free(editor->draft);
+    free_command_index(&editor->commands);
+}
+
+void reserve_line(Editor* editor, size_t len)
+{
+    if (len + 2 > editor->capacity) {  /* room for the newline and NUL */
+        editor->capacity = (len + 2) * 2;
+        editor->buf = (char*)realloc(editor->buf, editor->capacity);
+    }
+}
+
+void insert_text(Editor* editor, const char* text, size_t len)
+{
+    reserve_line(editor, editor->len + len);
+    memmove(editor->buf + editor->pos + len, editor->buf + editor->pos, editor->len - editor->pos + 1);
+    memcpy(editor->buf + editor->pos, text, len);
+    editor->len += len;
+    editor->pos += len;
+}
+
+void delete_text(Editor* editor, size_t from, size_t to)
+{
+    memmove(editor->buf + from, editor->buf + to, editor->len - to + 1);
+    editor->len -= to - from;
+    editor->pos = from;
+}
+
+void set_line(Editor* editor, const char* text, size_t len)
+{
+    reserve_line(editor, len);
+    memcpy(editor->buf, text, len);
+    editor->buf[len] = '\0';
+    editor->len = editor->pos = len;
+}
+
+/* step through the history, delta -1 to older entries; the new line is kept aside meanwhile */
+void browse_history(Editor* editor, int delta)
+{
+    long count = count_history(editor->history);
+    long target = (editor->browsing == 0) ? count + 1 + delta : editor->browsing + delta;
+    const char* entry;
+    size_t len;
+
+    if (target < 1 || target > count + 1 || (editor->browsing == 0 && delta > 0)) {
+        return;
+    }
+
+    if (editor->browsing == 0) {
+        free(editor->draft);
+        editor->draft = (char*)malloc(editor->len + 1);
+        strcpy(editor->draft, editor->buf);
+    }
+
+    if (target == count + 1) {
+        set_line(editor, editor->draft, strlen(editor->draft));
+        editor->browsing = 0;
+    } else if ((entry = get_history(editor->history, target, &len)) != NULL) {
+        set_line(editor, entry, len);
+        editor->browsing = target;
+    }
+}
+
+
+/******************************************************************************
+ * Tab completion: a word in command position is completed from the
+ * builtins and the command index, any other word, or one with a slash, from
+ * the directory it names
+ *****************************************************************************/
+#define WORD_BREAKS " \t|;&<>"
+
+typedef struct {
+    char** items;
+    int count;
+    int capacity;
+} Candidates;
+
+void add_candidate(Candidates* candidates, const char* text, size_t len, const char* suffix)
+{
+    char* item = (char*)malloc(len + strlen(suffix) + 1);
+
+    memcpy(item, text, len);
+    strcpy(item + len, suffix);
+    if (candidates->count == candidates->capacity) {
+        candidates->capacity = (candidates->capacity == 0) ? 16 : candidates->capacity * 2;
+        candidates->items = (char**)realloc(candidates->items, sizeof(char*) * candidates->capacity);
+    }
+    candidates->items[candidates->count++] = item;
+}
+
+void complete_command(Editor* editor, const char* word, Candidates* candidates)
+{
+    size_t len = strlen(word);
+    int i;
+
+    for (i = 0; editor->builtins[i] != NULL; i++) {
+        if (strncmp(editor->builtins[i], word, len) == 0) {
+            add_candidate(candidates, editor->builtins[i], strlen(editor->builtins[i]), " ");
+        }
+    }
+
+    refresh_command_index(&editor->commands);
+    for (i = lower_bound_name(&editor->commands, word); i < editor->commands.count; i++) {
+        const char* name = editor->commands.names[i];
+
+        if (strncmp(name, word, len) != 0) {
+            break;
+        }
+        add_candidate(candidates, name, strlen(name), " ");
+    }
+}
+
+/* returns how much of each candidate is the directory, left out when listing */
+size_t complete_path(const char* word, Candidates* candidates)
+{
+    const char* slash = strrchr(word, '/');
+    size_t dir_len = (slash != NULL) ? (size_t)(slash - word) + 1 : 0;
+    const char* base = word + dir_len;
+    char dir[BUF_SIZE * 2];
+    struct dirent* entry;
+    DIR* d;
+
+    if (dir_len == 0) {
+        strcpy(dir, ".");
+    } else if (word[0] == '~' && word[1] == '/' && getenv("HOME") != NULL) {
+        sprintf(dir, "%.*s%.*s", BUF_SIZE, getenv("HOME"), (int)(dir_len - 1 < BUF_SIZE ? dir_len - 1 : BUF_SIZE), word + 1);
+    } else {
+        sprintf(dir, "%.*s", (int)(dir_len < BUF_SIZE ? dir_len : BUF_SIZE), word);
+    }
+
+    if ((d = opendir(dir)) == NULL) {
+        return dir_len;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        const char* name = entry->d_name;
+        struct stat st;
+        bool is_dir;
+
+        if (strncmp(name, base, strlen(base)) != 0 || (name[0] == '.' && base[0] != '.')
+            || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        is_dir = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+            is_dir = (fstatat(dirfd(d), name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        }
+
+        {
+            char* text = (char*)malloc(dir_len + strlen(name) + 1);
+
+            memcpy(text, word, dir_len);
+            strcpy(text + dir_len, name);
+            add_candidate(candidates, text, strlen(text), is_dir ? "/" : " ");
+            free(text);
+        }
+    }
+    closedir(d);
+
+    return dir_len;
+}
+
+/* print the candidates in columns under the line, then the prompt and the line again */
+void list_candidates(Editor* editor, Candidates* candidates, size_t skip)
+{
+    size_t width = 0;
+    int i, columns, column = 0;
+
+    for (i = 0; i < candidates->count; i++) {
+        size_t len = strlen(candidates->items[i]) - skip;
+
+        width = (len > width) ? len : width;
+    }
+    columns = terminal_columns() / (int)(width + 2);
+    columns = (columns > 0) ? columns : 1;
+
+    printf("\n");
+    for (i = 0; i < candidates->count; i++) {
+        char* item = candidates->items[i] + skip;
+        size_t len = strlen(item);
+
+        if (item[len - 1] == ' ') {
+            len--;
+        }
+        printf("%-*.*s", (int)width + 2, (int)len, item);
+        if (++column == columns || i == candidates->count - 1) {
+            printf("\n");
+            column = 0;
+        }
+    }
+
+    editor->prompt();
+    editor->shown = 0;
+}
+
+void complete_word(Editor* editor)
+{
+    Candidates candidates = {NULL, 0, 0};
+    size_t start = editor->pos, before, common, word_len, skip = 0;
+    char* word;
+    int i, unique;
+
+    while (start > 0 && strchr(WORD_BREAKS, editor->buf[start - 1]) == NULL) {
+        start--;
+    }
+    word_len = editor->pos - start;
+    word = (char*)malloc(word_len + 1);
+    memcpy(word, editor->buf + start, word_len);
+    word[word_len] = '\0';
+
+    for (before = start; before > 0 && (editor->buf[before - 1] == ' ' || editor->buf[before - 1] == '\t'); before--) {
+        /* find the character before the word */
+    }
+    if ((before == 0 || strchr("|;&", editor->buf[before - 1]) != NULL) && strchr(word, '/') == NULL) {
+        complete_command(editor, word, &candidates);
+    } else {
+        skip = complete_path(word, &candidates);
+    }
+
+    qsort(candidates.items, candidates.count, sizeof(char*), compare_names);
+    for (i = 0, unique = 0; i < candidates.count; i++) {
+        if (unique > 0 && strcmp(candidates.items[unique - 1], candidates.items[i]) == 0) {
+            free(candidates.items[i]);
+        } else {
+            candidates.items[unique++] = candidates.items[i];
+        }
+    }
+    candidates.count = unique;
+
+    if (candidates.count == 0) {
+        fputs("\a", stdout);
+    } else {
+        /* the longest prefix shared by all, with the trailing space or slash only when alone */
+        common = strlen(candidates.items[0]);
+        if (candidates.count > 1) {
+            for (i = 1; i < candidates.count; i++) {
+                size_t j = 0;
+
+                while (j < common && candidates.items[i][j] == candidates.items[0][j]) {
+                    j++;
+                }
+                common = j;
+            }
+        }
+
+        if (common > word_len) {
+            insert_text(editor, candidates.items[0] + word_len, common - word_len);
+            editor->listed = false;
+        } else if (candidates.count > 1 && editor->listed) {
+            list_candidates(editor, &candidates, skip);
+        } else {
+            fputs("\a", stdout);
+            editor->listed = true;
+        }
+    }
+
+    for (i = 0; i < candidates.count; i++) {
+        free(candidates.items[i]);
+    }
+    free(candidates.items);
+    free(word);
+}
+
+
+/******************************************************************************
+ * Reading a line
+ *****************************************************************************/
+/* what an escape sequence stands for: the key letter of an arrow, Home, End or Delete */
+int read_escape()
+{
+    int first = read_key(), second;
+
+    if (first != '[' && first != 'O') {
+        return -1;
+    }
+    second = read_key();
+    if (isdigit(second)) {
+        int last = read_key();
+
+        if (last != '~') {
+            return -1;
+        }
+        switch (second) {
+            case '1': case '7': return 'H';
+            case '4': case '8': return 'F';
+            case '3': return 'X';  /* Delete */
+            default: return -1;
+        }
+    }
+
+    return second;
+}
+
+char* edit_line(Editor* editor)
+{
+    bool done = false, eof = false;
+
+    if (!isatty(STDIN_FILENO) || !enable_raw_mode()) {
+        size_t capacity = editor->capacity;
+        ssize_t len = getline(&editor->buf, &capacity, stdin);
+
+        editor->capacity = capacity;
+        return len < 0 ? NULL : editor->buf;
+    }
+
+    editor->len = editor->pos = editor->shown = 0;
+    editor->buf[0] = '\0';
+    editor->browsing = 0;
+    editor->listed = false;
+    fflush(stdout);
+
+    while (!done) {
+        int key = read_key();
+        bool tab = false;
+        size_t i;
+
+        switch (key) {
+            case -1:
+                eof = done = true;
+                break;
+            case '\r':
+            case '\n':
+                done = true;
+                break;
+            case CTRL_KEY('d'):
+                if (editor->len == 0) {
+                    eof = done = true;
+                } else if (editor->pos < editor->len) {
+                    delete_text(editor, editor->pos, editor->pos + 1);
+                }
+                break;
+            case CTRL_KEY('c'):
+                fputs("^C", stdout);
+                editor->len = editor->pos = 0;
+                editor->buf[0] = '\0';
+                done = true;
+                break;
+            case KEY_BACKSPACE:
+            case CTRL_KEY('h'):
+                if (editor->pos > 0) {
+                    delete_text(editor, editor->pos - 1, editor->pos);
+                }
+                break;
+            case CTRL_KEY('a'):
+                editor->pos = 0;
+                break;
+            case CTRL_KEY('e'):
+                editor->pos = editor->len;
+                break;
+            case CTRL_KEY('b'):
+                editor->pos -= (editor->pos > 0);
+                break;
+            case CTRL_KEY('f'):
+                editor->pos += (editor->pos < editor->len);
+                break;
+            case CTRL_KEY('p'):
+                browse_history(editor, -1);
+                break;
+            case CTRL_KEY('n'):
+                browse_history(editor, 1);
+                break;
+            case CTRL_KEY('k'):
+                delete_text(editor, editor->pos, editor->len);
+                break;
+            case CTRL_KEY('u'):
+                delete_text(editor, 0, editor->pos);
+                break;
+            case CTRL_KEY('w'):
+                for (i = editor->pos; i > 0 && editor->buf[i - 1] == ' '; i--) {
+                    /* spaces before the cursor */
+                }
+                for (; i > 0 && editor->buf[i - 1] != ' '; i--) {
+                    /* then the word */
+                }
+                delete_text(editor, i, editor->pos);
+                break;
+            case '\t':
+                complete_word(editor);
+                tab = true;
+                break;
+            case KEY_ESC:
+                switch (read_escape()) {
+                    case 'A': browse_history(editor, -1); break;
+                    case 'B': browse_history(editor, 1); break;
+                    case 'C': editor->pos += (editor->pos < editor->len); break;
+                    case 'D': editor->pos -= (editor->pos > 0); break;
+                    case 'H': editor->pos = 0; break;
+                    case 'F': editor->pos = editor->len; break;
+                    case 'X':
+                        if (editor->pos < editor->len) {
+                            delete_text(editor, editor->pos, editor->pos + 1);
+                        }
+                        break;
+                    default: break;
+                }
+                break;
+            default:
+                if (key >= ' ') {
+                    char ch = (char)key;
+
+                    insert_text(editor, &ch, 1);
+                }
+                break;
+        }
+
+        if (!tab) {
+            editor->listed = false;
+        }
+        if (!done) {
+            refresh_line(editor);
+        }
+    }
+
+    /* leave the cursor after the line, like the terminal would */
+    editor->pos = editor->len;
+    refresh_line(editor);
+    fputs("\r\n", stdout);
+    fflush(stdout);
+    disable_raw_mode();
+
+    if (eof && editor->len == 0) {
+        return NULL;
+    }
+    editor->buf[editor->len] = '\n';
+    editor->buf[editor->len + 1] = '\0';
+
+    return editor->buf;
+}
@@ -0,0 +1,57 @@
+#ifndef _EDITOR_H_
+#define _EDITOR_H_
+
+#include <termios.h>
+#include <time.h>
+
+#include "parse.h"
+#include "history.h"
+
+/******************************************************************************
+ * Command index: the executables of $PATH as one sorted array, built on the
+ * first completion. It is only rebuilt when $PATH or the modification time
+ * of one of its directories changed, so a keypress costs one stat per
+ * directory and a binary search.
+ *****************************************************************************/
+typedef struct {
+    char* path;  /* $PATH the index was built from, NULL before the first build */
+    struct timespec* mtimes;  /* of every directory of path, zero for a missing one */
+    int dirc;
+    char** names;  /* sorted, without duplicates */
+    int count;
+    int capacity;
+} CommandIndex;
+
+void init_command_index(CommandIndex* index);
+void free_command_index(CommandIndex* index);
+void refresh_command_index(CommandIndex* index);
+
+/******************************************************************************
+ * Line editor for terminals: emacs-style keys, history browsing with the
+ * arrows and tab completion of commands and paths. The terminal is only in
+ * raw mode while a line is being read.
+ *****************************************************************************/
+typedef struct {
+    char* buf;  /* the line being edited, always NUL-terminated */
+    size_t len;
+    size_t pos;  /* cursor, as an offset in buf */
+    size_t capacity;
+    size_t shown;  /* where the terminal cursor is, as an offset in buf */
+
+    History* history;
+    long browsing;  /* history entry shown, 0 while editing a new line */
+    char* draft;  /* the new line, saved while browsing */
+
+    const char** builtins;  /* completed like commands */
+    void (*prompt)();  /* prints the prompt again after a completion listing */
+    CommandIndex commands;
+    bool listed;  /* the last key was a tab that could not complete more */
+} Editor;
+
+void init_editor(Editor* editor, History* history, const char** builtins, void (*prompt)());
+void free_editor(Editor* editor);
+
+/* read one line with its newline, NULL at the end of the input; valid until the next call */
+char* edit_line(Editor* editor);
+
+#endif /* _EDITOR_H_ */
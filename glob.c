@@ -0,0 +1,564 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "glob.h"
+
+#define GLOB_PATH_SIZE 4096
+
+/******************************************************************************
+ * Directory listings, read once per line
+ *****************************************************************************/
+void init_glob_cache(GlobCache* cache, Arena* arena)
+{
+    memset(cache->buckets, 0, sizeof(cache->buckets));
+    cache->arena = arena;
+}
+
+void free_glob_cache(GlobCache* cache)
+{
+    int i;
+
+    for (i = 0; i < GLOB_CACHE_BUCKETS; i++) {
+        DirListing* listing;
+
+        for (listing = cache->buckets[i]; listing != NULL; listing = listing->next) {
+            free(listing->entries);
+            free(listing->names);
+        }
+        cache->buckets[i] = NULL;
+    }
+}
+
+typedef struct {
+    size_t names_len;
+    size_t names_capacity;
+    int entries_capacity;
+} ListingBuilder;
+
+void add_dir_entry(DirListing* listing, ListingBuilder* builder, const char* name, unsigned char type)
+{
+    size_t len = strlen(name) + 1;
+
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        return;  /* never matched */
+    }
+    if (listing->count == builder->entries_capacity) {
+        builder->entries_capacity = (builder->entries_capacity == 0) ? 64 : builder->entries_capacity * 2;
+        listing->entries = (DirEntry*)realloc(listing->entries, sizeof(DirEntry) * builder->entries_capacity);
+    }
+    if (builder->names_len + len > builder->names_capacity) {
+        builder->names_capacity = (builder->names_len + len) * 2;
+        listing->names = (char*)realloc(listing->names, builder->names_capacity);
+    }
+
+    memcpy(listing->names + builder->names_len, name, len);
+    listing->entries[listing->count].name = builder->names_len;
+    listing->entries[listing->count].type = type;
+    listing->count++;
+    builder->names_len += len;
+}
+
+#ifdef __linux__
+/* the kernel's struct linux_dirent64: two 64-bit fields, then these */
+#define DIRENT64_RECLEN(P)  (*(unsigned short*)((P) + 16))
+#define DIRENT64_TYPE(P)    (*(unsigned char*)((P) + 18))
+#define DIRENT64_NAME(P)    ((P) + 19)
+
+bool read_listing(DirListing* listing, ListingBuilder* builder, const char* dir)
+{
+    static char* buf = NULL;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    long count;
+
+    if (fd < 0) {
+        return false;
+    }
+    if (buf == NULL) {
+        buf = (char*)malloc(GLOB_READ_SIZE);
+    }
+
+    while ((count = syscall(SYS_getdents64, fd, buf, GLOB_READ_SIZE)) > 0) {
+        char* p;
+
+        for (p = buf; p < buf + count; p += DIRENT64_RECLEN(p)) {
+            add_dir_entry(listing, builder, DIRENT64_NAME(p), DIRENT64_TYPE(p));
+        }
+    }
+    close(fd);
+
+    return count == 0;
+}
+#else
+bool read_listing(DirListing* listing, ListingBuilder* builder, const char* dir)
+{
+    DIR* d = opendir(dir);
+    struct dirent* entry;
+
+    if (d == NULL) {
+        return false;
+    }
+    while ((entry = readdir(d)) != NULL) {
+        add_dir_entry(listing, builder, entry->d_name, entry->d_type);
+    }
+    closedir(d);
+
+    return true;
+}
+#endif
+
+/* the entries of dir, "" for the current directory */
+DirListing* get_listing(GlobCache* cache, const char* dir)
+{
+    unsigned long bucket = strhash(dir) % GLOB_CACHE_BUCKETS;
+    ListingBuilder builder = {0, 0, 0};
+    DirListing* listing;
+
+    for (listing = cache->buckets[bucket]; listing != NULL; listing = listing->next) {
+        if (strcmp(listing->path, dir) == 0) {
+            return listing;
+        }
+    }
+
+    listing = (DirListing*)arena_alloc(cache->arena, sizeof(DirListing));
+    listing->path = arena_strdup(cache->arena, dir);
+    listing->entries = NULL;
+    listing->names = NULL;
+    listing->count = 0;
+    listing->readable = read_listing(listing, &builder, *dir != '\0' ? dir : ".");
+    listing->next = cache->buckets[bucket];
+    cache->buckets[bucket] = listing;
+
+    return listing;
+}
+
+
+/******************************************************************************
+ * Patterns: each path component is compiled once into match operations
+ *****************************************************************************/
+typedef enum {
+    match_char,
+    match_any,  /* ? */
+    match_star,  /* * */
+    match_set  /* [...] */
+} MatchType;
+
+typedef struct {
+    MatchType type;
+    unsigned char ch;
+    unsigned char* set;  /* 256 bits */
+} MatchOp;
+
+typedef struct {
+    MatchOp* ops;
+    int count;
+    bool literal;  /* nothing to match, text is the name */
+    char* text;  /* the component with its quoted glob characters restored */
+} Component;
+
+/* the literal character behind a pattern byte */
+unsigned char pattern_char(char ch)
+{
+    const char* quoted = (ch != '\0') ? strchr(QUOTED_GLOB_CHARS, ch) : NULL;
+
+    return (unsigned char)((quoted != NULL) ? GLOB_CHARS[quoted - QUOTED_GLOB_CHARS] : ch);
+}
+
+void set_add(unsigned char* set, unsigned ch)
+{
+    set[ch >> 3] |= (unsigned char)(1 << (ch & 7));
+}
+
+bool set_has(const unsigned char* set, unsigned ch)
+{
+    return (set[ch >> 3] >> (ch & 7)) & 1;
+}
+
+/* the characters of [:name:] */
+bool add_char_class(unsigned char* set, const char* name, size_t len)
+{
+    const char* names[] = {"alpha", "digit", "alnum", "upper", "lower", "space", "punct", "xdigit", NULL};
+    int (*tests[])(int) = {isalpha, isdigit, isalnum, isupper, islower, isspace, ispunct, isxdigit};
+    int i;
+    unsigned ch;
+
+    for (i = 0; names[i] != NULL; i++) {
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0) {
+            for (ch = 1; ch < 256; ch++) {
+                if (tests[i]((int)ch)) {
+                    set_add(set, ch);
+                }
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* compile the bracket expression at p, returning what follows it, NULL if it is no bracket expression */
+const char* compile_set(const char* p, const char* end, unsigned char* set)
+{
+    bool negate = false, first = true;
+    int i;
+
+    memset(set, 0, 32);
+    p++;
+    if (p < end && (*p == '!' || *p == '^')) {
+        negate = true;
+        p++;
+    }
+
+    for (; p < end && (*p != ']' || first); first = false) {
+        if (p[0] == '[' && p + 1 < end && p[1] == ':') {
+            const char* close = p + 2;
+
+            while (close + 1 < end && !(close[0] == ':' && close[1] == ']')) {
+                close++;
+            }
+            if (close + 1 < end && add_char_class(set, p + 2, close - p - 2)) {
+                p = close + 2;
+                continue;
+            }
+        }
+        if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+            unsigned ch, low = pattern_char(p[0]), high = pattern_char(p[2]);
+
+            for (ch = low; ch <= high; ch++) {
+                set_add(set, ch);
+            }
+            p += 3;
+        } else {
+            set_add(set, pattern_char(*p));
+            p++;
+        }
+    }
+
+    if (p >= end) {
+        return NULL;
+    }
+    if (negate) {
+        for (i = 0; i < 32; i++) {
+            set[i] = (unsigned char)~set[i];
+        }
+    }
+
+    return p + 1;
+}
+
+void compile_component(Arena* arena, const char* start, const char* end, Component* component)
+{
+    const char* p = start;
+
+    component->ops = (MatchOp*)arena_alloc(arena, sizeof(MatchOp) * (end - start + 1));
+    component->count = 0;
+    component->literal = true;
+    component->text = arena_strndup(arena, start, end - start);
+    unquote_pattern(component->text, component->text);
+
+    while (p < end) {
+        MatchOp* op = &component->ops[component->count];
+        const char* next;
+
+        op->type = match_char;
+        op->ch = pattern_char(*p);
+        op->set = NULL;
+
+        if (*p == '*') {
+            op->type = match_star;
+            while (p < end && *p == '*') {
+                p++;
+            }
+            component->literal = false;
+        } else if (*p == '?') {
+            op->type = match_any;
+            p++;
+            component->literal = false;
+        } else if (*p == '[' && (op->set = (unsigned char*)arena_alloc(arena, 32)) != NULL
+            && (next = compile_set(p, end, op->set)) != NULL) {
+            op->type = match_set;
+            p = next;
+            component->literal = false;
+        } else {
+            p++;
+        }
+        component->count++;
+    }
+}
+
+/* match a whole name, backtracking to the last star only */
+bool match_component(Component* component, const char* name)
+{
+    MatchOp* ops = component->ops;
+    int i = 0, star = -1;
+    const char* star_name = NULL;
+
+    /* a leading dot must be matched by a dot */
+    if (name[0] == '.' && !(component->count > 0 && ops[0].type == match_char && ops[0].ch == '.')) {
+        return false;
+    }
+
+    while (*name != '\0') {
+        if (i < component->count) {
+            MatchOp* op = &ops[i];
+            unsigned char ch = (unsigned char)*name;
+
+            if (op->type == match_star) {
+                star = i++;
+                star_name = name;
+                continue;
+            }
+            if ((op->type == match_any) || (op->type == match_char && op->ch == ch)
+                || (op->type == match_set && set_has(op->set, ch))) {
+                i++;
+                name++;
+                continue;
+            }
+        }
+        if (star < 0) {
+            return false;
+        }
+        i = star + 1;
+        name = ++star_name;
+    }
+
+    while (i < component->count && ops[i].type == match_star) {
+        i++;
+    }
+
+    return i == component->count;
+}
+
+
+/******************************************************************************
+ * Expansion
+ *****************************************************************************/
+typedef struct {
+    char** items;
+    int count;
+    int capacity;
+} PathList;
+
+void add_path(PathList* list, const char* path, size_t len)
+{
+    char* item = (char*)malloc(len + 1);
+
+    memcpy(item, path, len);
+    item[len] = '\0';
+    if (list->count == list->capacity) {
+        list->capacity = (list->capacity == 0) ? 16 : list->capacity * 2;
+        list->items = (char**)realloc(list->items, sizeof(char*) * list->capacity);
+    }
+    list->items[list->count++] = item;
+}
+
+int compare_paths(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+typedef struct {
+    GlobCache* cache;
+    Component* components;
+    int count;
+    bool dirs_only;  /* the pattern ends with a slash */
+    char path[GLOB_PATH_SIZE];  /* the matched prefix, with its trailing slash */
+    PathList* matches;
+} GlobWalk;
+
+bool is_directory(GlobWalk* walk, size_t len, const char* name, unsigned char type)
+{
+    struct stat st;
+
+    if (type == DT_DIR) {
+        return true;
+    }
+    if (type != DT_LNK && type != DT_UNKNOWN) {
+        return false;
+    }
+    if (len + strlen(name) + 1 > GLOB_PATH_SIZE) {
+        return false;
+    }
+    strcpy(walk->path + len, name);
+
+    return stat(walk->path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* match component i below the directory in walk->path[0..len) */
+void walk_component(GlobWalk* walk, int i, size_t len)
+{
+    Component* component = &walk->components[i];
+    bool last = (i == walk->count - 1);
+    DirListing* listing;
+    int j;
+
+    if (component->literal) {
+        size_t text_len = strlen(component->text);
+        struct stat st;
+
+        if (len + text_len + 2 > GLOB_PATH_SIZE) {
+            return;
+        }
+        memcpy(walk->path + len, component->text, text_len + 1);
+        len += text_len;
+
+        if (!last) {
+            walk->path[len++] = '/';
+            walk->path[len] = '\0';
+            walk_component(walk, i + 1, len);
+        } else if (!walk->dirs_only && lstat(walk->path, &st) == 0) {
+            add_path(walk->matches, walk->path, len);
+        } else if (walk->dirs_only && stat(walk->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            walk->path[len++] = '/';
+            add_path(walk->matches, walk->path, len);
+        }
+        return;
+    }
+
+    walk->path[len] = '\0';
+    listing = get_listing(walk->cache, walk->path);
+
+    for (j = 0; j < listing->count; j++) {
+        DirEntry* entry = &listing->entries[j];
+        const char* name = listing->names + entry->name;
+        size_t name_len;
+
+        if (!match_component(component, name)) {
+            continue;
+        }
+
+        name_len = strlen(name);
+        if (len + name_len + 2 > GLOB_PATH_SIZE) {
+            continue;
+        }
+        if (last && !walk->dirs_only) {
+            memcpy(walk->path + len, name, name_len);
+            add_path(walk->matches, walk->path, len + name_len);
+        } else if (is_directory(walk, len, name, entry->type)) {
+            memcpy(walk->path + len, name, name_len);
+            walk->path[len + name_len] = '/';
+            walk->path[len + name_len + 1] = '\0';
+            if (last) {
+                add_path(walk->matches, walk->path, len + name_len + 1);
+            } else {
+                walk_component(walk, i + 1, len + name_len + 1);
+            }
+        }
+    }
+}
+
+/* add the sorted matches of pattern to matches, returns how many */
+int expand_pattern(GlobCache* cache, const char* pattern, PathList* matches)
+{
+    GlobWalk* walk = (GlobWalk*)malloc(sizeof(GlobWalk));
+    const char* p = pattern;
+    int capacity = 1, first = matches->count, i;
+    bool literal = true;
+
+    for (i = 0; pattern[i] != '\0'; i++) {
+        capacity += (pattern[i] == '/');
+    }
+
+    walk->cache = cache;
+    walk->components = (Component*)arena_alloc(cache->arena, sizeof(Component) * capacity);
+    walk->count = 0;
+    walk->matches = matches;
+    walk->path[0] = '\0';
+    if (*p == '/') {
+        strcpy(walk->path, "/");
+    }
+
+    /* one component between every run of slashes */
+    while (*p != '\0') {
+        const char* end;
+
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        end = p + strcspn(p, "/");
+        compile_component(cache->arena, p, end, &walk->components[walk->count]);
+        literal = literal && walk->components[walk->count].literal;
+        walk->count++;
+        p = end;
+    }
+    walk->dirs_only = (p > pattern && p[-1] == '/');
+
+    /* a word like [ has no real glob character: no need to look at the disk */
+    if (!literal && walk->count > 0) {
+        walk_component(walk, 0, strlen(walk->path));
+        qsort(matches->items + first, matches->count - first, sizeof(char*), compare_paths);
+    }
+    free(walk);
+
+    return matches->count - first;
+}
+
+bool has_patterns(CommandLine* command_line)
+{
+    int i;
+
+    for (i = 0; i < command_line->cmdc; i++) {
+        if (command_line->cmdv[i].patterns != NULL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+CommandLine* expand_command_line(GlobCache* cache, CommandLine* src, CommandLine* dest)
+{
+    int i, j;
+
+    *dest = *src;
+    dest->cmdv = (Command*)arena_alloc(cache->arena, sizeof(Command) * src->cmdc);
+    memcpy(dest->cmdv, src->cmdv, sizeof(Command) * src->cmdc);
+
+    for (i = 0; i < dest->cmdc; i++) {
+        Command* cmd = &dest->cmdv[i];
+        PathList args = {NULL, 0, 0};
+
+        if (cmd->patterns == NULL) {
+            continue;
+        }
+
+        for (j = 0; j < cmd->argc; j++) {
+            const char* arg = cmd->argv[j];
+
+            if (!cmd->patterns[j] || expand_pattern(cache, arg, &args) == 0) {
+                add_path(&args, arg, strlen(arg));
+                if (cmd->patterns[j]) {
+                    unquote_pattern(args.items[args.count - 1], arg);
+                }
+            }
+        }
+
+        cmd->argv = (char**)arena_alloc(cache->arena, sizeof(char*) * (args.count + 1));
+        for (j = 0; j < args.count; j++) {
+            cmd->argv[j] = arena_strdup(cache->arena, args.items[j]);
+            free(args.items[j]);
+        }
+        cmd->argv[args.count] = NULL;
+        cmd->argc = args.count;
+        cmd->patterns = NULL;
+        free(args.items);
+    }
+
+    return dest;
+}
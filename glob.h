@@ -0,0 +1,46 @@
+#ifndef _GLOB_H_
+#define _GLOB_H_
+
+#include "parse.h"
+
+/******************************************************************************
+ * Pathname expansion. Every directory a line looks into is read once, in
+ * large getdents64 batches, and its listing is shared by all patterns of the
+ * line. Entry types come from the listing, so matching never stats an entry
+ * unless the file system leaves its type unknown.
+ *****************************************************************************/
+#define GLOB_CACHE_BUCKETS  64
+#define GLOB_READ_SIZE      (256 * 1024)
+
+typedef struct {
+    size_t name;  /* offset of the name in the listing's names */
+    unsigned char type;  /* DT_* of the entry */
+} DirEntry;
+
+typedef struct DirListing {
+    struct DirListing* next;  /* in the same bucket */
+    char* path;
+    bool readable;
+    DirEntry* entries;
+    int count;
+    char* names;
+} DirListing;
+
+typedef struct {
+    DirListing* buckets[GLOB_CACHE_BUCKETS];
+    Arena* arena;  /* holds the listings and the expanded commands */
+} GlobCache;
+
+void init_glob_cache(GlobCache* cache, Arena* arena);
+void free_glob_cache(GlobCache* cache);
+
+bool has_patterns(CommandLine* command_line);
+
+/*
+ * The command line with every pattern replaced by the sorted paths it
+ * matches, or kept literally if it matches none. Commands without patterns
+ * are shared with src; the rest is built in dest and the cache's arena.
+ */
+CommandLine* expand_command_line(GlobCache* cache, CommandLine* src, CommandLine* dest);
+
+#endif /* _GLOB_H_ */
@@ -0,0 +1,501 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "history.h"
+
+/******************************************************************************
+ * Log file and entries
+ *****************************************************************************/
+void init_history(History* history)
+{
+    memset(history, 0, sizeof(History));
+    history->fd = -1;
+    history->base = -1;
+}
+
+/* map the whole log again, after it grew past the current mapping */
+bool map_history(History* history)
+{
+    struct stat st;
+    char* map;
+
+    if (history->fd < 0 || fstat(history->fd, &st) < 0) {
+        return false;
+    }
+    if ((size_t)st.st_size <= history->map_len) {
+        return true;
+    }
+
+    map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history->fd, 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (history->map != NULL) {
+        munmap(history->map, history->map_len);
+    }
+    history->map = map;
+    history->map_len = st.st_size;
+
+    return true;
+}
+
+/* open or create the log; only its size is looked at here */
+bool open_history(History* history, const char* path)
+{
+    history->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (history->fd < 0) {
+        return false;
+    }
+    if (history->fd < SHELL_FD_BASE) {
+        /* out of the way of `exec 3>file` */
+        int fd = fcntl(history->fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+
+        close(history->fd);
+        history->fd = fd;
+    }
+
+    map_history(history);
+    history->base_len = history->map_len;
+
+    return true;
+}
+
+void free_history(History* history)
+{
+    size_t i;
+    int j;
+
+    if (history->fd >= 0) {
+        close(history->fd);
+    }
+    if (history->map != NULL) {
+        munmap(history->map, history->map_len);
+    }
+    for (j = 0; j < HISTORY_RING; j++) {
+        free(history->ring[j]);
+    }
+    for (i = 0; i < history->buckets; i++) {
+        free(history->postings[i].ids);
+    }
+    free(history->lines);
+    free(history->offsets);
+    free(history->keys);
+    free(history->postings);
+
+    init_history(history);
+}
+
+/* find where every line of the log as it was at startup begins, once */
+void count_base_lines(History* history)
+{
+    size_t pos = 0, capacity = 1024;
+    long count = 0;
+
+    if (history->base >= 0) {
+        return;
+    }
+
+    history->lines = (size_t*)malloc(sizeof(size_t) * capacity);
+    while (pos < history->base_len) {
+        char* newline = (char*)memchr(history->map + pos, '\n', history->base_len - pos);
+
+        if (count == (long)capacity) {
+            capacity *= 2;
+            history->lines = (size_t*)realloc(history->lines, sizeof(size_t) * capacity);
+        }
+        history->lines[count++] = pos;
+        pos = (newline != NULL) ? (size_t)(newline - history->map) + 1 : history->base_len;
+    }
+    history->base = count;
+}
+
+long count_history(History* history)
+{
+    count_base_lines(history);
+
+    return history->base + history->added;
+}
+
+/* the line of the log starting at pos, without its newline */
+const char* log_line(History* history, size_t pos, size_t limit, size_t* len)
+{
+    char* newline;
+
+    if (pos >= limit) {
+        return NULL;
+    }
+    newline = (char*)memchr(history->map + pos, '\n', limit - pos);
+    *len = (newline != NULL) ? (size_t)(newline - history->map) - pos : limit - pos;
+
+    return history->map + pos;
+}
+
+/* entry s of this session (from 0), in the ring or back in the log */
+const char* session_entry(History* history, long s, size_t* len)
+{
+    if (s < 0 || s >= history->added) {
+        return NULL;
+    }
+    if (s >= history->added - HISTORY_RING) {
+        const char* line = history->ring[s % HISTORY_RING];
+
+        *len = strlen(line);
+        return line;
+    }
+    if (history->offsets[s] < 0) {
+        return NULL;
+    }
+    if ((size_t)history->offsets[s] >= history->map_len) {
+        map_history(history);
+    }
+
+    return log_line(history, history->offsets[s], history->map_len, len);
+}
+
+/* entry n (from 1) with its length, NULL if there is none */
+const char* get_history(History* history, long n, size_t* len)
+{
+    count_base_lines(history);
+
+    if (n >= 1 && n <= history->base) {
+        return log_line(history, history->lines[n - 1], history->base_len, len);
+    }
+
+    return session_entry(history, n - history->base - 1, len);
+}
+
+void index_entry(History* history, long n, const char* text, size_t len);
+
+void add_history(History* history, const char* line, size_t len)
+{
+    long s = history->added;
+    char* copy = (char*)malloc(len + 2);
+
+    memcpy(copy, line, len);
+    copy[len] = '\n';
+
+    if (s == history->offsets_capacity) {
+        history->offsets_capacity = (s == 0) ? 256 : s * 2;
+        history->offsets = (off_t*)realloc(history->offsets, sizeof(off_t) * history->offsets_capacity);
+    }
+
+    /* one write per line: the log stays whole with several shells appending to it */
+    history->offsets[s] = -1;
+    if (history->fd >= 0 && write(history->fd, copy, len + 1) == (ssize_t)(len + 1)) {
+        /* with O_APPEND, the offset is at the end of what was just written */
+        history->offsets[s] = lseek(history->fd, 0, SEEK_CUR) - (off_t)(len + 1);
+    }
+
+    copy[len] = '\0';
+    free(history->ring[s % HISTORY_RING]);
+    history->ring[s % HISTORY_RING] = copy;
+    history->added++;
+
+    if (history->indexed) {
+        index_entry(history, history->base + history->added, copy, len);
+    }
+}
+
+
+/******************************************************************************
+ * Trigram index: every three bytes of an entry map to the ascending list of
+ * entries holding them. A search walks the shortest list of the trigrams of
+ * the text it looks for and only compares the entries on it.
+ *****************************************************************************/
+#define INDEX_MIN_BUCKETS 4096
+
+unsigned trigram_key(const char* p)
+{
+    return (((unsigned)(unsigned char)p[0] << 16) | ((unsigned)(unsigned char)p[1] << 8)
+        | (unsigned)(unsigned char)p[2]) + 1;
+}
+
+size_t trigram_bucket(History* history, unsigned key)
+{
+    size_t mask = history->buckets - 1;
+    size_t i = (key * 2654435761u) & mask;
+
+    while (history->keys[i] != 0 && history->keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+void grow_index(History* history)
+{
+    unsigned* old_keys = history->keys;
+    Postings* old_postings = history->postings;
+    size_t old_buckets = history->buckets, i;
+
+    history->buckets = (old_buckets == 0) ? INDEX_MIN_BUCKETS : old_buckets * 2;
+    history->keys = (unsigned*)calloc(history->buckets, sizeof(unsigned));
+    history->postings = (Postings*)calloc(history->buckets, sizeof(Postings));
+
+    for (i = 0; i < old_buckets; i++) {
+        if (old_keys[i] != 0) {
+            size_t j = trigram_bucket(history, old_keys[i]);
+
+            history->keys[j] = old_keys[i];
+            history->postings[j] = old_postings[i];
+        }
+    }
+    free(old_keys);
+    free(old_postings);
+}
+
+void index_entry(History* history, long n, const char* text, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 3 <= len; i++) {
+        unsigned key = trigram_key(text + i);
+        Postings* postings;
+        size_t j;
+
+        if ((history->used + 1) * 2 > history->buckets) {
+            grow_index(history);
+        }
+        j = trigram_bucket(history, key);
+        if (history->keys[j] == 0) {
+            history->keys[j] = key;
+            history->used++;
+        }
+
+        postings = &history->postings[j];
+        if (postings->count > 0 && postings->ids[postings->count - 1] == n) {
+            continue;  /* the trigram appears twice in this entry */
+        }
+        if (postings->count == postings->capacity) {
+            postings->capacity = (postings->capacity == 0) ? 4 : postings->capacity * 2;
+            postings->ids = (int*)realloc(postings->ids, sizeof(int) * postings->capacity);
+        }
+        postings->ids[postings->count++] = (int)n;
+    }
+}
+
+void build_index(History* history)
+{
+    long n, count = count_history(history);
+
+    for (n = 1; n <= count; n++) {
+        size_t len;
+        const char* text = get_history(history, n, &len);
+
+        if (text != NULL) {
+            index_entry(history, n, text, len);
+        }
+    }
+    history->indexed = true;
+}
+
+bool contains_text(const char* entry, size_t len, const char* text, size_t text_len)
+{
+    const char* end = entry + len;
+    const char* p = entry;
+
+    if (text_len == 0) {
+        return true;
+    }
+    while (p + text_len <= end && (p = (const char*)memchr(p, text[0], end - p - text_len + 1)) != NULL) {
+        if (memcmp(p, text, text_len) == 0) {
+            return true;
+        }
+        p++;
+    }
+
+    return false;
+}
+
+bool entry_contains(History* history, long n, const char* text, size_t text_len)
+{
+    size_t len;
+    const char* entry = get_history(history, n, &len);
+
+    return entry != NULL && contains_text(entry, len, text, text_len);
+}
+
+/* the newest entry before the given one containing text, 0 if none */
+long search_history(History* history, const char* text, long before)
+{
+    size_t text_len = strlen(text), i;
+    Postings* shortest = NULL;
+    long n;
+    int low, high;
+
+    if (text_len < 3) {
+        for (n = before - 1; n >= 1; n--) {
+            if (entry_contains(history, n, text, text_len)) {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    if (!history->indexed) {
+        build_index(history);
+    }
+    for (i = 0; i + 3 <= text_len; i++) {
+        size_t j;
+
+        if (history->buckets == 0) {
+            return 0;
+        }
+        j = trigram_bucket(history, trigram_key(text + i));
+        if (history->keys[j] == 0) {
+            return 0;  /* no entry has this trigram */
+        }
+        if (shortest == NULL || history->postings[j].count < shortest->count) {
+            shortest = &history->postings[j];
+        }
+    }
+
+    /* the first candidate at or after before, then backwards */
+    low = 0;
+    high = shortest->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+
+        if (shortest->ids[mid] < before) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    while (--low >= 0) {
+        if (entry_contains(history, shortest->ids[low], text, text_len)) {
+            return shortest->ids[low];
+        }
+    }
+
+    return 0;
+}
+
+
+/******************************************************************************
+ * History expansion and listing
+ *****************************************************************************/
+/* the newest entry starting with prefix, 0 if none */
+long search_history_prefix(History* history, const char* prefix, size_t prefix_len)
+{
+    long n;
+
+    for (n = count_history(history); n >= 1; n--) {
+        size_t len;
+        const char* entry = get_history(history, n, &len);
+
+        if (entry != NULL && len >= prefix_len && memcmp(entry, prefix, prefix_len) == 0) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+void append_text(char** dest, size_t* len, size_t* capacity, const char* text, size_t text_len)
+{
+    if (*len + text_len + 1 > *capacity) {
+        *capacity = (*len + text_len + 1) * 2;
+        *dest = (char*)realloc(*dest, *capacity);
+    }
+    memcpy(*dest + *len, text, text_len);
+    *len += text_len;
+    (*dest)[*len] = '\0';
+}
+
+int expand_history(History* history, const char* line, char** expanded)
+{
+    const char* p = line;
+    const char* copied = line;
+    char* result = NULL;
+    size_t len = 0, capacity = 0;
+    bool quoted = false;
+
+    for (; *p != '\0'; p++) {
+        const char* event = p;
+        const char* end;
+        const char* entry;
+        size_t entry_len;
+        long n = 0;
+
+        if (*p == '\'') {
+            quoted = !quoted;
+        } else if (*p == '\\' && !quoted && p[1] != '\0') {
+            p++;  /* \! stays as it is, the shell's quote removal drops the backslash */
+            continue;
+        }
+        if (quoted || *p != '!' || p[1] == '\0' || strchr(" \t\n=(", p[1]) != NULL) {
+            continue;
+        }
+
+        if (p[1] == '!') {
+            n = count_history(history);
+            end = p + 2;
+        } else if (isdigit((unsigned char)p[1]) || (p[1] == '-' && isdigit((unsigned char)p[2]))) {
+            n = strtol(p + 1, (char**)&end, 10);
+            if (n < 0) {
+                n += count_history(history) + 1;
+            }
+        } else if (p[1] == '?') {
+            char text[BUF_SIZE];
+            size_t text_len = strcspn(p + 2, "?\n");
+
+            end = p + 2 + text_len + (p[2 + text_len] == '?');
+            text_len = (text_len < BUF_SIZE) ? text_len : BUF_SIZE - 1;
+            memcpy(text, p + 2, text_len);
+            text[text_len] = '\0';
+            n = search_history(history, text, count_history(history) + 1);
+        } else {
+            size_t prefix_len = strcspn(p + 1, " \t\n;&|<>\"')");
+
+            end = p + 1 + prefix_len;
+            n = search_history_prefix(history, p + 1, prefix_len);
+        }
+
+        entry = (n >= 1) ? get_history(history, n, &entry_len) : NULL;
+        if (entry == NULL) {
+            fprintf(stderr, "%s: %.*s: event not found\n", PROGRAM_NAME, (int)(end - event), event);
+            free(result);
+            return -1;
+        }
+
+        append_text(&result, &len, &capacity, copied, event - copied);
+        append_text(&result, &len, &capacity, entry, entry_len);
+        copied = end;
+        p = end - 1;
+    }
+
+    if (result == NULL) {
+        return 0;
+    }
+    append_text(&result, &len, &capacity, copied, strlen(copied));
+    *expanded = result;
+
+    return 1;
+}
+
+/* the last entries, all of them if last <= 0, numbered like bash does */
+void print_history(History* history, long last)
+{
+    long n, count = count_history(history);
+
+    for (n = (last > 0 && last < count) ? count - last + 1 : 1; n <= count; n++) {
+        size_t len;
+        const char* entry = get_history(history, n, &len);
+
+        if (entry != NULL) {
+            printf("%5ld  %.*s\n", n, (int)len, entry);
+        }
+    }
+}
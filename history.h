@@ -0,0 +1,65 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <sys/types.h>
+
+#include "parse.h"
+
+/******************************************************************************
+ * Command history: every line typed is appended to a log file right away.
+ * The log is mapped at startup and not read further until an entry is asked
+ * for, so starting up costs the same for ten lines as for a million. Lines
+ * of this session are kept in a ring, and a trigram index built by the first
+ * search answers substring searches from then on.
+ *****************************************************************************/
+#define HISTORY_ENV     "SIMPLEBASH_HISTORY"  /* log file, empty to keep none */
+#define HISTORY_FILE    ".simplebash_history"  /* in $HOME by default */
+#define HISTORY_RING    1024
+
+typedef struct {
+    int* ids;  /* entries holding the trigram, ascending */
+    int count;
+    int capacity;
+} Postings;
+
+typedef struct {
+    int fd;  /* append-only log, -1 when history is not saved */
+    char* map;  /* the log as last mapped, NULL while empty */
+    size_t map_len;
+
+    size_t base_len;  /* bytes of the log when the shell started */
+    long base;  /* lines in those bytes, -1 until counted */
+    size_t* lines;  /* start of each of them in the log */
+
+    char* ring[HISTORY_RING];  /* text of the latest entries of this session */
+    long added;  /* entries added in this session */
+    off_t* offsets;  /* where each entry of this session starts in the log, -1 if not saved */
+    long offsets_capacity;
+
+    unsigned* keys;  /* trigram index: open addressing, 0 marks an empty bucket */
+    Postings* postings;
+    size_t buckets;
+    size_t used;
+    bool indexed;
+} History;
+
+void init_history(History* history);
+bool open_history(History* history, const char* path);
+void free_history(History* history);
+
+void add_history(History* history, const char* line, size_t len);
+
+long count_history(History* history);
+const char* get_history(History* history, long n, size_t* len);
+long search_history(History* history, const char* text, long before);
+
+/*
+ * Expand !!, !n, !-n, !?text and !prefix in line. Returns 1 and a malloc'ed
+ * line in expanded if anything was replaced, 0 if line has no event, and
+ * -1 after reporting an event which is not found.
+ */
+int expand_history(History* history, const char* line, char** expanded);
+
+void print_history(History* history, long last);
+
+#endif /* _HISTORY_H_ */
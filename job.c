@@ -0,0 +1,535 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "job.h"
+
+#define JOB_LIST_INIT_CAPACITY 16
+
+/******************************************************************************
+ * pid -> job slot map, linear probing
+ *****************************************************************************/
+unsigned long pid_bucket(JobList* list, pid_t pid)
+{
+    /* Knuth's multiplicative hash spreads the consecutive pids */
+    return ((unsigned long)pid * 2654435761UL) & (unsigned long)(list->map_capacity - 1);
+}
+
+void map_resize(JobList* list, int capacity)
+{
+    pid_t* old_pids = list->map_pids;
+    int* old_jobs = list->map_jobs;
+    int old_capacity = list->map_capacity;
+    int i;
+
+    list->map_pids = (pid_t*)calloc(capacity, sizeof(pid_t));
+    list->map_jobs = (int*)malloc(sizeof(int) * capacity);
+    list->map_capacity = capacity;
+
+    for (i = 0; i < old_capacity; i++) {
+        if (old_pids[i] > 0) {
+            unsigned long b = pid_bucket(list, old_pids[i]);
+
+            while (list->map_pids[b] != 0) {
+                b = (b + 1) & (unsigned long)(capacity - 1);
+            }
+            list->map_pids[b] = old_pids[i];
+            list->map_jobs[b] = old_jobs[i];
+        }
+    }
+
+    free(old_pids);
+    free(old_jobs);
+}
+
+void map_insert(JobList* list, pid_t pid, int idx)
+{
+    unsigned long b;
+
+    /* keep the load factor under 1/2 */
+    if ((list->map_count + 1) * 2 > list->map_capacity) {
+        map_resize(list, list->map_capacity * 2);
+    }
+
+    b = pid_bucket(list, pid);
+    while (list->map_pids[b] != 0 && list->map_pids[b] != pid) {
+        b = (b + 1) & (unsigned long)(list->map_capacity - 1);
+    }
+    if (list->map_pids[b] == 0) {
+        list->map_count++;
+    }
+    list->map_pids[b] = pid;
+    list->map_jobs[b] = idx;
+}
+
+long map_find(JobList* list, pid_t pid)
+{
+    unsigned long b = pid_bucket(list, pid);
+
+    while (list->map_pids[b] != 0) {
+        if (list->map_pids[b] == pid) {
+            return (long)b;
+        }
+        b = (b + 1) & (unsigned long)(list->map_capacity - 1);
+    }
+
+    return -1;
+}
+
+/* delete by shifting back the entries of the probe run, so no tombstones pile up */
+void map_remove(JobList* list, pid_t pid)
+{
+    unsigned long mask = (unsigned long)(list->map_capacity - 1);
+    long found = map_find(list, pid);
+    unsigned long hole, b;
+
+    if (found < 0) {
+        return;
+    }
+
+    hole = (unsigned long)found;
+    b = (hole + 1) & mask;
+    while (list->map_pids[b] != 0) {
+        unsigned long home = pid_bucket(list, list->map_pids[b]);
+
+        /* move the entry into the hole unless its home lies between them */
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            list->map_pids[hole] = list->map_pids[b];
+            list->map_jobs[hole] = list->map_jobs[b];
+            hole = b;
+        }
+        b = (b + 1) & mask;
+    }
+
+    list->map_pids[hole] = 0;
+    list->map_count--;
+}
+
+
+/******************************************************************************
+ * Job list
+ *****************************************************************************/
+void init_job_slots(JobList* list, int from)
+{
+    int i;
+
+    /* chain the new slots in ascending order in front of the free list */
+    for (i = list->capacity - 1; i >= from; i--) {
+        (list->data[i]).available = false;
+        (list->data[i]).wc = NULL;
+        (list->data[i]).cmd_str = NULL;
+        (list->data[i]).pids = NULL;
+        (list->data[i]).stats = NULL;
+        (list->data[i]).usage = NULL;
+        (list->data[i]).procc = 0;
+        (list->data[i]).running = 0;
+        (list->data[i]).job_id = i;
+        (list->data[i]).newer = -1;
+        (list->data[i]).older = -1;
+        (list->data[i]).next_free = list->free_head;
+        list->free_head = i;
+    }
+}
+
+void init_job_list(JobList* list)
+{
+    list->capacity = JOB_LIST_INIT_CAPACITY;
+    list->data = (Job*)malloc(sizeof(Job) * list->capacity);
+    list->top = -1;
+    list->free_head = -1;
+    list->recent = -1;
+    list->ended = 0;
+
+    init_job_slots(list, 0);
+
+    list->map_capacity = JOB_LIST_INIT_CAPACITY * 2;
+    list->map_pids = (pid_t*)calloc(list->map_capacity, sizeof(pid_t));
+    list->map_jobs = (int*)malloc(sizeof(int) * list->map_capacity);
+    list->map_count = 0;
+}
+
+void free_job_list(JobList* list)
+{
+    while (list->top >= 0) {
+        remove_job_list(list, list->top);
+    }
+
+    free(list->data);
+    free(list->map_pids);
+    free(list->map_jobs);
+}
+
+Job* append_job_list(JobList* list, pid_t* pids, int procc, CommandLine* cmd_ln, char* wc)
+{
+    Job* job;
+    int idx, i;
+
+    if (list->free_head < 0) {  /* table is full, double it */
+        int old_capacity = list->capacity;
+
+        list->capacity *= 2;
+        list->data = (Job*)realloc(list->data, sizeof(Job) * list->capacity);
+        init_job_slots(list, old_capacity);
+    }
+
+    idx = list->free_head;
+    job = &list->data[idx];
+    list->free_head = job->next_free;
+    if (idx > list->top) {
+        list->top = idx;
+    }
+
+    job->pids = (pid_t*)malloc(sizeof(pid_t) * procc);
+    job->stats = (int*)malloc(sizeof(int) * procc);
+    job->usage = (struct rusage*)calloc(procc, sizeof(struct rusage));
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    job->ended = job->started;
+    job->procc = procc;
+    job->running = 0;
+    for (i = 0; i < procc; i++) {
+        job->pids[i] = pids[i];
+        /* a stage that never started counts as "command not found" */
+        job->stats[i] = (pids[i] > 0) ? -1 : (127 << 8);
+        if (pids[i] > 0) {
+            job->running++;
+            map_insert(list, pids[i], idx);
+        }
+    }
+    if (job->running == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->ended);
+        list->ended++;
+    }
+    /* the parsed line is recycled for the next one, keep its text only */
+    job->cmd_str = (char*)malloc(format_command_line(NULL, cmd_ln, false) + 1);
+    format_command_line(job->cmd_str, cmd_ln, false);
+    job->wc = (char*)malloc(strlen(wc) + 1);
+    strcpy(job->wc, wc);
+    job->available = true;
+    job->scheduled = false;
+    job->quiet = false;
+
+    /* the new job becomes the current one */
+    job->newer = -1;
+    job->older = list->recent;
+    if (list->recent >= 0) {
+        (list->data[list->recent]).newer = idx;
+    }
+    list->recent = idx;
+
+    return job;
+}
+
+void remove_job_list(JobList* list, int idx)
+{
+    Job* job;
+    int i;
+
+    if (list == NULL || idx < 0 || idx > list->top || !(list->data[idx]).available) {
+        return;
+    }
+
+    job = &list->data[idx];
+    job->available = false;
+    if (job->running == 0) {
+        list->ended--;
+    }
+
+    for (i = 0; i < job->procc; i++) {
+        if (job->stats[i] == -1) {
+            map_remove(list, job->pids[i]);
+        }
+    }
+
+    free(job->pids);
+    free(job->stats);
+    free(job->usage);
+    job->pids = NULL;
+    job->stats = NULL;
+    job->usage = NULL;
+    job->procc = 0;
+    job->running = 0;
+
+    if (job->wc != NULL) {
+        free(job->wc);
+        job->wc = NULL;
+    }
+
+    if (job->cmd_str != NULL) {
+        free(job->cmd_str);
+        job->cmd_str = NULL;
+    }
+
+    /* unlink from the most-recent ordering */
+    if (job->newer >= 0) {
+        (list->data[job->newer]).older = job->older;
+    } else {
+        list->recent = job->older;
+    }
+    if (job->older >= 0) {
+        (list->data[job->older]).newer = job->newer;
+    }
+    job->newer = job->older = -1;
+
+    job->next_free = list->free_head;
+    list->free_head = idx;
+
+    while (list->top >= 0 && (list->data[list->top]).available == false) {
+        --list->top;
+    }
+}
+
+/* job by its number as shown to the user, NULL if there is none */
+Job* find_job(JobList* list, int job_id)
+{
+    if (job_id < 1 || job_id - 1 > list->top || !(list->data[job_id - 1]).available) {
+        return NULL;
+    }
+
+    return &list->data[job_id - 1];
+}
+
+/* resolve %n, %+, %% and %- */
+Job* find_job_spec(JobList* list, const char* spec)
+{
+    if (*spec == '%') {
+        spec++;
+    }
+
+    if (strcmp(spec, "+") == 0 || strcmp(spec, "%") == 0 || *spec == '\0') {
+        return list->recent >= 0 ? &list->data[list->recent] : NULL;
+    } else if (strcmp(spec, "-") == 0) {
+        int older = list->recent >= 0 ? (list->data[list->recent]).older : -1;
+
+        return older >= 0 ? &list->data[older] : NULL;
+    }
+
+    return find_job(list, atoi(spec));
+}
+
+/* job with a stage of the given pid, NULL if there is none */
+Job* find_job_pid(JobList* list, pid_t pid)
+{
+    long bucket = map_find(list, pid);
+    int i, j;
+
+    if (bucket >= 0) {
+        return &list->data[list->map_jobs[bucket]];
+    }
+
+    /* stages already reaped have left the map */
+    for (i = 0; i <= list->top; i++) {
+        Job* job = &list->data[i];
+
+        for (j = 0; job->available && j < job->procc; j++) {
+            if (job->pids[j] == pid) {
+                return job;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* store the status and resource use of a reaped child on its job, NULL if it belongs to none */
+Job* record_job_status(JobList* list, pid_t pid, int stats, const struct rusage* usage)
+{
+    long bucket = map_find(list, pid);
+    Job* job;
+    int i;
+
+    if (bucket < 0) {
+        return NULL;
+    }
+
+    job = &list->data[list->map_jobs[bucket]];
+    map_remove(list, pid);
+
+    for (i = 0; i < job->procc; i++) {
+        if (job->pids[i] == pid && job->stats[i] == -1) {
+            job->stats[i] = stats;
+            if (usage != NULL) {
+                job->usage[i] = *usage;
+            }
+            job->running--;
+            break;
+        }
+    }
+
+    if (job->running == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->ended);
+        list->ended++;
+    }
+
+    return job;
+}
+
+void get_stage_status_name(int stats, char* dest)
+{
+    if (stats == -1) {
+        strcpy(dest, "Running");
+    } else if (WIFEXITED(stats)) {
+        int es = WEXITSTATUS(stats);
+
+        if (es == 0) {
+            strcpy(dest, "Done");
+        } else {
+            sprintf(dest, "Exit %d", es);
+        }
+    } else if (WIFSIGNALED(stats)) {
+        strcpy(dest, "Terminated");
+    }
+}
+
+/* the status of a job is the one of its last stage, once all stages ended */
+bool get_job_status_name(Job* job, char* dest)
+{
+    bool ended = (job->running == 0);
+
+    get_stage_status_name(ended ? job->stats[job->procc - 1] : -1, dest);
+
+    return ended;
+}
+
+/* + for the current job, - for the previous one */
+char get_flag_char(JobList* list, Job* job)
+{
+    if (job->job_id == list->recent) {
+        return '+';
+    } else if (list->recent >= 0 && job->job_id == (list->data[list->recent]).older) {
+        return '-';
+    } else {
+        return ' ';
+    }
+}
+
+/* print one line of `jobs`, return whether the job has ended */
+bool print_job(JobList* list, Job* job)
+{
+    char stats_name[32];
+    bool ended = get_job_status_name(job, stats_name);  /* whether the process is Done/Exit/Terminated */
+
+    printf("[%d]%c  %s%*s%s%s\n", job->job_id + 1, get_flag_char(list, job), stats_name, (int)(24 - strlen(stats_name)), "",
+        job->cmd_str, ended ? "" : " &");
+
+    return ended;
+}
+
+double timespec_elapsed(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double timeval_seconds(const struct timeval* tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Resource use of every stage under the job line of `jobs -l`: wall time
+ * of the job so far, then CPU, peak RSS, page faults and context switches
+ * (voluntary/involuntary) of each reaped stage.
+ */
+void print_job_usage(Job* job)
+{
+    struct timespec now;
+    int i;
+
+    if (job->running > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } else {
+        now = job->ended;
+    }
+    printf("      real %.3fs\n", timespec_elapsed(&job->started, &now));
+
+    for (i = 0; i < job->procc; i++) {
+        struct rusage* usage = &job->usage[i];
+        char stats_name[32];
+
+        get_stage_status_name(job->stats[i], stats_name);
+        if (job->stats[i] == -1) {
+            printf("      %-7ld %s\n", (long)job->pids[i], stats_name);
+            continue;
+        }
+        printf("      %-7ld %-10s user %.3fs  sys %.3fs  maxrss %ldk  faults %ld/%ld  switches %ld/%ld\n",
+            (long)job->pids[i], stats_name, timeval_seconds(&usage->ru_utime), timeval_seconds(&usage->ru_stime),
+            usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt, usage->ru_nvcsw, usage->ru_nivcsw);
+    }
+}
+
+void print_job_list(JobList* list, bool usage)
+{
+    int i;
+
+    for (i = 0; i <= list->top; i++) {
+        if (list->data[i].available) {
+            print_job(list, &list->data[i]);
+            if (usage) {
+                print_job_usage(&list->data[i]);
+            }
+        }
+    }
+
+    /* drop the finished jobs only now, so the +/- flags above stay put */
+    for (i = list->top; i >= 0; i--) {
+        if (list->data[i].available && list->data[i].running == 0) {
+            remove_job_list(list, i);
+        }
+    }
+}
+
+
+/******************************************************************************
+ * Job queue, first in first out
+ *****************************************************************************/
+void init_job_queue(JobQueue* queue)
+{
+    queue->head = queue->tail = NULL;
+    queue->count = 0;
+}
+
+void push_job_queue(JobQueue* queue, const char* line, bool quiet)
+{
+    size_t len = strlen(line);
+    QueuedJob* node = (QueuedJob*)malloc(sizeof(QueuedJob) + len + 1);
+
+    node->next = NULL;
+    node->quiet = quiet;
+    node->line = (char*)(node + 1);
+    memcpy(node->line, line, len + 1);
+
+    if (queue->tail != NULL) {
+        queue->tail->next = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    queue->count++;
+}
+
+QueuedJob* pop_job_queue(JobQueue* queue)
+{
+    QueuedJob* node = queue->head;
+
+    if (node != NULL) {
+        queue->head = node->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        queue->count--;
+    }
+
+    return node;
+}
+
+void clear_job_queue(JobQueue* queue)
+{
+    QueuedJob* node;
+
+    while ((node = pop_job_queue(queue)) != NULL) {
+        free(node);
+    }
+}
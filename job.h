@@ -0,0 +1,96 @@
+#ifndef _JOB_H_
+#define _JOB_H_
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "parse.h"
+
+/******************************************************************************
+ * Job and job list
+ *****************************************************************************/
+typedef struct {
+    pid_t* pids;  /* one process per pipeline stage, -1 if it failed to start */
+    int* stats;  /* wait status of each stage, -1 while still running */
+    struct rusage* usage;  /* resources of each stage, filled in once it is reaped */
+    struct timespec started;  /* monotonic clock at launch */
+    struct timespec ended;  /* monotonic clock when the last stage was reaped */
+    int procc;
+    int running;  /* stages not reaped yet */
+    char* cmd_str;  /* the command line as displayed by `jobs`, without & */
+    char* wc;
+    bool available;
+    int job_id;  /* slot in the job table, shown as job_id + 1 */
+    int newer;  /* neighbours in the most-recent ordering, -1 at the ends */
+    int older;
+    int next_free;  /* next slot of the free list while not available */
+    bool scheduled;  /* started by the scheduler, holds one of its slots */
+    bool quiet;  /* started by `parallel`: dropped silently once done */
+} Job;
+
+/*
+ * Jobs live in a growable slab and are referred to by slot, so growing it
+ * never invalidates a reference. Freed slots are kept on a free list and
+ * their job numbers reused. A pid -> slot hash map finds the job of a
+ * reaped child in O(1), and a doubly linked list keeps the live jobs from
+ * the most recent one (+) to the oldest.
+ */
+typedef struct {
+    Job* data;
+    int capacity;
+    int top;  /* highest slot in use, -1 if none */
+    int free_head;
+    int recent;  /* most recent job, -1 if none */
+    int ended;  /* jobs whose every stage was reaped, not removed yet */
+
+    pid_t* map_pids;  /* open addressing, 0 marks an empty bucket */
+    int* map_jobs;
+    int map_capacity;
+    int map_count;
+} JobList;
+
+void init_job_list(JobList* list);
+void free_job_list(JobList* list);
+
+Job* append_job_list(JobList* list, pid_t* pids, int procc, CommandLine* cmd_ln, char* wc);
+void remove_job_list(JobList* list, int idx);
+
+Job* find_job(JobList* list, int job_id);
+Job* find_job_spec(JobList* list, const char* spec);
+Job* find_job_pid(JobList* list, pid_t pid);
+
+Job* record_job_status(JobList* list, pid_t pid, int stats, const struct rusage* usage);
+
+void get_stage_status_name(int stats, char* dest);
+bool get_job_status_name(Job* job, char* dest);
+char get_flag_char(JobList* list, Job* job);
+bool print_job(JobList* list, Job* job);
+void print_job_usage(Job* job);
+void print_job_list(JobList* list, bool usage);
+
+double timespec_elapsed(const struct timespec* start, const struct timespec* end);
+double timeval_seconds(const struct timeval* tv);
+
+/******************************************************************************
+ * Job queue: background command lines waiting for a scheduler slot
+ *****************************************************************************/
+typedef struct QueuedJob {
+    struct QueuedJob* next;
+    bool quiet;
+    char* line;  /* command line text, stored right after the node */
+} QueuedJob;
+
+typedef struct {
+    QueuedJob* head;
+    QueuedJob* tail;
+    int count;
+} JobQueue;
+
+void init_job_queue(JobQueue* queue);
+void push_job_queue(JobQueue* queue, const char* line, bool quiet);
+QueuedJob* pop_job_queue(JobQueue* queue);  /* the caller frees the node */
+void clear_job_queue(JobQueue* queue);
+
+#endif /* _JOB_H_ */
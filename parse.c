@@ -64,6 +64,17 @@ int strjoin(char* dest, char* strv[], int strc, const char* sep)
     return len;
 }
 
+/* djb2, good enough for the small string tables of the shell */
+unsigned long strhash(const char* str)
+{
+    unsigned long hash = 5381;
+    int ch;
+    while((ch = (unsigned char)*str++) != '\0'){
+        hash = ((hash << 5) + hash) + ch;
+    }
+    return hash;
+}
+
 /******************************************************************************
  * Path Utilities
  *****************************************************************************/
@@ -112,136 +123,956 @@ bool path_file_exists(const char* path)
     return false;
 }
 
+/******************************************************************************
+ * Arena Allocator
+ *****************************************************************************/
+
+#define ARENA_ROUND_UP(SIZE)    (((SIZE) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER_SIZE       ARENA_ROUND_UP(sizeof(ArenaBlock))
+
+static ArenaBlock* arena_new_block(ArenaBlock* prev, size_t size)
+{
+    ArenaBlock* block = malloc(ARENA_HEADER_SIZE + size);
+    if(block == NULL){
+        fprintf(stderr, "arena: out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    block->prev = prev;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void arena_init(Arena* arena)
+{
+    arena->head = NULL;
+}
+
+void* arena_alloc(Arena* arena, size_t size)
+{
+    ArenaBlock* block = arena->head;
+    void* ptr;
+
+    size = ARENA_ROUND_UP(size);
+    if(block == NULL || block->used + size > block->size){
+        /* Grow geometrically, so a long line costs O(log n) blocks */
+        size_t block_size = ARENA_BLOCK_SIZE;
+        if(block != NULL) block_size = block->size * 2;
+        while(block_size < size) block_size *= 2;
+        block = arena->head = arena_new_block(block, block_size);
+    }
+    ptr = (char*)block + ARENA_HEADER_SIZE + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t len)
+{
+    char* dup = arena_alloc(arena, len + 1);
+    memcpy(dup, str, len);
+    dup[len] = '\0';
+    return dup;
+}
+
+char* arena_strdup(Arena* arena, const char* str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+ArenaMark arena_mark(Arena* arena)
+{
+    ArenaMark mark;
+    mark.block = arena->head;
+    mark.used = arena->head != NULL ? arena->head->used : 0;
+    return mark;
+}
+
+void arena_rewind(Arena* arena, ArenaMark mark)
+{
+    while(arena->head != mark.block){
+        ArenaBlock* prev = arena->head->prev;
+        free(arena->head);
+        arena->head = prev;
+    }
+    if(arena->head != NULL) arena->head->used = mark.used;
+}
+
+void arena_reset(Arena* arena)
+{
+    ArenaBlock* block = arena->head;
+    size_t total = 0;
+
+    if(block == NULL) return;
+    if(block->prev == NULL){
+        /* The common case: everything fitted, keep the block as it is */
+        block->used = 0;
+        return;
+    }
+    /* Merge into a single block big enough for the last use */
+    while(block != NULL){
+        ArenaBlock* prev = block->prev;
+        total += block->size;
+        free(block);
+        block = prev;
+    }
+    arena->head = arena_new_block(NULL, total);
+}
+
+void arena_free(Arena* arena)
+{
+    while(arena->head != NULL){
+        ArenaBlock* prev = arena->head->prev;
+        free(arena->head);
+        arena->head = prev;
+    }
+}
+
+/******************************************************************************
+ * Tokenizer
+ *****************************************************************************/
+
+void lexer_init(Lexer* lexer, char* line)
+{
+    lexer->pos = line;
+    lexer->saved = '\0';
+    lexer->error = NULL;
+}
+
+/* Character at pos + offset, seeing through a '\0' written by the last word */
+static char lexer_peek(Lexer* lexer, int offset)
+{
+    if(offset == 0 && lexer->saved != '\0') return lexer->saved;
+    return lexer->pos[offset];
+}
+
+static bool is_white_char(char ch)
+{
+    return ch != '\0' && strchr(WHITE_CHARS, ch) != NULL;
+}
+
+static bool is_operator_char(char ch)
+{
+    return ch != '\0' && strchr(OPERATOR_CHARS, ch) != NULL;
+}
+
+static TokenType lexer_operator(Lexer* lexer)
+{
+    char ch = lexer_peek(lexer, 0);
+    char next = lexer->pos[1];
+    int len = 2;
+    TokenType type;
+
+    switch(ch){
+        case '|':
+            type = (next == '|') ? TOKEN_OR : TOKEN_PIPE;
+            break;
+        case '&':
+            if(next == '&') type = TOKEN_AND;
+            else if(next != '>') type = TOKEN_AMP;
+            else if(lexer->pos[2] == '>') type = TOKEN_APPEND_ALL;
+            else type = TOKEN_OUTPUT_ALL;
+            break;
+        case ';':
+            type = TOKEN_SEMI;
+            break;
+        case '<':
+            if(next == '&') type = TOKEN_DUP_INPUT;
+            else if(next != '<') type = TOKEN_INPUT;
+            else if(lexer->pos[2] == '<') type = TOKEN_HERESTRING;
+            else if(lexer->pos[2] == '-') type = TOKEN_HEREDOC_STRIP;
+            else type = TOKEN_HEREDOC;
+            break;
+        default:
+            if(next == '>') type = TOKEN_APPEND;
+            else if(next == '&') type = TOKEN_DUP_OUTPUT;
+            else type = TOKEN_OUTPUT;
+            break;
+    }
+    if(type == TOKEN_PIPE || type == TOKEN_AMP || type == TOKEN_SEMI || type == TOKEN_INPUT || type == TOKEN_OUTPUT) len = 1;
+    if(type == TOKEN_HERESTRING || type == TOKEN_HEREDOC_STRIP || type == TOKEN_APPEND_ALL) len = 3;
+
+    lexer->saved = '\0';
+    lexer->pos += len;
+    return type;
+}
+
+/*
+ * Scan a word starting at pos. The read pointer runs ahead of the write
+ * pointer whenever a quote or backslash is dropped, so the unquoted word is
+ * built over its own source text in a single pass.
+ */
+/* Store a quoted character, marking it if it would be a glob character */
+static char* lexer_quoted(char* write, char ch, bool* marked)
+{
+    const char* glob = (ch != '\0') ? strchr(GLOB_CHARS, ch) : NULL;
+    if(glob != NULL){
+        *marked = true;
+        *write = QUOTED_GLOB_CHARS[glob - GLOB_CHARS];
+    }else{
+        *write = ch;
+    }
+    return write + 1;
+}
+
+bool is_var_name_char(char ch, bool first)
+{
+    return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (!first && ch >= '0' && ch <= '9');
+}
+
+size_t assignment_name_len(const char* word)
+{
+    size_t len = 0;
+    while(is_var_name_char(word[len], len == 0)) len++;
+    return (len > 0 && word[len] == '=') ? len : 0;
+}
+
+/* Whether a $ followed by ch starts a reference: $NAME, ${NAME}, $? or $$ */
+static bool is_var_start(char ch)
+{
+    return ch == '{' || ch == '?' || ch == '$' || is_var_name_char(ch, true);
+}
+
+/*
+ * Called where a quote or backslash is dropped: if a $NAME ends right
+ * before write, VAR_END keeps the name from running into what follows.
+ * The dropped character leaves room for it.
+ */
+static char* lexer_end_reference(char* start, char* write)
+{
+    char* name = write;
+    while(name > start && is_var_name_char(name[-1], false)) name--;
+    if(name < write && name > start && (name[-1] == VAR_MARK || name[-1] == QUOTED_VAR_MARK)){
+        *write++ = VAR_END;
+    }
+    return write;
+}
+
+/* The ) closing a $( whose command starts at p, NULL if it is not closed */
+static const char* skip_command(const char* p)
+{
+    int depth = 1;
+    for(; *p != '\0'; p++){
+        if(*p == '\\' && p[1] != '\0'){
+            p++;
+        }else if(*p == '\'' || *p == '`'){
+            const char* close = strchr(p + 1, *p);
+            if(close == NULL) return NULL;
+            p = close;
+        }else if(*p == '"'){
+            for(p++; *p != '"'; p++){
+                if(*p == '\0') return NULL;
+                if(*p == '\\' && p[1] != '\0') p++;
+            }
+        }else if(*p == '('){
+            depth++;
+        }else if(*p == ')' && --depth == 0){
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Copy the command of the substitution at *read, $(...) or `...`, between
+ * its marks. Inside backquotes a backslash only escapes `, \ and $. The
+ * delimiters are at least as long as the marks, so it fits in place.
+ */
+static bool lexer_substitution(Lexer* lexer, char** read, char** write, bool quoted)
+{
+    char* r = *read;
+    char* w = *write;
+    bool backquoted = (*r == '`');
+
+    /* The mark may overwrite the opening delimiter */
+    *w++ = quoted ? QUOTED_SUBST_MARK : SUBST_MARK;
+    if(backquoted){
+        for(r++; *r != '`'; r++){
+            if(*r == '\0'){
+                lexer->error = "unexpected EOF while looking for matching ``'";
+                return false;
+            }
+            if(*r == '\\' && (r[1] == '`' || r[1] == '\\' || r[1] == '$')) r++;
+            *w++ = *r;
+        }
+    }else{
+        const char* end = skip_command(r + 2);
+        if(end == NULL){
+            lexer->error = "unexpected EOF while looking for matching `)'";
+            return false;
+        }
+        for(r += 2; r < end; r++) *w++ = *r;
+    }
+    *w++ = SUBST_END;
+
+    *read = r + 1;
+    *write = w;
+    return true;
+}
+
+static TokenType lexer_word(Lexer* lexer, Token* token)
+{
+    char* read = lexer->pos;
+    char* write = lexer->pos;
+    char quote = '\0';
+    bool marked = false;
+
+    token->text = write;
+    token->pattern = false;
+    token->expand = false;
+    token->quoted = false;
+    for(;;){
+        char ch = *read;
+        if(ch == '\0'){
+            break;
+        }else if(quote == '\''){
+            /* Everything is literal inside single quotes */
+            if(ch == '\'') quote = '\0';
+            else write = lexer_quoted(write, ch, &marked);
+            read++;
+        }else if(quote == '"'){
+            if(ch == '"'){
+                quote = '\0';
+                write = lexer_end_reference(token->text, write);
+                read++;
+            }else if(ch == '\\' && read[1] != '\0' && strchr("\"\\$`\n", read[1]) != NULL){
+                *write++ = read[1];
+                read += 2;
+            }else if((ch == '$' && read[1] == '(') || ch == '`'){
+                if(!lexer_substitution(lexer, &read, &write, true)) return TOKEN_ERROR;
+                token->expand = true;
+            }else if(ch == '$' && is_var_start(read[1])){
+                *write++ = QUOTED_VAR_MARK;
+                token->expand = true;
+                read++;
+            }else{
+                write = lexer_quoted(write, *read++, &marked);
+            }
+        }else if(is_white_char(ch) || is_operator_char(ch)){
+            break;
+        }else if(ch == '\'' || ch == '"'){
+            quote = ch;
+            token->quoted = true;
+            write = lexer_end_reference(token->text, write);
+            read++;
+        }else if(ch == '\\'){
+            /* A backslash quotes the next character, a trailing one is dropped */
+            token->quoted = true;
+            write = lexer_end_reference(token->text, write);
+            if(read[1] != '\0'){
+                write = lexer_quoted(write, read[1], &marked);
+                read++;
+            }
+            read++;
+        }else if((ch == '$' && read[1] == '(') || ch == '`'){
+            if(!lexer_substitution(lexer, &read, &write, false)) return TOKEN_ERROR;
+            token->expand = true;
+        }else if(ch == '$' && is_var_start(read[1])){
+            *write++ = VAR_MARK;
+            token->expand = true;
+            read++;
+        }else{
+            if(ch == '*' || ch == '?' || ch == '[') token->pattern = true;
+            *write++ = *read++;
+        }
+    }
+
+    if(quote != '\0'){
+        lexer->error = (quote == '\'') ? "unexpected EOF while looking for matching `''"
+                                       : "unexpected EOF while looking for matching `\"'";
+        return TOKEN_ERROR;
+    }
+
+    /* Terminate the word, remembering the delimiter if it gets overwritten */
+    lexer->saved = (write == read) ? *read : '\0';
+    if(lexer->saved != '\0' && is_white_char(lexer->saved)) lexer->saved = ' ';
+    *write = '\0';
+    lexer->pos = read;
+
+    /* Quoted glob characters only need marking in a pattern */
+    if(marked && !token->pattern) unquote_pattern(token->text, token->text);
+    return TOKEN_WORD;
+}
+
+char* unquote_pattern(char* dest, const char* word)
+{
+    char* write = dest;
+    for(; *word != '\0'; word++){
+        const char* quoted = strchr(QUOTED_GLOB_CHARS, *word);
+        *write++ = (quoted != NULL) ? GLOB_CHARS[quoted - QUOTED_GLOB_CHARS] : *word;
+    }
+    *write = '\0';
+    return dest;
+}
+
+bool mark_here_line(char* line, bool* expand, const char** error)
+{
+    Lexer lexer;
+    char* read = line;
+    char* write = line;
+
+    lexer.error = NULL;
+    while(*read != '\0'){
+        char ch = *read;
+        if(ch == '\\' && read[1] != '\0' && strchr("\\$`", read[1]) != NULL){
+            *write++ = read[1];
+            read += 2;
+        }else if((ch == '$' && read[1] == '(') || ch == '`'){
+            if(!lexer_substitution(&lexer, &read, &write, true)){
+                *error = lexer.error;
+                return false;
+            }
+            *expand = true;
+        }else if(ch == '$' && is_var_start(read[1])){
+            *write++ = QUOTED_VAR_MARK;
+            *expand = true;
+            read++;
+        }else{
+            *write++ = *read++;
+        }
+    }
+    *write = '\0';
+    return true;
+}
+
+/* The number of n<, n> and the like, which must touch the operator; -1 if none is there */
+static int lexer_fd_number(Lexer* lexer)
+{
+    char* p = lexer->pos;
+    int fd = 0;
+    while(*p >= '0' && *p <= '9' && fd < 10000){
+        fd = fd * 10 + (*p - '0');
+        p++;
+    }
+    if(p == lexer->pos || fd >= 10000 || (*p != '<' && *p != '>')) return -1;
+    lexer->pos = p;
+    return fd;
+}
+
+TokenType lexer_next(Lexer* lexer, Token* token)
+{
+    char ch;
+
+    token->text = NULL;
+    token->fd = -1;
+    /* Skip blanks */
+    while(is_white_char(ch = lexer_peek(lexer, 0))){
+        lexer->saved = '\0';
+        lexer->pos++;
+    }
+
+    if(ch == '\0' || ch == '#'){
+        /* End of line, or a comment up to it */
+        token->type = TOKEN_END;
+    }else if(is_operator_char(ch)){
+        token->type = lexer_operator(lexer);
+    }else if(ch >= '0' && ch <= '9' && (token->fd = lexer_fd_number(lexer)) >= 0){
+        token->type = lexer_operator(lexer);
+    }else{
+        token->type = lexer_word(lexer, token);
+    }
+    return token->type;
+}
+
+const char* token_name(TokenType type)
+{
+    switch(type){
+        case TOKEN_PIPE:    return "|";
+        case TOKEN_AMP:     return "&";
+        case TOKEN_SEMI:    return ";";
+        case TOKEN_AND:     return "&&";
+        case TOKEN_OR:      return "||";
+        case TOKEN_INPUT:   return "<";
+        case TOKEN_OUTPUT:  return ">";
+        case TOKEN_APPEND:  return ">>";
+        case TOKEN_HEREDOC: return "<<";
+        case TOKEN_HEREDOC_STRIP:   return "<<-";
+        case TOKEN_HERESTRING:  return "<<<";
+        case TOKEN_DUP_INPUT:   return "<&";
+        case TOKEN_DUP_OUTPUT:  return ">&";
+        case TOKEN_OUTPUT_ALL:  return "&>";
+        case TOKEN_APPEND_ALL:  return "&>>";
+        case TOKEN_END:     return "newline";
+        default:            return "word";
+    }
+}
+
 /******************************************************************************
  * Command Utilities
  *****************************************************************************/
 
-void parse_command_line(CommandLine* command_line, char* line)
+void init_command_line(CommandLine* command_line, Arena* arena)
+{
+    command_line->cmdc = 0;
+    command_line->cmdv = NULL;
+    command_line->bg = false;
+    command_line->timed = false;
+    command_line->error = NULL;
+    command_line->arena = arena;
+}
+
+static Command* append_command(CommandLine* command_line, int* capacity)
+{
+    Command* cmd;
+    if(command_line->cmdc == *capacity){
+        /* Double the array, the old one stays behind in the arena */
+        Command* cmdv;
+        *capacity = (*capacity == 0) ? 4 : *capacity * 2;
+        cmdv = arena_alloc(command_line->arena, sizeof(Command) * (*capacity));
+        if(command_line->cmdc > 0){
+            memcpy(cmdv, command_line->cmdv, sizeof(Command) * command_line->cmdc);
+        }
+        command_line->cmdv = cmdv;
+    }
+    cmd = &command_line->cmdv[command_line->cmdc++];
+    cmd->argc = 0;
+    cmd->argv = NULL;
+    cmd->patterns = NULL;
+    cmd->assigns = NULL;
+    cmd->expand = false;
+    cmd->path = NULL;
+    cmd->envp = NULL;
+    cmd->redirects = NULL;
+    cmd->redirc = 0;
+    return cmd;
+}
+
+/*
+ * Keep argv NULL terminated, doubling it in the arena when full. The
+ * pattern flags are only allocated once a pattern shows up.
+ */
+static void append_argument(Command* cmd, char* arg, bool pattern, Arena* arena, int* capacity)
+{
+    if(cmd->argc + 1 >= *capacity){
+        char** argv;
+        *capacity = (*capacity == 0) ? 8 : *capacity * 2;
+        argv = arena_alloc(arena, sizeof(char*) * (*capacity));
+        if(cmd->argc > 0) memcpy(argv, cmd->argv, sizeof(char*) * cmd->argc);
+        cmd->argv = argv;
+        if(cmd->patterns != NULL){
+            bool* patterns = arena_alloc(arena, sizeof(bool) * (*capacity));
+            memcpy(patterns, cmd->patterns, sizeof(bool) * cmd->argc);
+            cmd->patterns = patterns;
+        }
+    }
+    if(pattern && cmd->patterns == NULL){
+        cmd->patterns = arena_alloc(arena, sizeof(bool) * (*capacity));
+        memset(cmd->patterns, 0, sizeof(bool) * cmd->argc);
+    }
+    if(cmd->patterns != NULL) cmd->patterns[cmd->argc] = pattern;
+    cmd->argv[cmd->argc++] = arg;
+    cmd->argv[cmd->argc] = NULL;
+}
+
+/* Leading NAME=value words are kept apart from the arguments */
+static void append_assignment(Command* cmd, char* word, Arena* arena, int* count)
+{
+    char** assigns = arena_alloc(arena, sizeof(char*) * (*count + 2));
+    if(*count > 0) memcpy(assigns, cmd->assigns, sizeof(char*) * (*count));
+    assigns[(*count)++] = word;
+    assigns[*count] = NULL;
+    cmd->assigns = assigns;
+}
+
+static bool is_redirection(TokenType type)
+{
+    return type == TOKEN_INPUT || type == TOKEN_OUTPUT || type == TOKEN_APPEND
+        || type == TOKEN_HEREDOC || type == TOKEN_HEREDOC_STRIP || type == TOKEN_HERESTRING
+        || type == TOKEN_DUP_INPUT || type == TOKEN_DUP_OUTPUT || type == TOKEN_OUTPUT_ALL || type == TOKEN_APPEND_ALL;
+}
+
+Redirect* find_redirect(Command* cmd, int fd)
 {
-    const char* pipe_delimiters = "|";
-    char* token;
-    char* commands[MAX_CMDS];
     int i;
+    for(i = cmd->redirc - 1; i >= 0; i--){
+        if(cmd->redirects[i].fd == fd) return &cmd->redirects[i];
+    }
+    return NULL;
+}
 
-    line = strtrim(line, WHITE_CHARS);
-    /* Is background command? */
-    command_line->bg = strendswith(line, "&");
-    /* Eliminate the end &, after it's handled */
-    line = strtrim(line, CAT_CONST_STR(WHITE_CHARS, "&"));
-
-    /* Tokenize by vertical line(|) */
-    i = 0;
-    token = strtok(line, pipe_delimiters);
-    while(token != NULL){
-        commands[i++] = token;
-        token = strtok(NULL, pipe_delimiters);
-    }
-    /* Now i equals to the count of arguments */
-    command_line->cmdc = i;
-    command_line->cmdv = malloc(sizeof(Command) * i);
-    for(i = 0; i < command_line->cmdc; i++){
-        Command* cmd = &command_line->cmdv[i];
+static bool add_redirect(Command* cmd, RedirectType type, int fd, char* target, HereDoc* here, Arena* arena)
+{
+    Redirect* redirect;
+    if(cmd->redirects == NULL){
+        cmd->redirects = arena_alloc(arena, sizeof(Redirect) * MAX_REDIRECTS);
+    }else if(cmd->redirc == MAX_REDIRECTS){
+        return false;
+    }
+    redirect = &cmd->redirects[cmd->redirc++];
+    redirect->type = type;
+    redirect->fd = fd;
+    redirect->target = target;
+    redirect->here = here;
+    redirect->source = -1;
+    return true;
+}
+
+static bool is_fd_target(const char* target)
+{
+    if(strcmp(target, "-") == 0) return true;
+    for(; *target != '\0'; target++){
+        if(*target < '0' || *target > '9') return false;
+    }
+    return true;
+}
+
+/*
+ * A here-string keeps its word, which gets a newline. A here-document
+ * only records its delimiter: the body is in the lines that follow, which
+ * whoever reads them stores in text.
+ */
+static HereDoc* parse_here(TokenType type, Token* token, Arena* arena)
+{
+    HereDoc* here = arena_alloc(arena, sizeof(HereDoc));
+    here->text = NULL;
+    here->delimiter = NULL;
+    here->strip_tabs = (type == TOKEN_HEREDOC_STRIP);
+    here->literal = false;
+    if(type == TOKEN_HERESTRING){
+        size_t len = strlen(token->text);
+        here->text = arena_alloc(arena, len + 2);
+        memcpy(here->text, token->text, len);
+        here->text[len] = '\n';
+        here->text[len + 1] = '\0';
+    }else{
+        here->delimiter = token->text;
+        here->literal = token->quoted;
+    }
+    return here;
+}
+
+static bool syntax_error(CommandLine* command_line, TokenType type)
+{
+    char* message = arena_alloc(command_line->arena, 64);
+    sprintf(message, "syntax error near unexpected token `%s'", token_name(type));
+    command_line->error = message;
+    command_line->cmdc = 0;
+    return false;
+}
+
+/*
+ * Parse the target of the redirection operator type, n being its number or
+ * -1. &>file stands for >file 2>&1, and so does >&file unless the target
+ * names a descriptor.
+ */
+static bool parse_redirect(CommandLine* command_line, Command* cmd, TokenType type, int n, Lexer* lexer, Token* token)
+{
+    Arena* arena = command_line->arena;
+    bool reads = (type == TOKEN_INPUT || type == TOKEN_DUP_INPUT || type == TOKEN_HEREDOC
+                  || type == TOKEN_HEREDOC_STRIP || type == TOKEN_HERESTRING);
+    int fd = (n >= 0) ? n : (reads ? 0 : 1);
+    bool ok;
+
+    if(lexer_next(lexer, token) != TOKEN_WORD){
+        return syntax_error(command_line, token->type);
+    }
+    /* Redirections name one file, patterns are not expanded there */
+    if(token->pattern) unquote_pattern(token->text, token->text);
+    if(token->expand && type != TOKEN_HEREDOC && type != TOKEN_HEREDOC_STRIP){
+        /* The delimiter of a here-document is taken as typed, quotes aside */
+        cmd->expand = true;
+    }
+
+    if(type == TOKEN_DUP_OUTPUT && n < 0 && !token->expand && !is_fd_target(token->text)){
+        type = TOKEN_OUTPUT_ALL;
+    }
+    switch(type){
+        case TOKEN_INPUT:
+            ok = add_redirect(cmd, REDIRECT_INPUT, fd, token->text, NULL, arena);
+            break;
+        case TOKEN_OUTPUT:
+            ok = add_redirect(cmd, REDIRECT_OUTPUT, fd, token->text, NULL, arena);
+            break;
+        case TOKEN_APPEND:
+            ok = add_redirect(cmd, REDIRECT_APPEND, fd, token->text, NULL, arena);
+            break;
+        case TOKEN_DUP_INPUT:
+        case TOKEN_DUP_OUTPUT:
+            ok = add_redirect(cmd, REDIRECT_DUP, fd, token->text, NULL, arena);
+            break;
+        case TOKEN_OUTPUT_ALL:
+        case TOKEN_APPEND_ALL:
+            ok = add_redirect(cmd, type == TOKEN_OUTPUT_ALL ? REDIRECT_OUTPUT : REDIRECT_APPEND, 1, token->text, NULL, arena)
+                 && add_redirect(cmd, REDIRECT_DUP, 2, "1", NULL, arena);
+            break;
+        default:
+            ok = add_redirect(cmd, REDIRECT_HERE, fd, NULL, parse_here(type, token, arena), arena);
+            break;
+    }
+    if(!ok){
+        command_line->error = "too many redirections";
+        command_line->cmdc = 0;
+    }
+    return ok;
+}
+
+bool parse_pipeline(CommandLine* command_line, Lexer* lexer, Token* token)
+{
+    Command* cmd = NULL;
+    int capacity = 0, argv_capacity = 0, assignc = 0;
+
+    command_line->cmdc = 0;
+    command_line->cmdv = NULL;
+    command_line->bg = false;
+    command_line->timed = false;
+    command_line->error = NULL;
+
+    for(; !command_line->bg; lexer_next(lexer, token)){
+        TokenType type = token->type;
+
+        if(type == TOKEN_ERROR){
+            command_line->error = lexer->error;
+            command_line->cmdc = 0;
+            return false;
+        }
+        if(type == TOKEN_END || type == TOKEN_SEMI || type == TOKEN_AND || type == TOKEN_OR){
+            /* The list around the pipeline goes on */
+            break;
+        }
+
+        if(type == TOKEN_WORD && command_line->cmdc == 0 && !command_line->timed && !token->quoted && strcmp(token->text, "time") == 0){
+            /* The time keyword covers the whole pipeline */
+            command_line->timed = true;
+            continue;
+        }
+
+        if(cmd == NULL && (type == TOKEN_WORD || is_redirection(type))){
+            /* A new command of the pipeline starts */
+            if(command_line->cmdc == MAX_CMDS){
+                command_line->error = "too many commands in a pipeline";
+                command_line->cmdc = 0;
+                return false;
+            }
+            cmd = append_command(command_line, &capacity);
+            argv_capacity = 0;
+            assignc = 0;
+        }
+
+        switch(type){
+            case TOKEN_WORD:
+                if(token->expand) cmd->expand = true;
+                if(cmd->argc == 0 && assignment_name_len(token->text) > 0){
+                    /* Assignments are not globbed */
+                    if(token->pattern) unquote_pattern(token->text, token->text);
+                    append_assignment(cmd, token->text, command_line->arena, &assignc);
+                }else{
+                    append_argument(cmd, token->text, token->pattern, command_line->arena, &argv_capacity);
+                }
+                break;
+            case TOKEN_INPUT:
+            case TOKEN_OUTPUT:
+            case TOKEN_APPEND:
+            case TOKEN_HEREDOC:
+            case TOKEN_HEREDOC_STRIP:
+            case TOKEN_HERESTRING:
+            case TOKEN_DUP_INPUT:
+            case TOKEN_DUP_OUTPUT:
+            case TOKEN_OUTPUT_ALL:
+            case TOKEN_APPEND_ALL:
+                if(!parse_redirect(command_line, cmd, type, token->fd, lexer, token)) return false;
+                break;
+            case TOKEN_PIPE:
+                if(cmd == NULL) return syntax_error(command_line, type);
+                cmd = NULL;
+                break;
+            case TOKEN_AMP:
+                if(cmd == NULL) return syntax_error(command_line, type);
+                command_line->bg = true;
+                break;
+            default:
+                return syntax_error(command_line, type);
+        }
+    }
+
+    if(command_line->cmdc > 0 && cmd == NULL && !command_line->bg){
+        /* Dangling pipe */
+        return syntax_error(command_line, token->type);
+    }
+    return true;
+}
+
+bool parse_command_line(CommandLine* command_line, char* line)
+{
+    Lexer lexer;
+    Token token;
+
+    lexer_init(&lexer, line);
+    lexer_next(&lexer, &token);
+    if(!parse_pipeline(command_line, &lexer, &token)) return false;
+    if(token.type != TOKEN_END){
+        /* Lists need a program, a line holds one pipeline */
+        return syntax_error(command_line, token.type);
+    }
+    return true;
+}
+
+bool parse_word_list(CommandLine* command_line, Lexer* lexer, Token* token)
+{
+    Command* cmd;
+    int capacity = 0, argv_capacity = 0;
+
+    init_command_line(command_line, command_line->arena);
+    cmd = append_command(command_line, &capacity);
+    for(; token->type == TOKEN_WORD; lexer_next(lexer, token)){
+        if(token->expand) cmd->expand = true;
+        append_argument(cmd, token->text, token->pattern, command_line->arena, &argv_capacity);
+    }
+    if(token->type == TOKEN_ERROR){
+        command_line->error = lexer->error;
+        return false;
+    }
+    if(cmd->argv == NULL){
+        append_argument(cmd, NULL, false, command_line->arena, &argv_capacity);
         cmd->argc = 0;
-        cmd->output = NULL;
-        cmd->input = NULL;
-
-        /* Traverse each token */
-        token = strtok(commands[i], WHITE_CHARS);
-        while(token != NULL){
-            if(strcmp(token, ">") == 0){
-                /* Write */
-                token = strtok(NULL, WHITE_CHARS);
-                cmd->output = malloc(sizeof(char) * (strlen(token) + 1));
-                strcpy(cmd->output, token);
-                cmd->append = false;
-            }else if(strcmp(token, ">>") == 0){
-                /* Append */
-                token = strtok(NULL, WHITE_CHARS);
-                cmd->output = malloc(sizeof(char) * (strlen(token) + 1));
-                strcpy(cmd->output, token);
-                cmd->append = true;
-            }else if(strcmp(token, "<") == 0){
-                /* Read */
-                token = strtok(NULL, WHITE_CHARS);
-                cmd->input = malloc(sizeof(char) * (strlen(token) + 1));
-                strcpy(cmd->input, token);
-                cmd->append = false;
+    }
+    return true;
+}
+
+/* Append str to dest at len, or just count it when dest is NULL */
+static int format_append(char* dest, int len, const char* str)
+{
+    int str_len = strlen(str);
+    if(dest != NULL) memcpy(dest + len, str, str_len + 1);
+    return len + str_len;
+}
+
+static int format_marked(char* dest, int len, const char* word, size_t size, bool pattern);
+
+/* Append a word, single-quoted if it would not read back as one word */
+int format_word(char* dest, int len, const char* word)
+{
+    const char* ch;
+    if(strpbrk(word, EXPANSION_MARKS) != NULL){
+        return format_marked(dest, len, word, strlen(word), false);
+    }
+    if(*word != '\0' && strpbrk(word, CAT_CONST_STR(WHITE_CHARS, "|&;<>'\"\\#*?[$")) == NULL){
+        return format_append(dest, len, word);
+    }
+    len = format_append(dest, len, "'");
+    for(ch = word; *ch != '\0'; ch++){
+        if(*ch == '\''){
+            len = format_append(dest, len, "'\\''");
+        }else{
+            if(dest != NULL) dest[len] = *ch;
+            len++;
+        }
+    }
+    return format_append(dest, len, "'");
+}
+
+/*
+ * Append a word holding marks: references are written back as such, and
+ * glob characters are left unquoted only in a pattern. Anything else that
+ * is special gets a backslash.
+ */
+static int format_marked(char* dest, int len, const char* word, size_t size, bool pattern)
+{
+    char escaped[3] = {'\\', '\0', '\0'};
+    const char* stop = word + size;
+    for(; word < stop; word++){
+        const char* quoted = strchr(QUOTED_GLOB_CHARS, *word);
+        if(*word == SUBST_MARK || *word == QUOTED_SUBST_MARK){
+            /* The command as typed */
+            const char* end = strchr(word, SUBST_END);
+            bool quoted = (*word == QUOTED_SUBST_MARK);
+            len = format_append(dest, len, quoted ? "\"$(" : "$(");
+            if(dest != NULL) memcpy(dest + len, word + 1, end - word - 1);
+            len += end - word - 1;
+            len = format_append(dest, len, quoted ? ")\"" : ")");
+            word = end;
+        }else if(*word == VAR_MARK){
+            len = format_append(dest, len, "$");
+        }else if(*word == VAR_END){
+            len = format_append(dest, len, "\"\"");
+        }else if(*word == QUOTED_VAR_MARK){
+            /* The reference alone goes in double quotes */
+            size_t ref_len = 1;
+            if(word[1] == '{'){
+                while(word[ref_len] != '\0' && word[ref_len] != '}') ref_len++;
+                if(word[ref_len] == '}') ref_len++;
+            }else if(word[1] == '?' || word[1] == '$'){
+                ref_len = 2;
             }else{
-                cmd->argv[cmd->argc] = malloc(sizeof(char) * (strlen(token) + 1));
-                strcpy(cmd->argv[cmd->argc], token);
-                cmd->argc++;
+                while(is_var_name_char(word[ref_len], ref_len == 1)) ref_len++;
             }
-            token = strtok(NULL, WHITE_CHARS);
+            len = format_append(dest, len, "\"$");
+            if(dest != NULL) memcpy(dest + len, word + 1, ref_len - 1);
+            len += ref_len - 1;
+            len = format_append(dest, len, "\"");
+            word += ref_len - 1;
+        }else if(quoted != NULL || (!pattern && strchr(GLOB_CHARS, *word) != NULL)
+                 || strchr(CAT_CONST_STR(WHITE_CHARS, "|&;<>'\"\\#$"), *word) != NULL){
+            escaped[1] = (quoted != NULL) ? GLOB_CHARS[quoted - QUOTED_GLOB_CHARS] : *word;
+            len = format_append(dest, len, escaped);
+        }else{
+            if(dest != NULL) dest[len] = *word;
+            len++;
         }
     }
+    if(dest != NULL) dest[len] = '\0';
+    return len;
 }
 
-void free_command_line(CommandLine* command_line)
+static int format_redirect(char* dest, int len, Redirect* redirect)
 {
-    int i, j;
-    for(i = 0; i < command_line->cmdc; i++){
-        Command* cmd = &command_line->cmdv[i];
-        if(cmd->input != NULL) free(cmd->input);
-        if(cmd->output != NULL) free(cmd->output);
-        for(j = 0; j < cmd->argc; j++){
-            free(cmd->argv[j]);
-        }
+    static const char* operators[] = {"<", ">", ">>", ">&", "<<<"};
+    bool reads = (redirect->type == REDIRECT_INPUT || redirect->type == REDIRECT_HERE
+                  || (redirect->type == REDIRECT_DUP && redirect->fd == 0));
+    const char* operator = operators[redirect->type];
+    HereDoc* here = redirect->here;
+    char number[16];
+
+    if(redirect->type == REDIRECT_DUP && reads) operator = "<&";
+    if(here != NULL && here->text == NULL) operator = here->strip_tabs ? "<<-" : "<<";
+    if(redirect->fd != (reads ? 0 : 1)){
+        sprintf(number, " %d", redirect->fd);
+        len = format_append(dest, len, number);
+    }else{
+        len = format_append(dest, len, " ");
+    }
+    len = format_append(dest, len, operator);
+    len = format_append(dest, len, redirect->type == REDIRECT_DUP ? "" : " ");
+
+    if(here == NULL){
+        return format_word(dest, len, redirect->target);
+    }else if(here->text == NULL){
+        return format_word(dest, len, here->delimiter);
+    }else{
+        /* A body read already goes back in as a here-string, less its last newline */
+        size_t size = strlen(here->text);
+        if(size > 0 && here->text[size - 1] == '\n') size--;
+        if(size == 0) len = format_append(dest, len, "''");
+        return format_marked(dest, len, here->text, size, false);
     }
-    free(command_line->cmdv);
 }
 
 int format_command_line(char* dest, CommandLine* command_line, bool bg)
 {
-    int i, len = 0;
-    char** command_strs = malloc(command_line->cmdc * sizeof(char*));
+    int i, j, len = 0;
+    if(dest != NULL) dest[0] = '\0';
+    if(command_line->timed) len = format_append(dest, len, command_line->cmdc > 0 ? "time " : "time");
     for(i = 0; i < command_line->cmdc; i++){
         Command* cmd = &command_line->cmdv[i];
-        char* cmd_str;
-        int cmd_str_len = strjoin(NULL, cmd->argv, cmd->argc, " ");
-        if(cmd->input){
-            /* 3 for ' < ' */
-            cmd_str_len += 3;
-            cmd_str_len += strlen(cmd->input);
-        }
-        if(cmd->output){
-            if(cmd->append){
-                /* 4 for ' >> ' */
-                cmd_str_len += 4;
-            }else{
-                /* 3 for ' > ' */
-                cmd_str_len += 3;
-            }
-            cmd_str_len += strlen(cmd->output);
-        }
-        cmd_str = malloc(sizeof(char) * (cmd_str_len + 1));
-        strjoin(cmd_str, cmd->argv, cmd->argc, " ");
-        if(cmd->input){
-            strcat(cmd_str, " < ");
-            strcat(cmd_str, cmd->input);
+        if(i > 0) len = format_append(dest, len, " | ");
+        for(j = 0; cmd->assigns != NULL && cmd->assigns[j] != NULL; j++){
+            len = format_word(dest, len, cmd->assigns[j]);
+            if(cmd->argc > 0 || cmd->assigns[j + 1] != NULL) len = format_append(dest, len, " ");
         }
-        if(cmd->output){
-            if(cmd->append){
-                strcat(cmd_str, " >> ");
+        for(j = 0; j < cmd->argc; j++){
+            if(j > 0) len = format_append(dest, len, " ");
+            if(cmd->patterns != NULL && cmd->patterns[j]){
+                len = format_marked(dest, len, cmd->argv[j], strlen(cmd->argv[j]), true);
             }else{
-                strcat(cmd_str, " > ");
+                len = format_word(dest, len, cmd->argv[j]);
             }
-            strcat(cmd_str, cmd->output);
         }
-        command_strs[i] = cmd_str;
-    }
-    len = strjoin(dest, command_strs, command_line->cmdc, " | ");
-    for(i = 0; i < command_line->cmdc; i++){
-        free(command_strs[i]);
+        for(j = 0; j < cmd->redirc; j++){
+            len = format_redirect(dest, len, &cmd->redirects[j]);
+        }
     }
-    free(command_strs);
 
     /* If require the tailing background flag */
     if(bg && command_line->bg){
-        /* 2 for ' &' */
-        len += 2;
-        if(dest){
-            strcat(dest, " &");
-        }
+        len = format_append(dest, len, " &");
     }
     return len;
 }
@@ -3,9 +3,10 @@
 
 #include <string.h>
 
+#define PROGRAM_NAME    "shell"  /* prefix of every error message */
 #define BUF_SIZE    512
 #define MAX_CMDS    100
-#define MAX_ARGC    100
+#define MAX_REDIRECTS   16
 #define WHITE_CHARS " \f\n\r\t\v"
 #define SEP_CHARS   " \f\n\r\t\v,()"
 
@@ -31,6 +32,8 @@ bool strendswith(const char* str, const char* tar);
 
 int strjoin(char* dest, char* strv[], int strc, const char* sep);
 
+unsigned long strhash(const char* str);
+
 /******************************************************************************
  * Path Utilities
  *****************************************************************************/
@@ -42,18 +45,192 @@ char* path_eliminate_tail_slash(char* path);
 char* path_ensure_tail_slash(char* path);
 bool path_file_exists(const char* path);
 
+/******************************************************************************
+ * Arena Allocator
+ *****************************************************************************/
+
+#define ARENA_BLOCK_SIZE    4096
+#define ARENA_ALIGN         16
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock*  prev;
+    size_t              size;
+    size_t              used;
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock*     head;
+} Arena;
+
+typedef struct
+{
+    ArenaBlock*     block;
+    size_t          used;
+} ArenaMark;
+
+void arena_init(Arena* arena);
+void* arena_alloc(Arena* arena, size_t size);
+char* arena_strndup(Arena* arena, const char* str, size_t len);
+char* arena_strdup(Arena* arena, const char* str);
+ArenaMark arena_mark(Arena* arena);
+void arena_rewind(Arena* arena, ArenaMark mark);
+void arena_reset(Arena* arena);
+void arena_free(Arena* arena);
+
+/******************************************************************************
+ * Tokenizer
+ *****************************************************************************/
+
+#define OPERATOR_CHARS  "|&;<>"
+
+/*
+ * A word with unquoted glob characters is a pattern. Its quoted glob
+ * characters are stored as the control bytes below, so that only the
+ * unquoted ones match; words which are no pattern keep their text as is.
+ */
+#define GLOB_CHARS          "*?["
+#define QUOTED_GLOB_CHARS   "\001\002\003"
+
+char* unquote_pattern(char* dest, const char* word);
+
+/*
+ * A $ starting a variable reference is stored as one of these bytes, the
+ * second one inside double quotes where the value is not split into fields.
+ * The reference itself is expanded each time the command runs. VAR_END
+ * ends a $NAME where a quote did, as in "$NAME"s.
+ */
+#define VAR_MARK            '\004'
+#define QUOTED_VAR_MARK     '\005'
+#define VAR_END             '\006'
+
+/*
+ * A command substitution, $(...) or `...`, keeps its command as typed
+ * between SUBST_MARK, or QUOTED_SUBST_MARK inside double quotes, and
+ * SUBST_END. The command runs each time the word is expanded.
+ */
+#define SUBST_MARK          '\016'
+#define QUOTED_SUBST_MARK   '\017'
+#define SUBST_END           '\020'
+
+/* the bytes starting an expansion of either kind */
+#define EXPANSION_MARKS     "\004\005\016\017"
+
+bool is_var_name_char(char ch, bool first);
+
+/* length of NAME in a NAME=value word, 0 if the word is no assignment */
+size_t assignment_name_len(const char* word);
+
+typedef enum
+{
+    TOKEN_END,
+    TOKEN_WORD,
+    TOKEN_PIPE,         /* | */
+    TOKEN_AMP,          /* & */
+    TOKEN_SEMI,         /* ; */
+    TOKEN_AND,          /* && */
+    TOKEN_OR,           /* || */
+    TOKEN_INPUT,        /* < */
+    TOKEN_OUTPUT,       /* > */
+    TOKEN_APPEND,       /* >> */
+    TOKEN_HEREDOC,      /* << */
+    TOKEN_HEREDOC_STRIP,    /* <<- */
+    TOKEN_HERESTRING,   /* <<< */
+    TOKEN_DUP_INPUT,    /* <& */
+    TOKEN_DUP_OUTPUT,   /* >& */
+    TOKEN_OUTPUT_ALL,   /* &> */
+    TOKEN_APPEND_ALL,   /* &>> */
+    TOKEN_ERROR
+} TokenType;
+
+typedef struct
+{
+    TokenType       type;
+    char*           text;   /* words only: slice of the line, quotes removed */
+    bool            pattern;    /* words only: has unquoted glob characters */
+    bool            expand;     /* words only: references variables */
+    bool            quoted;     /* words only: had quotes or backslashes */
+    int             fd;     /* redirections only: the number before the operator, -1 if none */
+} Token;
+
+/*
+ * The lexer works in place: quotes and escapes are removed by moving the
+ * rest of a word down, and every word is terminated inside the line buffer.
+ * All state lives in the Lexer, so several lines can be tokenized at once.
+ */
+typedef struct
+{
+    char*           pos;    /* next character to read */
+    char            saved;  /* character at pos overwritten by a word's '\0' */
+    const char*     error;
+} Lexer;
+
+void lexer_init(Lexer* lexer, char* line);
+TokenType lexer_next(Lexer* lexer, Token* token);
+const char* token_name(TokenType type);
+
+/*
+ * Mark the expansions of a line of a here-document body in place, as inside
+ * double quotes, except that a double quote stays literal. Sets *expand if
+ * there is any. Returns false with *error set for an unclosed substitution.
+ */
+bool mark_here_line(char* line, bool* expand, const char** error);
+
 /******************************************************************************
  * Command Utilities
  *****************************************************************************/
 
+/*
+ * A here-document or here-string. The body of a here-document comes from
+ * the lines after its command and is filled in once read; until then text
+ * is NULL. Unless literal, the text is marked like a double-quoted word.
+ */
+typedef struct
+{
+    char*           text;   /* everything given as stdin, final newline included */
+    const char*     delimiter;  /* NULL for a here-string */
+    bool            strip_tabs;     /* <<-, leading tabs are dropped from the body */
+    bool            literal;    /* the delimiter was quoted, the body is not expanded */
+} HereDoc;
+
+/*
+ * Descriptors 0 to 9 belong to redirections, as in bash. Those the shell
+ * keeps for itself are moved to SHELL_FD_BASE and up, where `exec 3>log`
+ * cannot close them behind its back.
+ */
+#define SHELL_FD_BASE   10
+
+typedef enum
+{
+    REDIRECT_INPUT,     /* n<file */
+    REDIRECT_OUTPUT,    /* n>file */
+    REDIRECT_APPEND,    /* n>>file */
+    REDIRECT_DUP,       /* n<&m or n>&m, closing n if the target is - */
+    REDIRECT_HERE       /* here-document or here-string on n */
+} RedirectType;
+
+typedef struct
+{
+    RedirectType    type;
+    int             fd;     /* the descriptor set up for the command */
+    char*           target;     /* file, or descriptor number or - to dup; NULL for a here-document */
+    HereDoc*        here;
+    int             source;     /* while the command starts: the descriptor opened for it or copied, -1 to close */
+} Redirect;
+
 typedef struct
 {
     int             argc;
-    char*           argv[MAX_ARGC];
+    char**          argv;   /* NULL terminated */
+    bool*           patterns;   /* per argument, whether it is a glob pattern; NULL if none is */
+    char**          assigns;    /* leading NAME=value words, NULL terminated; NULL if none */
+    bool            expand;     /* some word references variables */
+    char*           path;   /* resolved executable, filled in before launch */
+    char**          envp;   /* environment of the executable, filled in with path */
 
-    char*           input;
-    char*           output;
-    bool            append;
+    Redirect*       redirects;  /* applied in order, after the pipes; NULL if none */
+    int             redirc;
 
 } Command;
 
@@ -62,11 +239,31 @@ typedef struct
     int             cmdc;
     Command*        cmdv;
     bool            bg;
+    bool            timed;  /* started with the time keyword */
+    const char*     error;  /* syntax error of the line, NULL if none */
+
+    Arena*          arena;  /* holds the commands, may be shared by many lines */
 } CommandLine;
 
-void parse_command_line(CommandLine* command_line, char* line);
+void init_command_line(CommandLine* command_line, Arena* arena);
+
+/* the last redirection of fd, which is the one in effect; NULL if none */
+Redirect* find_redirect(Command* cmd, int fd);
+
+/* The words of the commands point into line, which must outlive them */
+bool parse_command_line(CommandLine* command_line, char* line);
+
+/*
+ * Parse the pipeline starting at token. It ends before ;, &&, || or the
+ * end of the line, or after &. The token following it is left in token.
+ */
+bool parse_pipeline(CommandLine* command_line, Lexer* lexer, Token* token);
+
+/* Parse the words starting at token as the arguments of one command, as after `for x in` */
+bool parse_word_list(CommandLine* command_line, Lexer* lexer, Token* token);
 
-void free_command_line(CommandLine* command_line);
+/* Append a word at len of dest so it reads back as one word, or count it when dest is NULL */
+int format_word(char* dest, int len, const char* word);
 
 int format_command_line(char* dest, CommandLine* command_line, bool bg);
 
@@ -0,0 +1,461 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "program.h"
+
+/******************************************************************************
+ * Code buffer
+ *****************************************************************************/
+void init_program(Program* program, Arena* arena)
+{
+    memset(program, 0, sizeof(Program));
+    program->arena = arena;
+    program->list_jump = -1;
+}
+
+void free_program(Program* program)
+{
+    free(program->code);
+    program->code = NULL;
+    program->count = 0;
+    program->capacity = 0;
+    free(program->here_buf);
+    program->here_buf = NULL;
+    program->here_capacity = 0;
+}
+
+void reset_program(Program* program)
+{
+    program->count = 0;
+    program->depth = 0;
+    program->list_jump = -1;
+    program->pending = 0;
+    program->error = NULL;
+    program->error_line = 0;
+    program->here_count = 0;
+    program->here_len = 0;
+}
+
+static int emit(Program* program, OpCode code, CommandLine* line, const char* text, int lineno)
+{
+    Instruction* op;
+
+    if (program->count == program->capacity) {
+        program->capacity = program->capacity > 0 ? program->capacity * 2 : 64;
+        program->code = (Instruction*)realloc(program->code, sizeof(Instruction) * program->capacity);
+    }
+
+    op = &program->code[program->count];
+    op->code = code;
+    op->target = -1;
+    op->line = line;
+    op->text = text;
+    op->lineno = lineno;
+
+    return program->count++;
+}
+
+/* point every jump of a chain linked through the targets at target */
+static void patch_chain(Program* program, int jump, int target)
+{
+    while (jump >= 0) {
+        int next = program->code[jump].target;
+
+        program->code[jump].target = target;
+        jump = next;
+    }
+}
+
+bool program_complete(Program* program)
+{
+    return program->depth == 0 && program->list_jump < 0 && program->here_count == 0;
+}
+
+
+/******************************************************************************
+ * Compiler
+ *****************************************************************************/
+static const char* keywords[] = {"if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for", NULL};
+
+static bool is_keyword(const char* word)
+{
+    int i;
+
+    for (i = 0; keywords[i] != NULL; i++) {
+        if (strcmp(keywords[i], word) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Drop the code of the input which is not complete yet, as bash parses a
+ * whole construct before running any of it, and stop there.
+ */
+static bool compile_error(Program* program, const char* message, int lineno)
+{
+    program->count = program->pending;
+    program->depth = 0;
+    program->list_jump = -1;
+    program->here_count = 0;
+    program->error = message;
+    program->error_line = lineno;
+    emit(program, OP_ERROR, NULL, message, lineno);
+
+    return false;
+}
+
+static bool token_error(Program* program, const char* token, int lineno)
+{
+    char* message = (char*)arena_alloc(program->arena, strlen(token) + 64);
+
+    sprintf(message, "syntax error near unexpected token `%s'", token);
+    return compile_error(program, message, lineno);
+}
+
+static Block* top_block(Program* program)
+{
+    return program->depth > 0 ? &program->blocks[program->depth - 1] : NULL;
+}
+
+/* a command or construct ended: it is what a pending && or || skips */
+static void command_done(Program* program)
+{
+    if (program->list_jump >= 0) {
+        program->code[program->list_jump].target = program->count;
+        program->list_jump = -1;
+    }
+    if (program->depth > 0) {
+        top_block(program)->empty = false;
+    }
+}
+
+static Block* open_block(Program* program, BlockType type, BlockState state)
+{
+    Block* block = &program->blocks[program->depth++];
+
+    block->type = type;
+    block->state = state;
+    block->start = program->count;
+    block->cond_jump = -1;
+    block->end_jumps = -1;
+    block->list_jump = program->list_jump;
+    block->empty = true;
+    program->list_jump = -1;
+
+    return block;
+}
+
+static void close_block(Program* program)
+{
+    Block* block = &program->blocks[--program->depth];
+
+    program->list_jump = block->list_jump;
+    command_done(program);
+}
+
+/*
+ * for NAME [in WORDS] ; do, the words are expanded when the loop starts.
+ * Without in, the loop runs over the positional parameters, which this
+ * shell has none of.
+ */
+static bool compile_for(Program* program, Lexer* lexer, Token* token, int lineno)
+{
+    CommandLine* words = NULL;
+    const char* name;
+    size_t i;
+
+    if (lexer_next(lexer, token) != TOKEN_WORD) {
+        return token_error(program, token_name(token->type), lineno);
+    }
+    for (i = 0; is_var_name_char(token->text[i], i == 0); i++) {
+    }
+    if (i == 0 || token->text[i] != '\0') {
+        char* message = (char*)arena_alloc(program->arena, strlen(token->text) + 32);
+
+        sprintf(message, "`%s': not a valid identifier", token->text);
+        return compile_error(program, message, lineno);
+    }
+    name = token->text;
+
+    lexer_next(lexer, token);
+    if (token->type == TOKEN_WORD && strcmp(token->text, "in") == 0) {
+        words = (CommandLine*)arena_alloc(program->arena, sizeof(CommandLine));
+        init_command_line(words, program->arena);
+        lexer_next(lexer, token);
+        if (!parse_word_list(words, lexer, token)) {
+            return compile_error(program, words->error, lineno);
+        }
+    }
+
+    if (token->type == TOKEN_SEMI) {
+        lexer_next(lexer, token);
+    } else if (token->type != TOKEN_END && (token->type != TOKEN_WORD || strcmp(token->text, "do") != 0)) {
+        return token_error(program, token->type == TOKEN_WORD ? token->text : token_name(token->type), lineno);
+    }
+
+    emit(program, OP_FOR_START, words, NULL, lineno);
+    open_block(program, BLOCK_FOR, BLOCK_WORDS)->cond_jump = emit(program, OP_FOR_NEXT, NULL, name, lineno);
+
+    return true;
+}
+
+/* a keyword in command position, token is left after it */
+static bool compile_keyword(Program* program, Lexer* lexer, Token* token, int lineno, bool* after_command)
+{
+    const char* word = token->text;
+    Block* block = top_block(program);
+    bool opens = strcmp(word, "if") == 0 || strcmp(word, "while") == 0 || strcmp(word, "until") == 0
+                 || strcmp(word, "for") == 0;
+
+    if (opens) {
+        if (program->depth == MAX_NESTING) {
+            return compile_error(program, "constructs nested too deeply", lineno);
+        }
+    } else if (program->list_jump >= 0) {
+        return token_error(program, word, lineno);
+    }
+
+    if (strcmp(word, "if") == 0) {
+        open_block(program, BLOCK_IF, BLOCK_CONDITION);
+    } else if (strcmp(word, "while") == 0 || strcmp(word, "until") == 0) {
+        open_block(program, word[0] == 'w' ? BLOCK_WHILE : BLOCK_UNTIL, BLOCK_CONDITION);
+    } else if (strcmp(word, "for") == 0) {
+        /* the words are read here, token is already past them */
+        return compile_for(program, lexer, token, lineno);
+    } else if (block == NULL || (block->empty && block->state != BLOCK_WORDS)) {
+        return token_error(program, word, lineno);
+    } else if (strcmp(word, "then") == 0 && block->type == BLOCK_IF && block->state == BLOCK_CONDITION) {
+        block->cond_jump = emit(program, OP_JUMP_IF_FAIL, NULL, NULL, lineno);
+        block->state = BLOCK_BODY;
+        block->empty = true;
+    } else if ((strcmp(word, "elif") == 0 || strcmp(word, "else") == 0)
+               && block->type == BLOCK_IF && block->state == BLOCK_BODY) {
+        int jump = emit(program, OP_JUMP, NULL, NULL, lineno);
+
+        program->code[jump].target = block->end_jumps;
+        block->end_jumps = jump;
+        program->code[block->cond_jump].target = program->count;
+        block->cond_jump = -1;
+        block->state = (word[2] == 'i') ? BLOCK_CONDITION : BLOCK_ELSE;
+        block->empty = true;
+    } else if (strcmp(word, "fi") == 0 && block->type == BLOCK_IF && block->state != BLOCK_CONDITION) {
+        if (block->state == BLOCK_BODY) {
+            /* no branch taken: the status is 0, not the one of the condition */
+            int jump = emit(program, OP_JUMP, NULL, NULL, lineno);
+
+            program->code[jump].target = block->end_jumps;
+            block->end_jumps = jump;
+            program->code[block->cond_jump].target = program->count;
+            emit(program, OP_CLEAR, NULL, NULL, lineno);
+        }
+        patch_chain(program, block->end_jumps, program->count);
+        close_block(program);
+        *after_command = true;
+    } else if (strcmp(word, "do") == 0 && block->state == BLOCK_WORDS) {
+        block->state = BLOCK_BODY;
+    } else if (strcmp(word, "do") == 0 && block->type != BLOCK_IF && block->state == BLOCK_CONDITION) {
+        block->cond_jump = emit(program, block->type == BLOCK_WHILE ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK, NULL, NULL, lineno);
+        block->state = BLOCK_BODY;
+        block->empty = true;
+    } else if (strcmp(word, "done") == 0 && block->type != BLOCK_IF && block->state == BLOCK_BODY) {
+        int jump = emit(program, OP_JUMP, NULL, NULL, lineno);
+
+        program->code[jump].target = (block->type == BLOCK_FOR) ? block->cond_jump : block->start;
+        program->code[block->cond_jump].target = program->count;
+        if (block->type != BLOCK_FOR) {
+            /* the failed condition is not the status of the loop */
+            emit(program, OP_CLEAR, NULL, NULL, lineno);
+        }
+        close_block(program);
+        *after_command = true;
+    } else {
+        return token_error(program, word, lineno);
+    }
+
+    lexer_next(lexer, token);
+    return true;
+}
+
+/******************************************************************************
+ * Here-documents
+ *****************************************************************************/
+static bool queue_here_docs(Program* program, CommandLine* command_line, int lineno)
+{
+    int i, j;
+
+    for (i = 0; i < command_line->cmdc; i++) {
+        Command* cmd = &command_line->cmdv[i];
+
+        for (j = 0; j < cmd->redirc; j++) {
+            HereDoc* here = cmd->redirects[j].here;
+
+            if (here == NULL || here->text != NULL) {
+                continue;
+            }
+            if (program->here_count == MAX_HERE_DOCS) {
+                return compile_error(program, "too many here-documents", lineno);
+            }
+            if (program->here_count == 0) {
+                program->here_line = lineno;
+            }
+            program->here_docs[program->here_count].cmd = cmd;
+            program->here_docs[program->here_count].here = here;
+            program->here_count++;
+        }
+    }
+
+    return true;
+}
+
+static void here_append(Program* program, const char* text, size_t len)
+{
+    if (program->here_len + len + 1 > program->here_capacity) {
+        while (program->here_len + len + 1 > program->here_capacity) {
+            program->here_capacity = program->here_capacity > 0 ? program->here_capacity * 2 : 4096;
+        }
+        program->here_buf = (char*)realloc(program->here_buf, program->here_capacity);
+    }
+    memcpy(program->here_buf + program->here_len, text, len);
+    program->here_len += len;
+}
+
+/* the first open here-document gets the body read so far */
+static void close_here_doc(Program* program)
+{
+    program->here_docs[0].here->text = arena_strndup(program->arena, program->here_buf != NULL ? program->here_buf : "", program->here_len);
+    program->here_len = 0;
+    program->here_count--;
+    memmove(program->here_docs, program->here_docs + 1, sizeof(PendingHereDoc) * program->here_count);
+}
+
+/* a line of the body of the first open here-document, or its delimiter */
+static bool here_line(Program* program, char* line, int lineno)
+{
+    HereDoc* here = program->here_docs[0].here;
+    const char* error = NULL;
+    bool expand = false;
+
+    /* read lines keep their newline, the body gets exactly one per line */
+    line[strcspn(line, "\n")] = '\0';
+    if (here->strip_tabs) {
+        while (*line == '\t') {
+            line++;
+        }
+    }
+    if (strcmp(line, here->delimiter) == 0) {
+        close_here_doc(program);
+        return true;
+    }
+
+    if (!here->literal && !mark_here_line(line, &expand, &error)) {
+        return compile_error(program, error, lineno);
+    }
+    if (expand) {
+        program->here_docs[0].cmd->expand = true;
+    }
+    here_append(program, line, strlen(line));
+    here_append(program, "\n", 1);
+
+    return true;
+}
+
+
+/******************************************************************************
+ * Lines
+ *****************************************************************************/
+bool compile_line(Program* program, char* line, int lineno)
+{
+    Lexer lexer;
+    Token token;
+    bool after_command = false;  /* a separator or && and || may follow */
+
+    if (program->error != NULL) {
+        return false;
+    }
+    if (program->here_count > 0) {
+        return here_line(program, line, lineno);
+    }
+    if (program_complete(program)) {
+        program->pending = program->count;
+    }
+
+    lexer_init(&lexer, line);
+    lexer_next(&lexer, &token);
+    while (token.type != TOKEN_END) {
+        TokenType type = token.type;
+        Block* block = top_block(program);
+        CommandLine* command_line;
+
+        if (type == TOKEN_ERROR) {
+            return compile_error(program, lexer.error, lineno);
+        }
+
+        if (type == TOKEN_SEMI || type == TOKEN_AND || type == TOKEN_OR) {
+            if (!after_command) {
+                return token_error(program, token_name(type), lineno);
+            }
+            if (type != TOKEN_SEMI) {
+                program->list_jump = emit(program, type == TOKEN_AND ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK, NULL, NULL, lineno);
+            }
+            after_command = false;
+            lexer_next(&lexer, &token);
+            continue;
+        }
+
+        if (type == TOKEN_WORD && !after_command && is_keyword(token.text)
+            && (block == NULL || block->state != BLOCK_WORDS || strcmp(token.text, "do") == 0)) {
+            if (!compile_keyword(program, &lexer, &token, lineno, &after_command)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (after_command || (block != NULL && block->state == BLOCK_WORDS)) {
+            return token_error(program, type == TOKEN_WORD ? token.text : token_name(type), lineno);
+        }
+
+        command_line = (CommandLine*)arena_alloc(program->arena, sizeof(CommandLine));
+        init_command_line(command_line, program->arena);
+        if (!parse_pipeline(command_line, &lexer, &token)) {
+            return compile_error(program, command_line->error, lineno);
+        }
+        if (!queue_here_docs(program, command_line, lineno)) {
+            return false;
+        }
+        emit(program, OP_RUN, command_line, NULL, lineno);
+        command_done(program);
+        after_command = !command_line->bg;
+    }
+
+    return true;
+}
+
+bool finish_program(Program* program, int lineno)
+{
+    if (program->error != NULL) {
+        return false;
+    }
+    while (program->here_count > 0) {
+        /* bash takes what was read as the body and goes on, naming the last line */
+        if (lineno > 0) {
+            fprintf(stderr, "%s: line %d: warning: here-document at line %d delimited by end-of-file (wanted `%s')\n",
+                    PROGRAM_NAME, lineno - 1, program->here_line, program->here_docs[0].here->delimiter);
+        } else {
+            fprintf(stderr, "%s: warning: here-document delimited by end-of-file (wanted `%s')\n",
+                    PROGRAM_NAME, program->here_docs[0].here->delimiter);
+        }
+        close_here_doc(program);
+    }
+    if (!program_complete(program)) {
+        return compile_error(program, "syntax error: unexpected end of file", lineno);
+    }
+
+    return true;
+}
@@ -0,0 +1,109 @@
+#ifndef _PROGRAM_H_
+#define _PROGRAM_H_
+
+#include "parse.h"
+
+/******************************************************************************
+ * Programs: lists, if, while, until and for are compiled into a flat array
+ * of instructions over parsed pipelines. Every line is tokenized once, so a
+ * loop body runs from the same CommandLine records on each iteration.
+ *****************************************************************************/
+#define MAX_NESTING 64
+#define MAX_HERE_DOCS 16
+
+typedef enum {
+    OP_RUN,             /* run line */
+    OP_JUMP,            /* go to target */
+    OP_JUMP_IF_OK,      /* go to target if the last status is 0 */
+    OP_JUMP_IF_FAIL,    /* go to target if the last status is not 0 */
+    OP_CLEAR,           /* set the last status to 0 */
+    OP_FOR_START,       /* expand the words of line for a new loop, no words if line is NULL */
+    OP_FOR_NEXT,        /* assign the next word to text, or end the loop and go to target */
+    OP_ERROR            /* report the syntax error in text and stop */
+} OpCode;
+
+typedef struct {
+    OpCode code;
+    int target;
+    CommandLine* line;
+    const char* text;
+    int lineno;
+} Instruction;
+
+typedef enum {
+    BLOCK_IF,
+    BLOCK_WHILE,
+    BLOCK_UNTIL,
+    BLOCK_FOR
+} BlockType;
+
+typedef enum {
+    BLOCK_CONDITION,    /* between if/elif/while/until and then/do */
+    BLOCK_WORDS,        /* between for and do */
+    BLOCK_BODY,
+    BLOCK_ELSE
+} BlockState;
+
+/* a construct whose closing keyword has not been seen yet */
+typedef struct {
+    BlockType type;
+    BlockState state;
+    int start;  /* first instruction, loops jump back to it */
+    int cond_jump;  /* jump taken when the condition fails, -1 if none */
+    int end_jumps;  /* jumps to the end, chained through their targets */
+    int list_jump;  /* && or || jump over the whole construct, -1 if none */
+    bool empty;  /* no command since the last keyword */
+} Block;
+
+/* a here-document waiting for its body */
+typedef struct {
+    Command* cmd;  /* expands once the body turns out to need it */
+    HereDoc* here;
+} PendingHereDoc;
+
+typedef struct {
+    Instruction* code;
+    int count;
+    int capacity;
+
+    /* compiler state carried from line to line */
+    Block blocks[MAX_NESTING];
+    int depth;
+    int list_jump;  /* && or || jump over the next command, -1 if none */
+    int pending;  /* first instruction of the input which is not complete yet */
+    const char* error;  /* first syntax error, NULL if none */
+    int error_line;
+
+    /* here-documents whose body is read from the next lines, in order */
+    PendingHereDoc here_docs[MAX_HERE_DOCS];
+    int here_count;
+    int here_line;  /* line of the command of the first one */
+    char* here_buf;  /* the body read so far */
+    size_t here_len;
+    size_t here_capacity;
+
+    Arena* arena;  /* holds the command lines */
+} Program;
+
+void init_program(Program* program, Arena* arena);
+void free_program(Program* program);
+
+/* drop the instructions, to compile new input into the same program */
+void reset_program(Program* program);
+
+/*
+ * Compile one line of input, lineno counting from 1 (0 where lines are not
+ * numbered). The words point into line, which must outlive the program. A
+ * syntax error drops the code of the unfinished constructs and of the
+ * line, leaving an OP_ERROR in their place. While here-documents are open,
+ * lines go to their bodies instead.
+ */
+bool compile_line(Program* program, char* line, int lineno);
+
+/* every construct is closed, no && or || waits for its command and no here-document for its body */
+bool program_complete(Program* program);
+
+/* the input ended, an unfinished construct is a syntax error and an open here-document ends there */
+bool finish_program(Program* program, int lineno);
+
+#endif /* _PROGRAM_H_ */
@@ -6,12 +6,49 @@
 #include <pwd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
 #include <sys/unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031  /* only declared with _GNU_SOURCE */
+#define F_GETPIPE_SZ 1032
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U  /* memfd flags and seals, also _GNU_SOURCE only */
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+#endif
 
 #include "parse.h"
+#include "job.h"
+#include "builtin.h"
+#include "trace.h"
+#include "history.h"
+#include "editor.h"
+#include "glob.h"
+#include "vars.h"
+#include "program.h"
 
-#define PROGRAM_NAME "shell"
+extern char** environ;
 
 
 /******************************************************************************
@@ -23,483 +60,3175 @@ typedef enum {
 } ShellMode;
 
 
+JobList job_list;  /* the job list */
+Arena glob_arena;  /* expanded words and patterns of the lines running */
+VarStore vars;  /* shell variables, the exported ones are the environment of commands */
+
+
+/******************************************************************************
+ * Job scheduler state: background command lines queue up behind a limit
+ * on running jobs, and the reap path starts them as slots free up
+ *****************************************************************************/
+typedef struct {
+    JobQueue queue;
+    int limit;  /* jobs -j N, 0 while `&` is not throttled */
+    int running;  /* scheduled jobs not finished yet */
+    int quiet_pending;  /* jobs of the running `parallel`, queued or running */
+    int quiet_failed;
+    Arena arena;  /* command lines being started */
+} Scheduler;
+
+Scheduler scheduler;
+
+/* defined with the redirections */
+int shell_fd(int fd);
+
+/* these need the launcher, they are defined with it below */
+void start_queued_jobs();
+int jobs_builtin(Command* cmd);
+int parallel_builtin(Command* cmd);
+int exec_program_builtin(Command* cmd);
+
+/* these change the prompt, they are defined after it */
+void variable_changed(const char* name);
+void assign_variables(char** assigns);
+int export_builtin(Command* cmd);
+int unset_builtin(Command* cmd);
+
+void init_scheduler()
+{
+    init_job_queue(&scheduler.queue);
+    scheduler.limit = 0;
+    scheduler.running = 0;
+    scheduler.quiet_pending = 0;
+    scheduler.quiet_failed = 0;
+    arena_init(&scheduler.arena);
+}
+
+/* exit status of a stage as reported by $? in bash */
+int status_code(int stats)
+{
+    if (WIFSIGNALED(stats)) {
+        return 128 + WTERMSIG(stats);
+    }
+    return WEXITSTATUS(stats);
+}
+
+/* the status of a finished job is the one of its last stage */
+int job_status_code(Job* job)
+{
+    return status_code(job->stats[job->procc - 1]);
+}
+
+/* give back the slot of a finished job; quiet jobs are dropped, returns true then */
+bool finish_scheduled_job(Job* job)
+{
+    job->scheduled = false;
+    scheduler.running--;
+
+    if (!job->quiet) {
+        return false;
+    }
+
+    if (job_status_code(job) != 0) {
+        scheduler.quiet_failed++;
+    }
+    scheduler.quiet_pending--;
+    remove_job_list(&job_list, job->job_id);
+
+    return true;
+}
+
+
+/******************************************************************************
+ * Child reaping: SIGCHLD only marks that children exited, the shell reaps
+ * them at the next safe point and caches their status on the job list
+ *****************************************************************************/
+volatile sig_atomic_t sigchld_pending = 0;
+int sigchld_pfds[] = {-1, -1};  /* self-pipe, readable once children have exited */
+
+void sigchld_handler(int sig)
+{
+    int saved_errno = errno;
+    char ch = 0;
+    ssize_t written;
+
+    UNUSED(sig);
+
+    sigchld_pending = 1;
+    written = write(sigchld_pfds[1], &ch, 1);  /* a full pipe already means "pending" */
+    UNUSED(written);
+
+    errno = saved_errno;
+}
+
+void init_sigchld()
+{
+    struct sigaction action;
+    int i;
+
+    if (pipe(sigchld_pfds) == 0) {
+        for (i = 0; i < 2; i++) {
+            sigchld_pfds[i] = shell_fd(sigchld_pfds[i]);
+            fcntl(sigchld_pfds[i], F_SETFD, FD_CLOEXEC);
+            fcntl(sigchld_pfds[i], F_SETFL, O_NONBLOCK);
+        }
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+/* forked children that stay a shell must not report to the parent's self-pipe */
+void reset_child_signals()
+{
+    signal(SIGCHLD, SIG_DFL);
+}
+
+/* record a reaped child, returns its job once every stage of it ended */
+Job* child_exited(pid_t pid, int stats, const struct rusage* usage)
+{
+    Job* job = record_job_status(&job_list, pid, stats, usage);
+
+    if (job == NULL || job->running > 0) {
+        return NULL;
+    }
+    if (trace_on) {
+        trace_span("job", trace_time(&job->started), trace_time(&job->ended), job->pids[0], job->job_id + 1, job->cmd_str);
+    }
+    if (job->scheduled && finish_scheduled_job(job)) {
+        return NULL;
+    }
+
+    return job;
+}
+
+/*
+ * Reap every exited child and record its status on the job list. Only
+ * called while no foreground pipeline runs, so each child reaped here
+ * belongs to a background job. With notify, finished jobs are reported
+ * and dropped like bash does before a prompt, those reaped meanwhile by
+ * a foreground wait included. Freed scheduler slots are handed to queued
+ * jobs right away.
+ */
+void reap_children(bool notify)
+{
+    char buf[64];
+    struct rusage usage;
+    pid_t pid;
+    int stats, i;
+
+    if (sigchld_pending) {
+        sigchld_pending = 0;
+        while (read(sigchld_pfds[0], buf, sizeof(buf)) > 0) {
+            /* drain the self-pipe */
+        }
+
+        while ((pid = wait4(-1, &stats, WNOHANG, &usage)) > 0) {
+            child_exited(pid, stats, &usage);
+        }
+
+        start_queued_jobs();
+    }
+
+    for (i = 0; notify && job_list.ended > 0 && i <= job_list.top; i++) {
+        Job* job = &job_list.data[i];
+
+        if (job->available && job->running == 0) {
+            print_job(&job_list, job);
+            remove_job_list(&job_list, i);
+        }
+    }
+}
+
+
 /******************************************************************************
- * Job and job list
+ * Blocking on background jobs: every stage to wait for gets a pidfd in one
+ * epoll set, so each wakeup is the exit of a watched child. Where pidfds
+ * are missing or run out, a blocking waitpid(-1) takes over. Neither polls.
  *****************************************************************************/
+#define WAIT_EVENTS 64
+
 typedef struct {
+    int epfd;  /* -1 once waitpid(-1) is used instead */
+    int* pidfds;  /* by watch index, -1 after the child was reaped */
+    int count;
+    int capacity;
+    int pending;  /* pidfds still open */
+    int finished;  /* slot of a job that ended in the last wait, -1 if none */
+} ChildWaiter;
+
+ChildWaiter* active_waiter = NULL;  /* jobs the scheduler starts meanwhile join it */
+
+void init_child_waiter(ChildWaiter* waiter)
+{
+#ifdef __linux__
+    waiter->epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+    waiter->epfd = -1;
+#endif
+    waiter->pidfds = NULL;
+    waiter->count = waiter->capacity = 0;
+    waiter->pending = 0;
+    waiter->finished = -1;
+    active_waiter = waiter;
+}
+
+void close_child_pidfds(ChildWaiter* waiter)
+{
+    int i;
+
+    for (i = 0; i < waiter->count; i++) {
+        if (waiter->pidfds[i] >= 0) {
+            close(waiter->pidfds[i]);
+        }
+    }
+    waiter->count = waiter->pending = 0;
+}
+
+void free_child_waiter(ChildWaiter* waiter)
+{
+    close_child_pidfds(waiter);
+    free(waiter->pidfds);
+    if (waiter->epfd >= 0) {
+        close(waiter->epfd);
+    }
+    active_waiter = NULL;
+}
+
+/* watch the running stages of a job */
+void watch_job(ChildWaiter* waiter, Job* job)
+{
+#ifdef __linux__
+    int i;
+
+    for (i = 0; waiter->epfd >= 0 && i < job->procc; i++) {
+        struct epoll_event event;
+        int fd;
+
+        if (job->stats[i] != -1) {
+            continue;
+        }
+
+        fd = (int)syscall(SYS_pidfd_open, job->pids[i], 0);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        if (waiter->count == waiter->capacity) {
+            waiter->capacity = waiter->capacity > 0 ? waiter->capacity * 2 : 16;
+            waiter->pidfds = (int*)realloc(waiter->pidfds, sizeof(int) * waiter->capacity);
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t)job->pids[i] << 32) | (uint32_t)waiter->count;
+        if (fd < 0 || epoll_ctl(waiter->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            /* no pidfd (old kernel, out of descriptors): every child goes through waitpid */
+            if (fd >= 0) close(fd);
+            close_child_pidfds(waiter);
+            close(waiter->epfd);
+            waiter->epfd = -1;
+            return;
+        }
+
+        waiter->pidfds[waiter->count++] = fd;
+        waiter->pending++;
+    }
+#else
+    UNUSED(waiter);
+    UNUSED(job);
+#endif
+}
+
+void waiter_child_exited(ChildWaiter* waiter, pid_t pid, int stats, const struct rusage* usage)
+{
+    Job* job = child_exited(pid, stats, usage);
+
+    if (job != NULL) {
+        waiter->finished = job->job_id;
+    }
+}
+
+/*
+ * Block until children exit and record them, the scheduler refills its
+ * slots on the way. Returns false when there is no child left to wait for.
+ */
+bool wait_for_children(ChildWaiter* waiter)
+{
+    struct rusage usage;
+    int stats;
     pid_t pid;
-    CommandLine* cmd_ln;
-    char* wc;
-    bool available;
-    int job_id;
-    int flag;  /* 1 for -, 0 for + */
-} Job;
 
-typedef struct {
-    Job* data;
-    int top;
-} JobList;
+    waiter->finished = -1;
+
+#ifdef __linux__
+    if (waiter->epfd >= 0 && waiter->pending > 0) {
+        struct epoll_event events[WAIT_EVENTS];
+        int i, count = epoll_wait(waiter->epfd, events, WAIT_EVENTS, -1);
+
+        for (i = 0; i < count; i++) {
+            int idx = (int)(events[i].data.u64 & 0xffffffffu);
+
+            pid = (pid_t)(events[i].data.u64 >> 32);
+            close(waiter->pidfds[idx]);
+            waiter->pidfds[idx] = -1;
+            waiter->pending--;
+
+            if (wait4(pid, &stats, WNOHANG, &usage) == pid) {
+                waiter_child_exited(waiter, pid, stats, &usage);
+            }
+        }
+        start_queued_jobs();
+
+        return count >= 0 || errno == EINTR;
+    }
+#endif
+
+    pid = wait4(-1, &stats, 0, &usage);
+    if (pid < 0) {
+        return errno == EINTR;
+    }
+    waiter_child_exited(waiter, pid, stats, &usage);
+    start_queued_jobs();
+
+    return true;
+}
+
+bool has_running_jobs()
+{
+    int i;
+
+    for (i = 0; i <= job_list.top; i++) {
+        if (job_list.data[i].available && job_list.data[i].running > 0) {
+            return true;
+        }
+    }
+
+    return scheduler.queue.count > 0;
+}
+
+/*
+ * wait [-n] [%job | pid ...]
+ * Wait for the given jobs, or for every job including queued ones, and
+ * drop them from the job list. The status is the one of the last job
+ * given, 0 with none. With -n, return as soon as one of them ends.
+ */
+int wait_builtin(Command* cmd)
+{
+    ChildWaiter waiter;
+    int* targets;
+    int i, first = 1, targetc = 0, status = EXIT_SUCCESS;
+    bool any = false;
+
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "-n") == 0) {
+        any = true;
+        first = 2;
+    }
+
+    reap_children(false);
+
+    /* slots of the jobs to wait for, -1 for an unknown one */
+    targets = (int*)malloc(sizeof(int) * (cmd->argc + 1));
+    for (i = first; i < cmd->argc; i++) {
+        char* arg = cmd->argv[i];
+        Job* job = (arg[0] == '%') ? find_job_spec(&job_list, arg) : find_job_pid(&job_list, (pid_t)atoi(arg));
+
+        if (job == NULL) {
+            if (arg[0] == '%') {
+                fprintf(stderr, "%s: wait: %s: no such job\n", PROGRAM_NAME, arg);
+            } else {
+                fprintf(stderr, "%s: wait: pid %s is not a child of this shell\n", PROGRAM_NAME, arg);
+            }
+        }
+        targets[targetc++] = (job != NULL) ? job->job_id : -1;
+    }
+
+    init_child_waiter(&waiter);
+
+    if (targetc == 0) {
+        for (i = 0; i <= job_list.top; i++) {
+            if (job_list.data[i].available) {
+                watch_job(&waiter, &job_list.data[i]);
+            }
+        }
+
+        if (any) {
+            status = 127;  /* nothing to wait for */
+            while (has_running_jobs() && wait_for_children(&waiter)) {
+                if (waiter.finished >= 0) {
+                    status = job_status_code(&job_list.data[waiter.finished]);
+                    remove_job_list(&job_list, waiter.finished);
+                    break;
+                }
+            }
+        } else {
+            while (has_running_jobs() && wait_for_children(&waiter)) {
+                /* every completion comes back here once */
+            }
+            for (i = job_list.top; i >= 0; i--) {
+                if (job_list.data[i].available && job_list.data[i].running == 0) {
+                    remove_job_list(&job_list, i);
+                }
+            }
+        }
+    } else {
+        for (i = 0; i < targetc; i++) {
+            if (targets[i] >= 0) {
+                watch_job(&waiter, &job_list.data[targets[i]]);
+            }
+        }
+
+        if (any) {
+            status = 127;
+            for (;;) {
+                Job* done = NULL;
+
+                for (i = 0; i < targetc && done == NULL; i++) {
+                    if (targets[i] >= 0 && job_list.data[targets[i]].available && job_list.data[targets[i]].running == 0) {
+                        done = &job_list.data[targets[i]];
+                    }
+                }
+                if (done != NULL) {
+                    status = job_status_code(done);
+                    remove_job_list(&job_list, done->job_id);
+                    break;
+                }
+                if (!wait_for_children(&waiter)) {
+                    break;
+                }
+            }
+        } else {
+            for (i = 0; i < targetc; i++) {
+                /* by slot: jobs started meanwhile may move the table */
+                if (targets[i] < 0) {
+                    status = 127;
+                    continue;
+                }
+                if (!job_list.data[targets[i]].available) {  /* given twice */
+                    continue;
+                }
+
+                while (job_list.data[targets[i]].running > 0 && wait_for_children(&waiter)) {
+                    /* until this one ends */
+                }
+                if (job_list.data[targets[i]].running > 0) {
+                    status = 127;
+                    continue;
+                }
+                status = job_status_code(&job_list.data[targets[i]]);
+                remove_job_list(&job_list, targets[i]);
+            }
+        }
+    }
+
+    free_child_waiter(&waiter);
+    free(targets);
+
+    return status;
+}
+
+
+/******************************************************************************
+ * Utilities
+ *****************************************************************************/
+/* resolved once at startup, the prompt never asks NSS again */
+typedef struct {
+    char user[BUF_SIZE];
+    char home[BUF_SIZE];
+    char host[BUF_SIZE];
+    char cwd[BUF_SIZE];  /* tracked by cd */
+    char cwd_alias[BUF_SIZE];  /* cwd where $HOME is replaced by ~ */
+    bool root;
+} ShellInfo;
+
+ShellInfo shell_info;
+
+/* replace $HOME with ~ */
+void alias_home_path(char* dest, char* src)
+{
+    char* home_path = shell_info.home;
+    size_t home_len = strlen(home_path);
+    char alias_path[BUF_SIZE];
+
+    /* only whole path components match, /home/ab is not under /home/a */
+    if (home_len > 1 && strstartswith(src, home_path) && (src[home_len] == '\0' || src[home_len] == '/')) {
+        strcpy(alias_path, "~");
+        strcat(alias_path, src + home_len);
+    } else {
+        strcpy(alias_path, src);
+    }
+
+    strcpy(dest, alias_path);
+}
+
+/* refresh the cached working directory, called after every chdir */
+void update_cwd()
+{
+    if (getcwd(shell_info.cwd, sizeof(shell_info.cwd)) == NULL) {
+        strcpy(shell_info.cwd, ".");
+    }
+    alias_home_path(shell_info.cwd_alias, shell_info.cwd);
+}
+
+void init_shell_info()
+{
+    uid_t uid;
+    struct passwd* pwd;
+    char* home_env = getenv("HOME");
+
+    /* get uid */
+    uid = geteuid();
+    shell_info.root = (uid == 0);
+    /* get user profile */
+    pwd = getpwuid(uid);
+    if (pwd) {
+        strncpy(shell_info.user, pwd->pw_name, BUF_SIZE - 1);
+        strncpy(shell_info.home, pwd->pw_dir, BUF_SIZE - 1);
+    } else {  /* failed to get username */
+        fprintf(stderr, "%s: cannot find username for UID %u\n", PROGRAM_NAME, (unsigned)uid);
+        exit(EXIT_FAILURE);
+    }
+
+    /* $HOME wins over the password database, like in bash */
+    if (home_env != NULL && *home_env != '\0') {
+        strncpy(shell_info.home, home_env, BUF_SIZE - 1);
+    }
+    if (strlen(shell_info.home) > 1) {
+        path_eliminate_tail_slash(shell_info.home);
+    }
+
+    if (gethostname(shell_info.host, sizeof(shell_info.host) - 1) < 0) {
+        strcpy(shell_info.host, "localhost");
+    }
+
+    update_cwd();
+}
+
+/* get username */
+void get_username(char* dest)
+{
+    strcpy(dest, shell_info.user);
+}
+
+/* get $HOME, e.g. /home/wyh */
+void get_home_path(char* dest)
+{
+    strcpy(dest, shell_info.home);
+}
+
+/* get current working directory where $HOME is replaced by ~ */
+void get_cwd_with_alias_home(char* dest)
+{
+    strcpy(dest, shell_info.cwd_alias);
+}
+
+/******************************************************************************
+ * Command hash table: command name -> absolute path of the executable
+ *****************************************************************************/
+#define CMD_HASH_BUCKETS 64
+
+typedef struct HashEntry {
+    char* name;
+    char* path;
+    int hits;
+    bool pinned;  /* set by `hash -p`, never dropped on PATH changes */
+    struct HashEntry* next;
+} HashEntry;
+
+typedef struct {
+    HashEntry* buckets[CMD_HASH_BUCKETS];
+    char* path_env;  /* $PATH the entries were resolved against */
+} CommandHash;
+
+CommandHash cmd_hash;  /* the command hash table */
+
+HashEntry** find_hash_entry(CommandHash* table, const char* name)
+{
+    HashEntry** entry = &table->buckets[strhash(name) % CMD_HASH_BUCKETS];
+
+    while (*entry != NULL && strcmp((*entry)->name, name) != 0) {
+        entry = &(*entry)->next;
+    }
+
+    return entry;
+}
+
+void remove_hash_entry(HashEntry** entry)
+{
+    HashEntry* removed = *entry;
+
+    *entry = removed->next;
+    free(removed->name);
+    free(removed->path);
+    free(removed);
+}
+
+HashEntry* insert_hash_entry(CommandHash* table, const char* name, const char* path, bool pinned)
+{
+    HashEntry** slot = find_hash_entry(table, name);
+    HashEntry* entry = *slot;
+
+    if (entry == NULL) {
+        entry = (HashEntry*)malloc(sizeof(HashEntry));
+        entry->name = (char*)malloc(strlen(name) + 1);
+        strcpy(entry->name, name);
+        entry->next = NULL;
+        *slot = entry;
+    } else {
+        free(entry->path);
+    }
+
+    entry->path = (char*)malloc(strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->hits = 0;
+    entry->pinned = pinned;
+
+    return entry;
+}
+
+/* drop all entries, the pinned ones only if `all` is set */
+void clear_command_hash(CommandHash* table, bool all)
+{
+    int i;
+
+    for (i = 0; i < CMD_HASH_BUCKETS; i++) {
+        HashEntry** entry = &table->buckets[i];
+
+        while (*entry != NULL) {
+            if (all || !(*entry)->pinned) {
+                remove_hash_entry(entry);
+            } else {
+                entry = &(*entry)->next;
+            }
+        }
+    }
+}
+
+/* forget every PATH-derived entry once $PATH differs from what they were resolved against */
+void check_path_changed(CommandHash* table)
+{
+    const char* path_env = get_var(&vars, "PATH");
+
+    if (path_env == NULL) {
+        path_env = "";
+    }
+
+    if (table->path_env != NULL && strcmp(table->path_env, path_env) == 0) {
+        return;
+    }
+
+    clear_command_hash(table, false);
+
+    free(table->path_env);
+    table->path_env = (char*)malloc(strlen(path_env) + 1);
+    strcpy(table->path_env, path_env);
+}
+
+bool is_executable_file(const char* path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/* walk $PATH for `name`, the result is written to dest */
+bool search_path(const char* path_env, const char* name, char* dest)
+{
+    const char* dir = path_env;
+
+    while (dir != NULL) {
+        const char* end = strchr(dir, ':');
+        size_t dir_len = (end != NULL) ? (size_t)(end - dir) : strlen(dir);
+
+        if (dir_len + strlen(name) + 2 <= BUF_SIZE) {
+            if (dir_len == 0) {  /* empty entry means the current directory */
+                strcpy(dest, ".");
+            } else {
+                memcpy(dest, dir, dir_len);
+                dest[dir_len] = '\0';
+            }
+            path_cat(dest, (char*)name);
+
+            if (is_executable_file(dest)) {
+                return true;
+            }
+        }
+
+        dir = (end != NULL) ? end + 1 : NULL;
+    }
+
+    return false;
+}
+
+/* resolve a command name to the path to execute, NULL if not found */
+const char* lookup_command(CommandHash* table, const char* name)
+{
+    HashEntry** slot;
+    HashEntry* entry;
+    char abs_path[BUF_SIZE];
+
+    if (strchr(name, '/') != NULL) {  /* explicit paths are never hashed */
+        return name;
+    }
+
+    slot = find_hash_entry(table, name);
+    if (*slot != NULL) {
+        if ((*slot)->pinned || is_executable_file((*slot)->path)) {
+            (*slot)->hits++;
+            return (*slot)->path;
+        }
+        /* the cached executable is gone, search again */
+        remove_hash_entry(slot);
+    }
+
+    if (!search_path(table->path_env, name, abs_path)) {
+        return NULL;
+    }
+
+    entry = insert_hash_entry(table, name, abs_path, false);
+    entry->hits++;
+
+    return entry->path;
+}
+
+void print_command_hash(CommandHash* table)
+{
+    int i;
+    bool empty = true;
+
+    for (i = 0; i < CMD_HASH_BUCKETS; i++) {
+        HashEntry* entry;
+
+        for (entry = table->buckets[i]; entry != NULL; entry = entry->next) {
+            if (empty) {
+                printf("hits\tcommand\n");
+                empty = false;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
+        }
+    }
+
+    if (empty) {
+        printf("hash: hash table empty\n");
+    }
+}
+
+/* hash [-r] [-p path name] [name ...] */
+int hash_builtin(Command* cmd)
+{
+    int i, status = EXIT_SUCCESS;
+
+    if (cmd->argc == 1) {
+        print_command_hash(&cmd_hash);
+        return status;
+    }
+
+    for (i = 1; i < cmd->argc; i++) {
+        char* arg = cmd->argv[i];
+
+        if (strcmp(arg, "-r") == 0) {
+            clear_command_hash(&cmd_hash, true);
+        } else if (strcmp(arg, "-p") == 0) {
+            if (i + 2 >= cmd->argc) {
+                fprintf(stderr, "%s: hash: usage: hash [-r] [-p pathname] [name ...]\n", PROGRAM_NAME);
+                return 2;
+            }
+            insert_hash_entry(&cmd_hash, cmd->argv[i + 2], cmd->argv[i + 1], true);
+            i += 2;
+        } else if (lookup_command(&cmd_hash, arg) == NULL) {
+            fprintf(stderr, "%s: hash: %s: not found\n", PROGRAM_NAME, arg);
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+const char* builtin_names[] = {"cd", "jobs", "kill", "hash", "launch", "pipestatus", "pwd", "exit",
+    "echo", "printf", "true", "false", "test", "[", "parallel", "wait", "set", "history", "export", "unset", "exec", NULL};
+
+bool is_builtin(const char* name)
+{
+    int i;
+
+    for (i = 0; builtin_names[i] != NULL; i++) {
+        if (strcmp(builtin_names[i], name) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool is_regular_file(const char* path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+/*
+ * cat with nothing but regular files to read is copied by the shell itself,
+ * in the kernel where possible. Options, - and devices go to the real cat.
+ */
+bool is_shell_cat(Command* cmd)
+{
+    int i;
+
+    if (cmd->argc <= 0 || strcmp(cmd->argv[0], "cat") != 0) {
+        return false;
+    }
+    if (cmd->argc == 1) {
+        Redirect* input = find_redirect(cmd, STDIN_FILENO);
+
+        return input != NULL && input->type == REDIRECT_INPUT && is_regular_file(input->target);
+    }
+    for (i = 1; i < cmd->argc; i++) {
+        if (cmd->argv[i][0] == '-' || !is_regular_file(cmd->argv[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* look up the executables of a command line in the parent, so the hash table fills up */
+void resolve_command_line(CommandLine* command_line)
+{
+    int i;
+
+    for (i = 0; i < command_line->cmdc; i++) {
+        Command* cmd = &command_line->cmdv[i];
+
+        if (cmd->argc > 0 && !is_builtin(cmd->argv[0])) {
+            cmd->path = (char*)lookup_command(&cmd_hash, cmd->argv[0]);
+            /* NAME=value words before a command only go to its environment */
+            cmd->envp = (cmd->assigns != NULL) ? overlay_envp(&vars, cmd->assigns, &glob_arena) : vars.envp;
+        }
+    }
+}
+
+
+/******************************************************************************
+ * Redirections: the parent opens every file a command redirects to before
+ * the command starts, so a failure is reported under the file's name and
+ * the command does not run. The started process, or the shell around a
+ * builtin, only dup2()s the descriptors in order.
+ *****************************************************************************/
+#define OUTPUT_CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH)
+
+/* move a descriptor of the shell's own out of the range left to redirections */
+int shell_fd(int fd)
+{
+    int moved;
+
+    if (fd < 0 || fd >= SHELL_FD_BASE) {
+        return fd;
+    }
+    moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    close(fd);
+
+    return moved;
+}
+
+/*
+ * Here-documents and here-strings are given as stdin in an anonymous
+ * memory file: the text is written once, sealed and rewound, so there is
+ * no temporary file on disk and no process feeding a pipe.
+ */
+int open_here_document(HereDoc* here)
+{
+    const char* text = here->text != NULL ? here->text : "";
+    size_t len = strlen(text), done = 0;
+    int fd;
+
+#if defined(__linux__) && defined(SYS_memfd_create)
+    fd = syscall(SYS_memfd_create, "here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    FILE* file = tmpfile();
+
+    fd = -1;
+    if (file != NULL) {
+        fd = fcntl(fileno(file), F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+        fclose(file);
+    }
+#endif
+    if (fd < 0) {
+        fprintf(stderr, "%s: cannot create temp file for here-document: %s\n", PROGRAM_NAME, strerror(errno));
+        return -1;
+    }
+
+    while (done < len) {
+        ssize_t n = write(fd, text + done, len - done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "%s: cannot write here-document: %s\n", PROGRAM_NAME, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        done += n;
+    }
+#ifdef __linux__
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    lseek(fd, 0, SEEK_SET);
+
+    return shell_fd(fd);
+}
+
+/*
+ * Report the failure of redirection idx where the ones before it sent
+ * stderr, as bash applies them in order: `2>/dev/null <missing` is silent.
+ */
+void redirect_error(Command* cmd, int idx, const char* name, const char* error)
+{
+    char message[BUF_SIZE + 128];
+    int fd = STDERR_FILENO;
+    int i;
+
+    for (i = idx - 1; i >= 0; i--) {
+        Redirect* redirect = &cmd->redirects[i];
+
+        if (redirect->fd != fd) {
+            continue;
+        }
+        if (redirect->type != REDIRECT_DUP || redirect->source < 0) {
+            fd = redirect->source;
+            break;
+        }
+        fd = redirect->source;  /* 2>&1 goes on with what 1 is at that point */
+    }
+    if (fd < 0) {
+        return;
+    }
+
+    sprintf(message, "%s: %.*s: %s\n", PROGRAM_NAME, BUF_SIZE, name, error);
+    if (write(fd, message, strlen(message)) < 0) {
+        /* nowhere left to report it */
+    }
+}
+
+/* the descriptor a dup copies, -1 to close; an unknown one is reported */
+bool dup_source(Command* cmd, int idx, int* source)
+{
+    Redirect* redirect = &cmd->redirects[idx];
+    const char* target = redirect->target;
+    long fd;
+    char* end;
+    int i;
+
+    if (strcmp(target, "-") == 0) {
+        *source = -1;
+        return true;
+    }
+    fd = strtol(target, &end, 10);
+    if (*target < '0' || *target > '9' || *end != '\0' || fd > INT_MAX) {
+        redirect_error(cmd, idx, target, "ambiguous redirect");
+        return false;
+    }
+
+    /* set up by an earlier redirection of the command, or open in the shell */
+    for (i = idx - 1; i >= 0 && cmd->redirects[i].fd != fd; i--) {
+    }
+    if (i >= 0 ? (cmd->redirects[i].source < 0) : (fd >= SHELL_FD_BASE || fcntl(fd, F_GETFD) < 0)) {
+        redirect_error(cmd, idx, target, strerror(EBADF));
+        return false;
+    }
+    *source = fd;
+
+    return true;
+}
+
+void close_redirects(Command* cmd)
+{
+    int i;
+
+    for (i = 0; i < cmd->redirc; i++) {
+        Redirect* redirect = &cmd->redirects[i];
+
+        if (redirect->type != REDIRECT_DUP && redirect->source >= 0) {
+            close(redirect->source);
+        }
+        redirect->source = -1;
+    }
+}
+
+/* open the files of the redirections of cmd into their source, reporting the first failure */
+bool open_redirects(Command* cmd)
+{
+    int i;
+
+    for (i = 0; i < cmd->redirc; i++) {
+        Redirect* redirect = &cmd->redirects[i];
+        int fd = -1;
+
+        switch (redirect->type) {
+        case REDIRECT_INPUT:
+            fd = open(redirect->target, O_RDONLY | O_CLOEXEC);
+            break;
+        case REDIRECT_OUTPUT:
+        case REDIRECT_APPEND:
+            fd = open(redirect->target, O_WRONLY | O_CREAT | O_CLOEXEC
+                      | (redirect->type == REDIRECT_APPEND ? O_APPEND : O_TRUNC), OUTPUT_CREATE_MODE);
+            break;
+        case REDIRECT_HERE:
+            if ((redirect->source = open_here_document(redirect->here)) < 0) {
+                close_redirects(cmd);
+                return false;
+            }
+            continue;
+        case REDIRECT_DUP:
+            if (!dup_source(cmd, i, &redirect->source)) {
+                close_redirects(cmd);
+                return false;
+            }
+            continue;
+        }
+
+        if (fd < 0) {
+            redirect_error(cmd, i, redirect->target, strerror(errno));
+            close_redirects(cmd);
+            return false;
+        }
+        /* above the user's descriptors, so a later redirection cannot replace it first */
+        redirect->source = shell_fd(fd);
+    }
+
+    return true;
+}
+
+/* set up the descriptors of the opened redirections of cmd in this process */
+bool apply_redirects(Command* cmd)
+{
+    int i;
+
+    for (i = 0; i < cmd->redirc; i++) {
+        Redirect* redirect = &cmd->redirects[i];
+
+        if (redirect->source < 0) {
+            close(redirect->fd);
+        } else if (redirect->source == redirect->fd) {
+            /* n>&n keeps n, across exec too */
+            fcntl(redirect->fd, F_SETFD, 0);
+        } else if (dup2(redirect->source, redirect->fd) < 0) {
+            fprintf(stderr, "%s: %d: %s\n", PROGRAM_NAME, redirect->fd, strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/******************************************************************************
+ * Launch backends: fork + exec, or posix_spawn for plain external commands
+ *****************************************************************************/
+typedef enum {
+    launch_fork,
+    launch_spawn
+} LaunchBackend;
+
+typedef struct {
+    long count;
+    double total_us;
+    double min_us;
+    double max_us;
+} LaunchStats;
+
+LaunchBackend launch_backend = launch_spawn;
+bool launch_timing = false;  /* measure fork-to-exec latency of every launch */
+LaunchStats launch_stats[2];
+
+const char* launch_backend_names[] = {"fork", "spawn"};
+
+double elapsed_us(struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+void record_launch(LaunchBackend backend, struct timespec* start)
+{
+    LaunchStats* stats = &launch_stats[backend];
+    double us = elapsed_us(start);
+
+    if (stats->count == 0 || us < stats->min_us) {
+        stats->min_us = us;
+    }
+    if (us > stats->max_us) {
+        stats->max_us = us;
+    }
+    stats->total_us += us;
+    stats->count++;
+}
+
+void print_launch_stats()
+{
+    int i;
+
+    printf("backend: %s, timing: %s\n", launch_backend_names[launch_backend], launch_timing ? "on" : "off");
+    printf("%-8s%10s%12s%12s%12s\n", "", "launches", "mean_us", "min_us", "max_us");
+
+    for (i = 0; i < 2; i++) {
+        LaunchStats* stats = &launch_stats[i];
+
+        printf("%-8s%10ld%12.1f%12.1f%12.1f\n", launch_backend_names[i], stats->count,
+            stats->count > 0 ? stats->total_us / stats->count : 0.0, stats->min_us, stats->max_us);
+    }
+}
+
+/* launch [fork|spawn] [timing on|off] [reset] */
+int launch_builtin(Command* cmd)
+{
+    int i;
+
+    if (cmd->argc == 1) {
+        print_launch_stats();
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 1; i < cmd->argc; i++) {
+        char* arg = cmd->argv[i];
+
+        if (strcmp(arg, "fork") == 0) {
+            launch_backend = launch_fork;
+        } else if (strcmp(arg, "spawn") == 0) {
+            launch_backend = launch_spawn;
+        } else if (strcmp(arg, "reset") == 0) {
+            memset(launch_stats, 0, sizeof(launch_stats));
+        } else if (strcmp(arg, "timing") == 0 && i + 1 < cmd->argc) {
+            launch_timing = (strcmp(cmd->argv[++i], "on") == 0);
+        } else {
+            fprintf(stderr, "%s: launch: usage: launch [fork|spawn] [timing on|off] [reset]\n", PROGRAM_NAME);
+            return 2;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/******************************************************************************
+ * Pipe capacity and fill sampling: `set -o pipesize=N` sizes every pipeline
+ * pipe, `set -o pipestats` samples how full each pipe is while a foreground
+ * pipeline runs and reports it to stderr when the pipeline is done
+ *****************************************************************************/
+#define PIPE_SAMPLE_MS 5
+
+typedef struct {
+    long samples;
+    long full;  /* samples where the writer had to block */
+    long empty;  /* samples where the reader had to block */
+    double bytes;
+    int max_bytes;
+    int capacity;
+} PipeSamples;
+
+long pipe_size = 0;  /* capacity given to pipeline pipes, 0 for the kernel's default */
+bool pipe_stats = false;
+long subst_max = 0;  /* bytes kept of the output of a substitution, 0 for no limit */
+int subst_status = -1;  /* status of the last substitution of the line, -1 if none ran */
+
+/* 64k, 512K, 1M, 1m... as a byte count, -1 if malformed */
+long parse_size(const char* str)
+{
+    char* end;
+    long value = strtol(str, &end, 10);
+
+    if (end == str || value < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        default: break;
+    }
+
+    return *end == '\0' ? value : -1;
+}
+
+/* the kernel rounds the capacity up to a power of two pages, and caps it for unprivileged users */
+bool set_pipe_capacity(int fd, long size)
+{
+#ifdef __linux__
+    return size <= 0 || fcntl(fd, F_SETPIPE_SZ, (int)size) >= 0;
+#else
+    UNUSED(fd);
+    errno = ENOTSUP;
+    return size <= 0;
+#endif
+}
+
+/* pipe() for pipeline stages, sized as `set -o pipesize` asks */
+int open_pipe(int pfds[2])
+{
+    if (pipe(pfds) < 0) {
+        return -1;
+    }
+    set_pipe_capacity(pfds[1], pipe_size);
+
+    return 0;
+}
+
+/*
+ * The shell keeps no end of the pipes between stages, so each sample
+ * reopens one through /proc: the stdin of the reader, or the stdout of the
+ * writer when the reader's input is redirected. Nothing is read, the fd is
+ * only held for the FIONREAD.
+ */
+void sample_pipes(CommandLine* command_line, pid_t* pids, int* stats, PipeSamples* samples)
+{
+    char path[64];
+    int i;
+
+    for (i = 0; i + 1 < command_line->cmdc; i++) {
+        PipeSamples* sample = &samples[i];
+        struct stat st;
+        int fd, bytes = 0;
+
+        if (stats[i + 1] == -1 && find_redirect(&command_line->cmdv[i + 1], STDIN_FILENO) == NULL) {
+            sprintf(path, "/proc/%ld/fd/0", (long)pids[i + 1]);
+        } else if (stats[i] == -1 && pids[i] > 0 && find_redirect(&command_line->cmdv[i], STDOUT_FILENO) == NULL) {
+            sprintf(path, "/proc/%ld/fd/1", (long)pids[i]);
+        } else {
+            continue;
+        }
+
+        fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && ioctl(fd, FIONREAD, &bytes) == 0) {
+#ifdef __linux__
+            if (sample->capacity == 0) {
+                sample->capacity = fcntl(fd, F_GETPIPE_SZ);
+            }
+#endif
+            sample->samples++;
+            sample->bytes += bytes;
+            sample->full += (sample->capacity > 0 && bytes >= sample->capacity);
+            sample->empty += (bytes == 0);
+            if (bytes > sample->max_bytes) {
+                sample->max_bytes = bytes;
+            }
+        }
+        close(fd);
+    }
+}
+
+/* one row per pipe; a pipe mostly full waits on its reader, mostly empty on its writer */
+void print_pipe_samples(CommandLine* command_line, PipeSamples* samples)
+{
+    int i;
+
+    fprintf(stderr, "%-8s%10s%10s%10s%10s%8s%8s  %s\n", "pipe", "capacity", "samples", "avg_fill", "max_fill",
+        "full%", "empty%", "bound by");
+    for (i = 0; i + 1 < command_line->cmdc; i++) {
+        PipeSamples* sample = &samples[i];
+        double count = sample->samples > 0 ? sample->samples : 1;
+        double full = 100.0 * sample->full / count, empty = 100.0 * sample->empty / count;
+        const char* bound = "-";
+        char name[32];
+
+        if (sample->samples > 0 && full >= 50) {
+            bound = command_line->cmdv[i + 1].argv[0];
+        } else if (sample->samples > 0 && empty >= 50) {
+            bound = command_line->cmdv[i].argv[0];
+        }
+
+        sprintf(name, "%d|%d", i + 1, i + 2);
+        fprintf(stderr, "%-8s%10d%10ld%10.0f%10d%8.1f%8.1f  %s\n", name, sample->capacity, sample->samples,
+            sample->bytes / count, sample->max_bytes, full, empty, bound);
+    }
+}
+
+/* set [-o|+o] [pipesize=N|pipestats]: without an option name, list them */
+int set_builtin(Command* cmd)
+{
+    int i;
+
+    if (cmd->argc == 1 || (cmd->argc == 2 && strcmp(cmd->argv[1], "-o") == 0)) {
+        if (pipe_size > 0) {
+            printf("%-15s\t%ld\n", "pipesize", pipe_size);
+        } else {
+            printf("%-15s\t%s\n", "pipesize", "default");
+        }
+        printf("%-15s\t%s\n", "pipestats", pipe_stats ? "on" : "off");
+        if (subst_max > 0) {
+            printf("%-15s\t%ld\n", "substmax", subst_max);
+        } else {
+            printf("%-15s\t%s\n", "substmax", "unlimited");
+        }
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 1; i + 1 < cmd->argc; i += 2) {
+        bool on = (strcmp(cmd->argv[i], "-o") == 0);
+        char* option = cmd->argv[i + 1];
+
+        if (!on && strcmp(cmd->argv[i], "+o") != 0) {
+            break;
+        }
+
+        if (strcmp(option, "pipestats") == 0) {
+            pipe_stats = on;
+        } else if (!on && strcmp(option, "pipesize") == 0) {
+            pipe_size = 0;
+        } else if (!on && strcmp(option, "substmax") == 0) {
+            subst_max = 0;
+        } else if (on && strncmp(option, "substmax=", 9) == 0) {
+            long size = parse_size(option + 9);
+
+            if (size <= 0) {
+                fprintf(stderr, "%s: set: %s: invalid size\n", PROGRAM_NAME, option + 9);
+                return EXIT_FAILURE;
+            }
+            subst_max = size;
+        } else if (on && strncmp(option, "pipesize=", 9) == 0) {
+            long size = parse_size(option + 9);
+            int pfds[2];
+            bool applied;
+
+            if (size < 0 || size > INT_MAX) {
+                fprintf(stderr, "%s: set: %s: invalid size\n", PROGRAM_NAME, option + 9);
+                return EXIT_FAILURE;
+            }
+
+            /* try it once here, so a size over the limit is reported now and not per pipeline */
+            if (pipe(pfds) < 0) {
+                fprintf(stderr, "%s: set: pipe: %s\n", PROGRAM_NAME, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            applied = set_pipe_capacity(pfds[1], size);
+            close(pfds[0]);
+            close(pfds[1]);
+            if (!applied) {
+                fprintf(stderr, "%s: set: pipesize: %s: %s\n", PROGRAM_NAME, option + 9, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            pipe_size = size;
+        } else {
+            fprintf(stderr, "%s: set: %s: invalid option name\n", PROGRAM_NAME, option);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (i < cmd->argc) {
+        fprintf(stderr, "%s: set: usage: set [-o|+o] [pipesize=N|pipestats|substmax=N]\n", PROGRAM_NAME);
+        return 2;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/******************************************************************************
+ * History: kept for interactive sessions only, in $SIMPLEBASH_HISTORY or
+ * ~/.simplebash_history. Input piped into the shell is neither logged nor
+ * !-expanded, as in bash.
+ *****************************************************************************/
+History history;
+bool tty_input = false;  /* stdin is a terminal */
+
+void open_history_file()
+{
+    char path[BUF_SIZE * 2];
+    char* env = getenv(HISTORY_ENV);
+
+    if (env != NULL) {
+        if (*env == '\0') {
+            return;  /* kept in memory only */
+        }
+        strncpy(path, env, sizeof(path) - 1);
+        path[sizeof(path) - 1] = '\0';
+    } else {
+        sprintf(path, "%s/%s", shell_info.home, HISTORY_FILE);
+    }
+
+    if (!open_history(&history, path)) {
+        fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, path, strerror(errno));
+    }
+}
+
+/* history [n]: the last n entries, all without n; history -s text: the entries containing text */
+int history_builtin(Command* cmd)
+{
+    if (cmd->argc == 3 && strcmp(cmd->argv[1], "-s") == 0) {
+        long matches[BUF_SIZE];
+        long n = count_history(&history) + 1;
+        int count = 0;
+
+        /* newest first, the last BUF_SIZE matches are shown oldest first */
+        while (count < BUF_SIZE && (n = search_history(&history, cmd->argv[2], n)) > 0) {
+            matches[count++] = n;
+        }
+        while (count-- > 0) {
+            size_t len;
+            const char* entry = get_history(&history, matches[count], &len);
+
+            printf("%5ld  %.*s\n", matches[count], (int)len, entry);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (cmd->argc > 2 || (cmd->argc == 2 && !isdigit((unsigned char)cmd->argv[1][0]))) {
+        fprintf(stderr, "%s: history: usage: history [n] | history -s text\n", PROGRAM_NAME);
+        return 2;
+    }
+
+    print_history(&history, cmd->argc == 2 ? atol(cmd->argv[1]) : 0);
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * plain external commands need nothing from the shell after exec, so they can
+ * be spawned; one not found is forked, to report it with its redirections
+ */
+bool can_spawn(Command* cmd)
+{
+    return launch_backend == launch_spawn && cmd->argc > 0 && cmd->path != NULL && !is_builtin(cmd->argv[0]);
+}
+
+/*
+ * Start an external command with posix_spawn. The pipe ends and then the
+ * opened redirections are applied as file actions: pipe_in/pipe_out become
+ * stdin/stdout, and every pipe end given is closed in the new process.
+ * The path is resolved already, can_spawn leaves the rest to fork.
+ */
+pid_t spawn_command(Command* cmd, int pipe_in, int pipe_out, int pipe_unused)
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid = -1;
+    int pipe_fds[3];
+    int i, err;
+
+    posix_spawn_file_actions_init(&actions);
+
+    if (pipe_in >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_in, STDIN_FILENO);
+    }
+    if (pipe_out >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, pipe_out, STDOUT_FILENO);
+    }
+
+    pipe_fds[0] = pipe_in;
+    pipe_fds[1] = pipe_out;
+    pipe_fds[2] = pipe_unused;
+    for (i = 0; i < 3; i++) {
+        if (pipe_fds[i] > STDERR_FILENO) {
+            posix_spawn_file_actions_addclose(&actions, pipe_fds[i]);
+        }
+    }
+
+    for (i = 0; i < cmd->redirc; i++) {
+        Redirect* redirect = &cmd->redirects[i];
+
+        if (redirect->source < 0) {
+            posix_spawn_file_actions_addclose(&actions, redirect->fd);
+        } else {
+            posix_spawn_file_actions_adddup2(&actions, redirect->source, redirect->fd);
+        }
+    }
+
+    err = posix_spawn(&pid, cmd->path, &actions, NULL, cmd->argv, cmd->envp);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, cmd->argv[0], strerror(err));
+        pid = -1;
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+
+    return pid;
+}
+
+
+/******************************************************************************
+ * Parse and execute commands
+ *****************************************************************************/
+int pipe_status[MAX_CMDS];  /* exit status of every stage of the last foreground pipeline */
+int pipe_status_count = 0;
+
+void set_pipe_status(int* stats, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        pipe_status[i] = status_code(stats[i]);
+    }
+    pipe_status_count = count;
+}
+
+/* $? of bash: the status of the last stage */
+int last_status()
+{
+    return pipe_status_count > 0 ? pipe_status[pipe_status_count - 1] : 0;
+}
+
+void print_pipe_status()
+{
+    int i;
+
+    for (i = 0; i < pipe_status_count; i++) {
+        printf(i == 0 ? "%d" : " %d", pipe_status[i]);
+    }
+    printf("\n");
+}
+
+int kill_process(Command* cmd)
+{
+    int i, status = EXIT_SUCCESS;
+
+    if (cmd->argc <= 1) {
+        fprintf(stderr, "kill: usage: kill pid");
+
+        return 2;
+    }
+
+    reap_children(false);
+
+    for (i = 1; i < cmd->argc; i++) {
+        pid_t pid;
+        bool is_job_id;
+        char* arg = cmd->argv[i];
+
+        is_job_id = strstartswith(arg, "%");
+
+        arg = strltrim(arg, "%");  /* trim beginning % */
+        pid = (pid_t)atoi(arg);
+
+        if (is_job_id) {
+            Job* job = find_job_spec(&job_list, cmd->argv[i]);
+            int j;
+
+            if (job == NULL) {
+                fprintf(stderr, "%s: kill: %s: no such job\n", PROGRAM_NAME, cmd->argv[i]);
+                status = EXIT_FAILURE;
+                continue;
+            }
+            for (j = 0; j < job->procc; j++) {
+                if (job->stats[j] == -1) {
+                    kill(job->pids[j], SIGKILL);
+                }
+            }
+            continue;
+        }
+
+        if (kill(pid, SIGKILL) < 0) {
+            fprintf(stderr, "%s: kill: (%s) - %s\n", PROGRAM_NAME, arg, strerror(errno));
+            status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+/* run cmd if it is a builtin, storing its exit status; returns false for anything else */
+bool exec_builtin(Command* cmd, int* status)
+{
+    bool builtin = true;
+    char* command_name;
+
+    if (cmd->argc <= 0) {
+        return false;
+    }
+
+    *status = EXIT_SUCCESS;
+
+    command_name = cmd->argv[0];
+    if (strcmp(command_name, "cd") == 0) {
+        char* dir;
+        char home_dir[BUF_SIZE];
+        if (cmd->argc == 1) {
+            get_home_path(home_dir);
+            dir = home_dir;
+        } else {
+            dir = cmd->argv[1];
+        }
+        if (chdir(dir) < 0) {
+            fprintf(stderr, "%s: cd: %s: No such file or directory\n", PROGRAM_NAME, dir);
+            *status = EXIT_FAILURE;
+        } else {
+            update_cwd();
+        }
+    } else if (strcmp(command_name, "jobs") == 0) {
+        *status = jobs_builtin(cmd);
+    } else if (strcmp(command_name, "parallel") == 0) {
+        *status = parallel_builtin(cmd);
+    } else if (strcmp(command_name, "wait") == 0) {
+        *status = wait_builtin(cmd);
+    } else if (strcmp(command_name, "set") == 0) {
+        *status = set_builtin(cmd);
+    } else if (strcmp(command_name, "history") == 0) {
+        *status = history_builtin(cmd);
+    } else if (strcmp(command_name, "export") == 0) {
+        *status = export_builtin(cmd);
+    } else if (strcmp(command_name, "unset") == 0) {
+        *status = unset_builtin(cmd);
+    } else if (strcmp(command_name, "exec") == 0) {
+        /* without a command, only redirections which are already in place */
+        *status = (cmd->argc > 1) ? exec_program_builtin(cmd) : EXIT_SUCCESS;
+    } else if (strcmp(command_name, "kill") == 0) {
+        *status = kill_process(cmd);
+    } else if (strcmp(command_name, "hash") == 0) {
+        *status = hash_builtin(cmd);
+    } else if (strcmp(command_name, "launch") == 0) {
+        *status = launch_builtin(cmd);
+    } else if (strcmp(command_name, "pipestatus") == 0) {
+        print_pipe_status();
+    } else if (strcmp(command_name, "pwd") == 0) {
+        printf("%s\n", shell_info.cwd);
+    } else if (strcmp(command_name, "exit") == 0) {
+        fflush(stdout);
+        exit(cmd->argc > 1 ? atoi(cmd->argv[1]) : last_status());
+    } else if (strcmp(command_name, "echo") == 0) {
+        *status = echo_builtin(cmd->argc, cmd->argv);
+    } else if (strcmp(command_name, "printf") == 0) {
+        *status = printf_builtin(cmd->argc, cmd->argv);
+    } else if (strcmp(command_name, "cat") == 0 && is_shell_cat(cmd)) {
+        *status = cat_builtin(cmd->argc, cmd->argv);
+    } else if (strcmp(command_name, "true") == 0) {
+        *status = EXIT_SUCCESS;
+    } else if (strcmp(command_name, "false") == 0) {
+        *status = EXIT_FAILURE;
+    } else if (strcmp(command_name, "test") == 0 || strcmp(command_name, "[") == 0) {
+        *status = test_builtin(cmd->argc, cmd->argv);
+    } else {
+        builtin = false;
+    }
+
+    return builtin;
+}
+
+void exec_command(Command* cmd)
+{
+    int status;
+
+    if(cmd->argc <= 0) return;
+
+    if(exec_builtin(cmd, &status)){
+        /* Exit child process, _exit leaves the parent's script stream alone */
+        fflush(stdout);
+        _exit(status);
+    }else{
+        /* the path has been resolved through the hash table by the parent shell */
+        if (cmd->path == NULL) {
+            fprintf(stderr, "%s: %s: command not found\n", PROGRAM_NAME, cmd->argv[0]);
+            _exit(127);
+        }
+
+        execve(cmd->path, cmd->argv, cmd->envp);
+
+        fprintf(stderr, "%s: %s: cannot execute\n", PROGRAM_NAME, cmd->argv[0]);
+        _exit(126);
+    }
+}
+
+/*
+ * Builtins running inside the shell get their redirections by swapping
+ * descriptors around the call. saved receives a copy of each descriptor
+ * replaced, -1 for one that was closed. stdout_fd (-1 for none) is the
+ * pipe stdout goes to before the command's own redirections.
+ */
+typedef struct {
+    int count;
+    int fds[MAX_REDIRECTS + 1];
+    int copies[MAX_REDIRECTS + 1];
+} SavedFds;
+
+static void save_fd(SavedFds* saved, int fd)
+{
+    int i;
+
+    for (i = 0; i < saved->count; i++) {
+        if (saved->fds[i] == fd) {
+            return;
+        }
+    }
+    saved->fds[saved->count] = fd;
+    saved->copies[saved->count] = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+    saved->count++;
+}
+
+/* descriptors from SHELL_FD_BASE up are the shell's own, a builtin must not swap them out */
+static bool builtin_fds_in_range(Command* cmd)
+{
+    int i;
+
+    for (i = 0; i < cmd->redirc; i++) {
+        if (cmd->redirects[i].fd >= SHELL_FD_BASE) {
+            fprintf(stderr, "%s: %s: %d: file descriptor out of range\n", PROGRAM_NAME, cmd->argv[0], cmd->redirects[i].fd);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool redirect_builtin(Command* cmd, int stdout_fd, SavedFds* saved)
+{
+    bool ok;
+    int i;
+
+    /* even unredirected: cat writes to fd 1 past what earlier builtins left in the buffer */
+    fflush(stdout);
+    saved->count = 0;
+    if (stdout_fd < 0 && cmd->redirc == 0) {
+        return true;
+    }
+    if (!builtin_fds_in_range(cmd) || !open_redirects(cmd)) {
+        return false;
+    }
+
+    if (stdout_fd >= 0) {
+        save_fd(saved, STDOUT_FILENO);
+        dup2(stdout_fd, STDOUT_FILENO);
+    }
+    for (i = 0; i < cmd->redirc; i++) {
+        save_fd(saved, cmd->redirects[i].fd);
+    }
+    ok = apply_redirects(cmd);
+    close_redirects(cmd);
+
+    return ok;
+}
+
+void restore_builtin(SavedFds* saved)
+{
+    int i;
+
+    fflush(stdout);
+    if (saved->count == 0) {
+        return;
+    }
+    clearerr(stdout);
+
+    for (i = saved->count - 1; i >= 0; i--) {
+        if (saved->copies[i] >= 0) {
+            dup2(saved->copies[i], saved->fds[i]);
+            close(saved->copies[i]);
+        } else {
+            close(saved->fds[i]);
+        }
+    }
+    saved->count = 0;
+}
+
+/*
+ * exec without a command keeps its redirections for the rest of the shell:
+ * after `exec 3>>log`, any number of `>&3` write to log without opening it
+ * again. Descriptors from 10 up are the shell's own.
+ */
+int exec_redirect_builtin(Command* cmd)
+{
+    bool ok;
+
+    if (!builtin_fds_in_range(cmd) || !open_redirects(cmd)) {
+        return EXIT_FAILURE;
+    }
+
+    fflush(stdout);
+    ok = apply_redirects(cmd);
+    close_redirects(cmd);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* exec with a command: the shell becomes it, with the redirections already applied */
+int exec_program_builtin(Command* cmd)
+{
+    const char* path = lookup_command(&cmd_hash, cmd->argv[1]);
+    char** envp = (cmd->assigns != NULL) ? overlay_envp(&vars, cmd->assigns, &glob_arena) : vars.envp;
+
+    if (path == NULL) {
+        fprintf(stderr, "%s: exec: %s: not found\n", PROGRAM_NAME, cmd->argv[1]);
+        return 127;
+    }
+
+    fflush(stdout);
+    signal(SIGPIPE, SIG_DFL);  /* run_builtin ignores it meanwhile, and that would outlive execve */
+    execve(path, cmd->argv + 1, envp);
+
+    fprintf(stderr, "%s: exec: %s: %s\n", PROGRAM_NAME, cmd->argv[1], strerror(errno));
+    return 126;
+}
+
+/*
+ * Run a builtin inside the shell, with output going to stdout_fd (-1 to keep
+ * stdout). SIGPIPE is ignored meanwhile: a reader that quits early makes the
+ * builtin's writes fail instead of killing the shell.
+ */
+int run_builtin(Command* cmd, int stdout_fd)
+{
+    struct sigaction ignore, old;
+    SavedFds saved;
+    int status = EXIT_FAILURE;
+    /* the conditions of loops never write, they skip the SIGPIPE switch */
+    bool silent = strcmp(cmd->argv[0], "true") == 0 || strcmp(cmd->argv[0], "false") == 0
+                  || strcmp(cmd->argv[0], "test") == 0 || strcmp(cmd->argv[0], "[") == 0;
+
+    if (cmd->argc == 1 && strcmp(cmd->argv[0], "exec") == 0) {
+        /* its redirections stay in place */
+        return exec_redirect_builtin(cmd);
+    }
+    if (!redirect_builtin(cmd, stdout_fd, &saved)) {
+        restore_builtin(&saved);
+        return status;
+    }
+
+    if (!silent) {
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore, &old);
+    }
+
+    exec_builtin(cmd, &status);
+
+    restore_builtin(&saved);
+    if (!silent) {
+        sigaction(SIGPIPE, &old, NULL);
+    }
+
+    return status;
+}
+
+/*
+ * Builtins which only produce output can feed a pipeline from the shell
+ * itself. Anything touching shell state (cd, exit, jobs...) must keep
+ * running in its own process there, as bash does.
+ */
+bool is_pipe_source_builtin(Command* cmd)
+{
+    const char* names[] = {"echo", "printf", "true", "false", "test", "[", "pwd", NULL};
+    int i;
+
+    if (cmd->argc <= 0) {
+        return false;
+    }
+    for (i = 0; names[i] != NULL; i++) {
+        if (strcmp(names[i], cmd->argv[0]) == 0) {
+            return true;
+        }
+    }
+
+    return is_shell_cat(cmd);
+}
+
+/* write end of the pipe fed by a builtin in the shell, -1 if none; forked stages close it */
+int pipe_source_fd = -1;
+
+/*
+ * Start stage idx of the pipeline with stdin/stdout connected to the given
+ * pipe ends (-1 for none). pfd_unused is the parent's read end of the pipe
+ * to the next stage, which the new process must not keep open.
+ */
+pid_t do_child_process(CommandLine* command_line, int idx, int pfd_input, int pfd_output, int pfd_unused)
+{
+    Command* cmd = &command_line->cmdv[idx];
+    struct timespec start;
+    int notify_pfds[] = {-1, -1};
+    double trace_start = 0, trace_forked = 0;
+    pid_t pid;
+
+    if (launch_timing) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    if (trace_on) {
+        trace_start = trace_now();
+    }
+
+    if (can_spawn(cmd)) {
+        /* posix_spawn only returns once the child has exec'd */
+        pid = spawn_command(cmd, pfd_input, pfd_output, pfd_unused);
+        if (launch_timing && pid > 0) {
+            record_launch(launch_spawn, &start);
+        }
+        if (trace_on && pid > 0) {
+            trace_span("spawn", trace_start, trace_now(), pid, 0, cmd->argv[0]);
+        }
+        return pid;
+    }
+
+    /* only an exec closes the pipe, a forked builtin would hold the shell until it exits */
+    if ((launch_timing || trace_on) && cmd->argc > 0 && !is_builtin(cmd->argv[0]) && pipe(notify_pfds) == 0) {
+        /* the write end disappears on exec, so EOF on the read end marks it */
+        fcntl(notify_pfds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(notify_pfds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    pid = fork();
+    if(pid == 0){
+        reset_child_signals();
+        init_scheduler();  /* queued lines belong to the parent shell */
+        if(notify_pfds[0] >= 0) close(notify_pfds[0]);
+        if(pfd_unused >= 0) close(pfd_unused);
+        if(pipe_source_fd >= 0){
+            close(pipe_source_fd);
+            pipe_source_fd = -1;
+        }
+
+        if(pfd_input >= 0){
+            /* Pipe stdin from the previous stage */
+            dup2(pfd_input, STDIN_FILENO);
+            close(pfd_input);
+        }
+        if(pfd_output >= 0){
+            /* Pipe stdout to the next stage */
+            dup2(pfd_output, STDOUT_FILENO);
+            close(pfd_output);
+        }
+
+        /* Redirections come after the pipes, 2>&1 | takes the pipe */
+        if(!apply_redirects(cmd)) _exit(EXIT_FAILURE);
+
+        exec_command(cmd);
+        _exit(EXIT_SUCCESS);
+    }
+
+    if (trace_on && pid > 0) {
+        trace_forked = trace_now();
+        trace_span("fork", trace_start, trace_forked, pid, 0, cmd->argc > 0 ? cmd->argv[0] : NULL);
+    }
+
+    if (notify_pfds[0] >= 0) {
+        char ch;
+
+        close(notify_pfds[1]);
+        while (read(notify_pfds[0], &ch, 1) < 0 && errno == EINTR) {}
+        close(notify_pfds[0]);
+
+        if (pid > 0 && launch_timing) {
+            record_launch(launch_fork, &start);
+        }
+        if (pid > 0 && trace_on) {
+            trace_span("exec", trace_forked, trace_now(), pid, 0, cmd->argv[0]);
+        }
+    }
+
+    return pid;
+}
+
+/*
+ * Start every stage of a command line from the shell itself, without
+ * waiting for them. The pipe to the next stage is created right before a
+ * stage starts, so the shell never holds more than three pipe ends. The
+ * pid of every stage is stored in pids, -1 for a stage which failed, and
+ * stats is set to -1 for the running ones.
+ *
+ * A foreground pipeline whose first stage is an output-only builtin runs
+ * that stage in the shell after the other stages are up, writing straight
+ * into the pipe: `echo x | cmd` costs one process instead of two. Its
+ * pid is 0 and its status is already in stats.
+ */
+void launch_command_line(CommandLine* command_line, pid_t* pids, int* stats)
+{
+    int i, first = 0, pfd_input = -1;
+
+    if (!command_line->bg && command_line->cmdc > 1 && is_pipe_source_builtin(&command_line->cmdv[0])) {
+        int pfds[2];
+
+        if (open_pipe(pfds) == 0) {
+            /* spawned and exec'd stages must not inherit the write end */
+            fcntl(pfds[1], F_SETFD, FD_CLOEXEC);
+            pfd_input = pfds[0];
+            pipe_source_fd = pfds[1];
+            first = 1;
+        }
+    }
+
+    for (i = first; i < command_line->cmdc; i++) {
+        int pfds[] = {-1, -1};
+
+        if (i < command_line->cmdc - 1 && open_pipe(pfds) < 0) {
+            fprintf(stderr, "%s: pipe: %s\n", PROGRAM_NAME, strerror(errno));
+        }
+
+        if (open_redirects(&command_line->cmdv[i])) {
+            pids[i] = do_child_process(command_line, i, pfd_input, pfds[1], pfds[0]);
+            close_redirects(&command_line->cmdv[i]);
+            stats[i] = pids[i] > 0 ? -1 : 127 << 8;  /* -1 while running */
+        } else {
+            /* the stage does not run, as in bash */
+            pids[i] = -1;
+            stats[i] = EXIT_FAILURE << 8;
+        }
+
+        /* the ends handed to the stage are not needed in the shell anymore */
+        if (pfd_input >= 0) close(pfd_input);
+        if (pfds[1] >= 0) close(pfds[1]);
+        pfd_input = pfds[0];
+    }
+
+    if (pipe_source_fd >= 0) {
+        double trace_start = trace_on ? trace_now() : 0;
+
+        pids[0] = 0;
+        stats[0] = run_builtin(&command_line->cmdv[0], pipe_source_fd) << 8;
+        if (trace_on) {
+            trace_span("builtin", trace_start, trace_now(), 0, 0, command_line->cmdv[0].argv[0]);
+        }
+        close(pipe_source_fd);
+        pipe_source_fd = -1;
+    }
+}
+
+/*
+ * Wait for every stage of a foreground pipeline still running. Any child
+ * is taken as it exits, one blocking call each: background jobs ending
+ * meanwhile are recorded and free their scheduler slots. The resource use
+ * of each stage lands in usage, zero for a stage run in the shell. With
+ * pipestats on, the wait wakes up every PIPE_SAMPLE_MS to sample the pipes.
+ */
+void wait_command_line(CommandLine* command_line, pid_t* pids, int* stats, struct rusage* usage)
+{
+    PipeSamples samples[MAX_CMDS];
+    int i, running = 0, procc = command_line->cmdc;
+    bool sampling = pipe_stats && procc > 1;
+
+    if (sampling) {
+        memset(samples, 0, sizeof(PipeSamples) * (procc - 1));
+    }
+
+    memset(usage, 0, sizeof(struct rusage) * procc);
+    for (i = 0; i < procc; i++) {
+        running += (stats[i] == -1);
+    }
+
+    while (running > 0) {
+        struct rusage child_usage;
+        int child_stats;
+        pid_t pid = wait4(-1, &child_stats, sampling ? WNOHANG : 0, &child_usage);
+
+        if (pid == 0) {
+            struct pollfd sigchld_poll;
+            char buf[64];
+
+            sample_pipes(command_line, pids, stats, samples);
+
+            /* the self-pipe only wakes us up early; sigchld_pending stays set for reap_children */
+            sigchld_poll.fd = sigchld_pfds[0];
+            sigchld_poll.events = POLLIN;
+            if (poll(&sigchld_poll, 1, PIPE_SAMPLE_MS) > 0) {
+                while (read(sigchld_pfds[0], buf, sizeof(buf)) > 0) {
+                    /* drain */
+                }
+            }
+            continue;
+        }
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  /* no children left: the stages were reaped elsewhere */
+        }
+
+        for (i = 0; i < procc && !(pids[i] == pid && stats[i] == -1); i++) {
+            /* find the stage */
+        }
+        if (i < procc) {
+            stats[i] = child_stats;
+            usage[i] = child_usage;
+            running--;
+        } else {
+            child_exited(pid, child_stats, &child_usage);
+            start_queued_jobs();
+        }
+    }
+
+    for (i = 0; i < procc; i++) {
+        if (stats[i] == -1) {
+            stats[i] = 127 << 8;
+        }
+    }
+
+    set_pipe_status(stats, procc);
+
+    if (sampling) {
+        fflush(stdout);
+        print_pipe_samples(command_line, samples);
+    }
+}
+
+void report_syntax_error(const char* error, int lineno)
+{
+    int stats = 2 << 8;
+
+    if (lineno > 0) {
+        fprintf(stderr, "%s: line %d: %s\n", PROGRAM_NAME, lineno, error);
+    } else {
+        fprintf(stderr, "%s: %s\n", PROGRAM_NAME, error);
+    }
+    set_pipe_status(&stats, 1);
+}
+
+/* bash's report of the time keyword: wall clock, then CPU of the shell and the stages */
+void print_times(struct timespec* start, struct rusage* self_start, struct rusage* usage, int count)
+{
+    struct timespec end;
+    struct rusage self;
+    double times[3];
+    const char* names[] = {"real", "user", "sys"};
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self);
+
+    times[0] = timespec_elapsed(start, &end);
+    times[1] = timeval_seconds(&self.ru_utime) - timeval_seconds(&self_start->ru_utime);
+    times[2] = timeval_seconds(&self.ru_stime) - timeval_seconds(&self_start->ru_stime);
+    for (i = 0; i < count; i++) {
+        times[1] += timeval_seconds(&usage[i].ru_utime);
+        times[2] += timeval_seconds(&usage[i].ru_stime);
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "\n");
+    for (i = 0; i < 3; i++) {
+        int minutes = (int)(times[i] / 60);
+
+        fprintf(stderr, "%s\t%dm%.3fs\n", names[i], minutes, times[i] - minutes * 60);
+    }
+}
+
+
+/******************************************************************************
+ * Job scheduler: start queued command lines while slots are free
+ *****************************************************************************/
+/* parse and launch one queued line as a scheduled background job */
+void start_queued_job(const char* line, bool quiet)
+{
+    CommandLine command_line;
+    pid_t pids[MAX_CMDS];
+    int stats[MAX_CMDS];
+    char cwd[BUF_SIZE];
+    Job* job;
+
+    /* the job keeps its own copy of the text, so the line is only needed until launch */
+    arena_reset(&scheduler.arena);
+    init_command_line(&command_line, &scheduler.arena);
+
+    if (!parse_command_line(&command_line, arena_strdup(&scheduler.arena, line)) || command_line.cmdc == 0) {
+        if (command_line.error != NULL) {
+            fprintf(stderr, "%s: %s\n", PROGRAM_NAME, command_line.error);
+        }
+        if (quiet) {
+            scheduler.quiet_failed += (command_line.error != NULL);
+            scheduler.quiet_pending--;
+        }
+        return;
+    }
+
+    command_line.bg = true;  /* no stage may run inside the shell */
+    resolve_command_line(&command_line);
+
+    fflush(stdout);
+    launch_command_line(&command_line, pids, stats);
+
+    get_cwd_with_alias_home(cwd);
+    job = append_job_list(&job_list, pids, command_line.cmdc, &command_line, cwd);
+    job->scheduled = true;
+    job->quiet = quiet;
+    scheduler.running++;
+    if (active_waiter != NULL) {
+        watch_job(active_waiter, job);
+    }
+
+    if (job->running == 0) {  /* nothing could be started */
+        finish_scheduled_job(job);
+    }
+}
+
+void start_queued_jobs()
+{
+    QueuedJob* node;
+
+    while (scheduler.limit <= 0 || scheduler.running < scheduler.limit) {
+        node = pop_job_queue(&scheduler.queue);
+        if (node == NULL) {
+            break;
+        }
+        start_queued_job(node->line, node->quiet);
+        free(node);
+    }
+}
+
+/* a background line while jobs -j is set: queue its text, it is parsed again on start */
+void submit_command_line(CommandLine* command_line)
+{
+    char* line = (char*)malloc(format_command_line(NULL, command_line, false) + 1);
+
+    format_command_line(line, command_line, false);
+    push_job_queue(&scheduler.queue, line, false);
+    free(line);
+
+    start_queued_jobs();
+}
+
+int online_cpus()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+/* parse the value of -jN or -j N, -1 when there is none */
+int job_limit_option(Command* cmd, int* i)
+{
+    char* arg = cmd->argv[*i];
+
+    if (arg[2] != '\0') {
+        return atoi(arg + 2);
+    }
+    if (*i + 1 < cmd->argc) {
+        return atoi(cmd->argv[++*i]);
+    }
+
+    return -1;
+}
+
+/*
+ * jobs [-l|--stats] [-j [N]]: list the jobs, with the resource use of
+ * every stage for -l, or show/set the limit on running background jobs,
+ * 0 for none
+ */
+int jobs_builtin(Command* cmd)
+{
+    int i = 1;
+
+    reap_children(false);
+
+    if (cmd->argc == 1) {
+        print_job_list(&job_list, false);
+        return EXIT_SUCCESS;
+    }
+
+    if (cmd->argc == 2 && (strcmp(cmd->argv[1], "-l") == 0 || strcmp(cmd->argv[1], "--stats") == 0)) {
+        print_job_list(&job_list, true);
+        return EXIT_SUCCESS;
+    }
+
+    if (strncmp(cmd->argv[1], "-j", 2) != 0 || (cmd->argc > 2 && cmd->argv[1][2] != '\0')) {
+        fprintf(stderr, "%s: jobs: usage: jobs [-l|--stats] [-j [N]]\n", PROGRAM_NAME);
+        return 2;
+    }
+
+    if (cmd->argc == 2 && cmd->argv[1][2] == '\0') {
+        printf("limit %d, running %d, queued %d\n", scheduler.limit, scheduler.running, scheduler.queue.count);
+        return EXIT_SUCCESS;
+    }
+
+    scheduler.limit = job_limit_option(cmd, &i);
+    if (scheduler.limit < 0) {
+        scheduler.limit = 0;
+    }
+    start_queued_jobs();
+
+    return EXIT_SUCCESS;
+}
+
+/* copy of word with every {} replaced by arg, or word itself without any */
+char* replace_braces(Arena* arena, char* word, const char* arg, bool* replaced)
+{
+    const char* p;
+    char* result;
+    int count = 0, len = 0, arg_len = strlen(arg);
+
+    for (p = strstr(word, "{}"); p != NULL; p = strstr(p + 2, "{}")) {
+        count++;
+    }
+    if (count == 0) {
+        return word;
+    }
+
+    *replaced = true;
+    result = (char*)arena_alloc(arena, strlen(word) + count * arg_len + 1);
+    for (p = word; *p != '\0'; p++) {
+        if (p[0] == '{' && p[1] == '}') {
+            memcpy(result + len, arg, arg_len);
+            len += arg_len;
+            p++;
+        } else {
+            result[len++] = *p;
+        }
+    }
+    result[len] = '\0';
+
+    return result;
+}
+
+/* the command line of one argument of `parallel`, words argv[first..last) being the command */
+char* parallel_line(Arena* arena, Command* cmd, int first, int last, const char* arg)
+{
+    char** words;
+    char* line;
+    bool replaced = false;
+    int i, n = 0, len = 0;
+
+    if (first == last) {
+        return arena_strdup(arena, arg);
+    }
+
+    words = (char**)arena_alloc(arena, sizeof(char*) * (last - first + 1));
+    for (i = first; i < last; i++) {
+        words[n++] = replace_braces(arena, cmd->argv[i], arg, &replaced);
+    }
+    if (!replaced) {
+        words[n++] = (char*)arg;
+    }
+
+    /* quote every word, so an argument stays one word whatever it holds */
+    for (i = 0; i < n; i++) {
+        len = format_word(NULL, len, words[i]) + 1;
+    }
+    line = (char*)arena_alloc(arena, len + 1);
+    for (i = 0, len = 0; i < n; i++) {
+        if (i > 0) {
+            line[len++] = ' ';
+        }
+        len = format_word(line, len, words[i]);
+    }
+
+    return line;
+}
+
+void queue_parallel_line(Arena* arena, Command* cmd, int first, int last, const char* arg)
+{
+    ArenaMark mark = arena_mark(arena);
+
+    push_job_queue(&scheduler.queue, parallel_line(arena, cmd, first, last, arg), true);
+    scheduler.quiet_pending++;
+    arena_rewind(arena, mark);
+}
+
+/* every line of stdin, read with the descriptor so no stdio buffer steals any */
+char* read_input_lines(Arena* arena, size_t* size)
+{
+    size_t capacity = BUF_SIZE;
+    char* data = (char*)arena_alloc(arena, capacity);
+    ssize_t count;
+
+    *size = 0;
+    for (;;) {
+        if (*size + 1 >= capacity) {
+            char* grown = (char*)arena_alloc(arena, capacity * 2);
+
+            memcpy(grown, data, *size);
+            data = grown;
+            capacity *= 2;
+        }
+        count = read(STDIN_FILENO, data + *size, capacity - *size - 1);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        *size += count;
+    }
+    data[*size] = '\0';
+
+    return data;
+}
+
+/*
+ * parallel [-j N] [command ...] [::: argument ...]
+ * Run one background command line per argument with at most N running at
+ * once (the online CPU count by default), and wait for all of them. The
+ * arguments are the lines of stdin unless given after :::. With a command,
+ * each argument is added as its last word or replaces {} in its words;
+ * without one, each argument is a command line of its own. The status is
+ * the number of failed lines, up to 101.
+ */
+int parallel_builtin(Command* cmd)
+{
+    int i = 1, sep, limit = online_cpus(), saved_limit = scheduler.limit;
+    ChildWaiter waiter;
+    Arena arena;
+
+    if (i < cmd->argc && strncmp(cmd->argv[i], "-j", 2) == 0) {
+        limit = job_limit_option(cmd, &i);
+        i++;
+        if (limit <= 0) {
+            fprintf(stderr, "%s: parallel: usage: parallel [-j N] [command ...] [::: argument ...]\n", PROGRAM_NAME);
+            return 2;
+        }
+    }
+
+    for (sep = i; sep < cmd->argc && strcmp(cmd->argv[sep], ":::") != 0; sep++) {
+        /* find the arguments */
+    }
+
+    arena_init(&arena);
+    scheduler.quiet_failed = 0;
+
+    if (sep < cmd->argc) {
+        int j;
+
+        for (j = sep + 1; j < cmd->argc; j++) {
+            queue_parallel_line(&arena, cmd, i, sep, cmd->argv[j]);
+        }
+    } else {
+        size_t size;
+        char* input = read_input_lines(&arena, &size);
+        char* line;
+
+        for (line = input; line < input + size; line += strlen(line) + 1) {
+            char* end = strchr(line, '\n');
+
+            if (end != NULL) {
+                *end = '\0';
+            }
+            if (*line != '\0') {
+                queue_parallel_line(&arena, cmd, i, sep, line);
+            }
+        }
+    }
+
+    arena_free(&arena);
+
+    /* reap right here: the lines start as their predecessors exit */
+    scheduler.limit = limit;
+    init_child_waiter(&waiter);
+    start_queued_jobs();
+    while (scheduler.quiet_pending > 0 && wait_for_children(&waiter)) {
+        /* one wakeup per finished line */
+    }
+    free_child_waiter(&waiter);
+    scheduler.limit = saved_limit;
+
+    return scheduler.quiet_failed < 101 ? scheduler.quiet_failed : 101;
+}
+
+
+/* execute a parsed command line */
+void run_command_line(CommandLine* command_line)
+{
+    struct timespec start;
+    struct rusage self_start, usage[MAX_CMDS];
+    int waited = 0;  /* stages whose resource use is in usage */
+    double trace_start = trace_on ? trace_now() : 0;
+    CommandLine* source = command_line;  /* as typed, for jobs and the queue */
+    CommandLine substituted, expanded;
+    ArenaMark glob_mark = arena_mark(&glob_arena);
+
+    if (command_line->timed) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        getrusage(RUSAGE_SELF, &self_start);
+    }
+
+    /* variables first, their values may hold patterns */
+    subst_status = -1;
+    if (has_references(command_line)) {
+        command_line = expand_variables(&vars, command_line, &substituted, &glob_arena, last_status());
+        if (command_line == NULL) {
+            int stats = EXIT_FAILURE << 8;
+
+            set_pipe_status(&stats, 1);
+            arena_rewind(&glob_arena, glob_mark);
+            return;
+        }
+    }
+
+    if (has_patterns(command_line)) {
+        GlobCache cache;
+
+        init_glob_cache(&cache, &glob_arena);
+        command_line = expand_command_line(&cache, command_line, &expanded);
+        free_glob_cache(&cache);
+    }
+
+    if (command_line->cmdc > 0) {
+        Command* first = &command_line->cmdv[0];
+
+        if (command_line->cmdc == 1 && first->argc == 0) {
+            /* assignments alone set shell variables, the status is the one of a substitution */
+            int stats = (subst_status >= 0) ? subst_status << 8 : 0;
+
+            if (first->assigns != NULL) {
+                assign_variables(first->assigns);
+            }
+            set_pipe_status(&stats, 1);
+        }
+
+        if (command_line->cmdc == 1 && first->argc == 0 && first->redirc == 0) {
+            /* nothing left to run */
+        } else if (!command_line->bg && command_line->cmdc == 1 && first->argc > 0 && (is_builtin(first->argv[0]) || is_shell_cat(first))) {
+            /* a lone builtin in the foreground never forks, in the background it is a job */
+            int stats = run_builtin(first, -1) << 8;
+            set_pipe_status(&stats, 1);
+        } else {
+            pid_t pids[MAX_CMDS];
+            int stats[MAX_CMDS];
+
+            if (command_line->bg && scheduler.limit > 0) {
+                submit_command_line(source);
+                arena_rewind(&glob_arena, glob_mark);
+                return;
+            }
+
+            resolve_command_line(command_line);
 
-void init_job_list(JobList* list)
-{
-    int i;
-    list->data = (Job*)malloc(sizeof(Job) * BUF_SIZE);
-    list->top = -1;
+            fflush(stdout);
+            launch_command_line(command_line, pids, stats);
 
-    for (i = 0; i < BUF_SIZE; i++) {
-        (list->data[i]).available = false;
-        (list->data[i]).wc = NULL;
-        (list->data[i]).cmd_ln = NULL;
-        (list->data[i]).pid = -1;
-        (list->data[i]).job_id = -1;
-        (list->data[i]).flag = -1;
-    }
-}
+            if (!command_line->bg) {
+                double trace_wait = trace_on ? trace_now() : 0;
 
-void update_job_flag(JobList* list)
-{
-    int idx = list->top, idx2;
+                wait_command_line(command_line, pids, stats, usage);
+                waited = command_line->cmdc;
+                if (trace_on) {
+                    trace_span("wait", trace_wait, trace_now(), 0, 0, NULL);
+                }
+            } else {
+                char cwd[BUF_SIZE];
+                get_cwd_with_alias_home(cwd);
 
-    if (list->top < 0) {
-        return;
+                /* push a job to job list */
+                append_job_list(&job_list, pids, command_line->cmdc, source, cwd);
+            }
+        }
     }
 
-    list->data[list->top].flag = 0;
-
-    while (idx > 0 && (list->data[--idx]).available == false) {}
-    if (idx < list->top) {
-        list->data[idx].flag = 1;
+    if (command_line->timed && !command_line->bg) {
+        print_times(&start, &self_start, usage, waited);
     }
 
-    idx2 = idx;
-    while (idx2 > 0 && (list->data[--idx2]).available == false) {}
-    if (idx2 < idx) {
-        list->data[idx2].flag = -1;
+    if (trace_on) {
+        char* cmd_str = (char*)malloc(format_command_line(NULL, source, true) + 1);
+
+        format_command_line(cmd_str, source, true);
+        trace_span("line", trace_start, trace_now(), 0, 0, cmd_str);
+        free(cmd_str);
     }
+
+    arena_rewind(&glob_arena, glob_mark);
 }
 
-Job* append_job_list(JobList* list, pid_t pid, CommandLine* cmd_ln, char* wc)
+
+/******************************************************************************
+ * Programs: the compiled instructions of a script or of the lines typed
+ * run here. A for loop keeps its expanded words in glob_arena, below the
+ * marks of the lines it runs, and gives them back when it ends.
+ *****************************************************************************/
+typedef struct {
+    char** words;
+    int count;
+    int next;
+    ArenaMark mark;  /* glob_arena before the words */
+} ForLoop;
+
+/* the words of a for loop are expanded like the arguments of a command */
+void start_for_loop(ForLoop* loop, CommandLine* words)
 {
-    ++list->top;
+    CommandLine substituted, expanded;
 
-    (list->data[list->top]).pid = pid;
-    (list->data[list->top]).cmd_ln = cmd_ln;
-    (list->data[list->top]).wc = (char*)malloc(strlen(wc) + 1);
-    (list->data[list->top]).available = true;
-    (list->data[list->top]).job_id = list->top;
-    (list->data[list->top]).flag = 0;
+    loop->mark = arena_mark(&glob_arena);
+    loop->words = NULL;
+    loop->count = 0;
+    loop->next = 0;
 
-    strcpy((list->data[list->top]).wc, wc);
+    if (words == NULL) {
+        return;
+    }
+    if (has_references(words)) {
+        words = expand_variables(&vars, words, &substituted, &glob_arena, last_status());
+        if (words == NULL) {
+            return;
+        }
+    }
+    if (has_patterns(words)) {
+        GlobCache cache;
 
-    update_job_flag(list);
+        init_glob_cache(&cache, &glob_arena);
+        words = expand_command_line(&cache, words, &expanded);
+        free_glob_cache(&cache);
+    }
 
-    return &(list->data[list->top]);
+    loop->words = words->cmdv[0].argv;
+    loop->count = words->cmdv[0].argc;
 }
 
-void remove_job_list(JobList* list, int idx)
+/* run the instructions from pc on, a syntax error ends the program */
+void run_program(Program* program, int pc)
 {
-    if (list == NULL || idx > list->top || !(list->data[idx]).available) {
-        return;
+    ForLoop loops[MAX_NESTING];
+    int depth = 0;
+    int stats = 0;
+    ArenaMark mark = arena_mark(&glob_arena);
+
+    while (pc < program->count) {
+        Instruction* op = &program->code[pc++];
+        ForLoop* loop;
+
+        switch (op->code) {
+            case OP_RUN:
+                run_command_line(op->line);
+                /* collect finished background jobs */
+                reap_children(false);
+                break;
+            case OP_JUMP:
+                pc = op->target;
+                break;
+            case OP_JUMP_IF_OK:
+                if (last_status() == 0) {
+                    pc = op->target;
+                }
+                break;
+            case OP_JUMP_IF_FAIL:
+                if (last_status() != 0) {
+                    pc = op->target;
+                }
+                break;
+            case OP_CLEAR:
+                set_pipe_status(&stats, 1);
+                break;
+            case OP_FOR_START:
+                start_for_loop(&loops[depth++], op->line);
+                break;
+            case OP_FOR_NEXT:
+                loop = &loops[depth - 1];
+                if (loop->next < loop->count) {
+                    set_var(&vars, op->text, loop->words[loop->next++]);
+                    variable_changed(op->text);
+                } else {
+                    if (loop->count == 0) {
+                        set_pipe_status(&stats, 1);
+                    }
+                    arena_rewind(&glob_arena, loop->mark);
+                    depth--;
+                    pc = op->target;
+                }
+                break;
+            case OP_ERROR:
+                report_syntax_error(op->text, op->lineno);
+                pc = program->count;
+                break;
+        }
     }
 
-    (list->data[idx]).available = false;
-    (list->data[idx]).pid = -1;
+    arena_rewind(&glob_arena, mark);
+}
 
-    if ((list->data[idx]).wc != NULL) {
-        free((list->data[idx]).wc);
-        (list->data[idx]).wc = NULL;
+/*
+ * Compile one line typed in interactive mode, and run the program once
+ * every construct in it is closed. History events are expanded first, and
+ * the line goes to the history before it runs.
+ */
+void handle_line(Program* program, char* line)
+{
+    double start;
+    char* expanded = NULL;
+    size_t len;
+
+    switch (tty_input ? expand_history(&history, line, &expanded) : 0) {
+        case -1:
+            return;
+        case 1:
+            line = expanded;
+            fputs(line, stdout);  /* bash shows the line it is going to run */
+            break;
+        default:
+            break;
+    }
+    len = strcspn(line, "\n");
+    if (line[strspn(line, WHITE_CHARS)] != '\0') {
+        add_history(&history, line, len);
     }
 
-    if ((list->data[idx]).cmd_ln != NULL) {
-        free_command_line((list->data[idx]).cmd_ln);
-        free((list->data[idx]).cmd_ln);
-        (list->data[idx]).cmd_ln = NULL;
+    if (program_complete(program)) {
+        /* a new command: the last one ran, its code and arena are recycled */
+        reset_program(program);
+        arena_reset(program->arena);
     }
 
-    if (idx == list->top) {
-        while (list->top >= 0 && (list->data[list->top]).available == false) {
-            --list->top;
-        }
+    start = trace_on ? trace_now() : 0;
+    compile_line(program, arena_strdup(program->arena, line), 0);
+    if (trace_on) {
+        trace_span("parse", start, trace_now(), 0, 0, NULL);
+    }
+    if (program_complete(program)) {
+        run_program(program, 0);
     }
 
-    update_job_flag(list);
+    free(expanded);
 }
 
-bool get_job_status_name(pid_t pid, char* dest)
-{
-    pid_t w;
-    bool ended = false;
-    int stats;
-
-    w = waitpid(pid, &stats, WNOHANG | WUNTRACED);
 
-    if (w == 0) {
-        strcpy(dest, "Running");
-
-        ended = false;
-    } else {
-        if (WIFEXITED(stats)) {
-            int es = WEXITSTATUS(stats);
+/******************************************************************************
+ * Command substitution: the command runs in a forked copy of the shell with
+ * stdout on a pipe, its pipelines starting through do_child_process as
+ * anywhere else. The shell reads the output into one buffer, doubling it
+ * and reading as much as fits each time, up to `set -o substmax=SIZE`.
+ *****************************************************************************/
+#define SUBST_READ_SIZE (64 * 1024)
 
-            if (es == 0) {
-                strcpy(dest, "Done");
-            } else {
-                sprintf(dest, "Exit %d", es);
+/* read fd to the end or up to subst_max bytes, into a NUL-terminated buffer */
+char* read_substitution(int fd, size_t* size, bool* truncated)
+{
+    size_t capacity = (subst_max > 0 && subst_max < SUBST_READ_SIZE) ? (size_t)subst_max : SUBST_READ_SIZE;
+    char* output = (char*)malloc(capacity + 1);
+    ssize_t n;
+
+    *size = 0;
+    *truncated = false;
+    for (;;) {
+        if (*size == capacity) {
+            if (subst_max > 0 && capacity == (size_t)subst_max) {
+                char extra;
+
+                /* full: only report it if something was left */
+                while ((n = read(fd, &extra, 1)) < 0 && errno == EINTR) {}
+                *truncated = (n > 0);
+                break;
             }
-        } else if (WIFSIGNALED(stats)) {
-            strcpy(dest, "Terminated");
+            capacity *= 2;
+            if (subst_max > 0 && capacity > (size_t)subst_max) {
+                capacity = subst_max;
+            }
+            output = (char*)realloc(output, capacity + 1);
         }
 
-        ended = true;
+        n = read(fd, output + *size, capacity - *size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        *size += n;
     }
 
-    return ended;
-}
-
-char get_flag_char(int flag)
-{
-    if (flag == 0) {
-        return '+';
-    } else if (flag == 1) {
-        return '-';
-    } else {
-        return ' ';
-    }
+    return output;
 }
 
-void print_job_list(JobList* list)
+/* the output of command, without NUL bytes and trailing newlines like in bash */
+char* command_substitution(const char* command, size_t len)
 {
-    int i;
-
-    for (i = 0; i <= list->top; i++) {
-        char stats_name[32];
-        bool ended;
-        char cmd_str[BUF_SIZE];
-
-        Job p = list->data[i];
+    char* output;
+    char* nul;
+    size_t size;
+    bool truncated;
+    int pfds[2], stats = 0;
+    pid_t pid;
 
-        if (!p.available) {
-            continue;
+    if (pipe(pfds) < 0) {
+        fprintf(stderr, "%s: pipe: %s\n", PROGRAM_NAME, strerror(errno));
+        return NULL;
+    }
+    fcntl(pfds[0], F_SETFD, FD_CLOEXEC);
+
+    fflush(stdout);  /* or the copy would print it again */
+    pid = fork();
+    if (pid == 0) {
+        Arena arena;
+        Program program;
+
+        close(pfds[0]);
+        reset_child_signals();
+        init_scheduler();  /* queued lines belong to the parent shell */
+        dup2(pfds[1], STDOUT_FILENO);
+        close(pfds[1]);
+
+        arena_init(&arena);
+        init_program(&program, &arena);
+        if (compile_line(&program, arena_strndup(&arena, command, len), 0)) {
+            finish_program(&program, 0);
         }
+        run_program(&program, 0);
+        fflush(stdout);
+        _exit(last_status());
+    }
+    close(pfds[1]);
+    if (pid < 0) {
+        fprintf(stderr, "%s: fork: %s\n", PROGRAM_NAME, strerror(errno));
+        close(pfds[0]);
+        return NULL;
+    }
 
-        ended = get_job_status_name(p.pid, stats_name);  /* whether the process is Done/Exit/Terminated */
-        format_command_line(cmd_str, p.cmd_ln, !ended);  /* get command display name */
+    output = read_substitution(pfds[0], &size, &truncated);
+    close(pfds[0]);  /* a command still writing gets SIGPIPE */
+    while (waitpid(pid, &stats, 0) < 0 && errno == EINTR) {}
+    subst_status = status_code(stats);
 
-        printf("[%d]%c  %s%*s%s\n", p.job_id + 1, get_flag_char(p.flag), stats_name, (int)(24 - strlen(stats_name)), "", cmd_str);
+    if (truncated) {
+        fprintf(stderr, "%s: command substitution: output truncated to %ld bytes\n", PROGRAM_NAME, subst_max);
+    }
+    if ((nul = memchr(output, '\0', size)) != NULL) {
+        char* read;
+        char* write = nul;
 
-        if (ended) {
-            remove_job_list(list, i);
+        for (read = nul; read < output + size; read++) {
+            if (*read != '\0') {
+                *write++ = *read;
+            }
         }
+        size = write - output;
     }
-}
+    while (size > 0 && output[size - 1] == '\n') {
+        size--;
+    }
+    output[size] = '\0';
 
-JobList job_list;  /* the job list */
+    return output;
+}
 
 
 /******************************************************************************
- * Utilities
+ * Script mode: the file is mapped and parsed completely before the first
+ * line runs, lines are executed from the parsed records
  *****************************************************************************/
-/* get username */
-void get_username(char* dest)
+typedef struct {
+    char* text;  /* the script, tokenized in place */
+    size_t size;
+    bool mapped;
+    int linec;
+    Program program;
+    Arena arena;  /* commands of all lines */
+} Script;
+
+/* read files which cannot be mapped, e.g. pipes, leaving room for a '\0' */
+char* read_script_file(int fd, size_t* size)
 {
-    char* user;
-    uid_t uid;
-    struct passwd* pwd;
-    
-    /* get uid */
-    uid = geteuid();
-    /* get user profile */
-    pwd = getpwuid(uid);
-    if (pwd) {
-        user = pwd->pw_name;
-    } else {  /* failed to get username */
-        fprintf(stderr, "%s: cannot find username for UID %u\n", PROGRAM_NAME, (unsigned)uid);
-        exit(EXIT_FAILURE);
+    size_t capacity = BUF_SIZE * 16;
+    char* text = (char*)malloc(capacity);
+    ssize_t n;
+
+    *size = 0;
+    while ((n = read(fd, text + *size, capacity - *size - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(text);
+            return NULL;
+        }
+        *size += n;
+        if (*size + 1 == capacity) {
+            capacity *= 2;
+            text = (char*)realloc(text, capacity);
+        }
     }
+    text[*size] = '\0';
 
-    strcpy(dest, user);
+    return text;
 }
 
-/* get $HOME, e.g. /home/wyh */
-void get_home_path(char* dest)
+bool load_script(Script* script, const char* filename)
 {
-    char user[BUF_SIZE];
-    char home_path[BUF_SIZE] = "/home/";
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
 
-    /* get username */
-    get_username(user);
+    script->text = NULL;
+    script->size = 0;
+    script->mapped = false;
+    script->linec = 0;
+    arena_init(&script->arena);
+    init_program(&script->program, &script->arena);
 
-    /* update home path */
-    strcat(home_path, user);
-    
-    strcpy(dest, home_path);
-}
-
-/* replace $HOME with ~ */
-void alias_home_path(char* dest, char* src)
-{
-    char home_path[BUF_SIZE];
-    char alias_path[BUF_SIZE] = "~/";
+    if (fd < 0) {
+        return false;
+    }
 
-    get_home_path(home_path);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        /* private mapping: the lexer writes into the pages, the file stays as is */
+        void* text = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
 
-    /* replace $HOME with ~ */
-    if (strstartswith(src, home_path)) {
-        path_change_directory(src, home_path, alias_path);
+        if (text != MAP_FAILED) {
+            script->text = (char*)text;
+            script->size = st.st_size;
+            script->mapped = true;
+        }
     }
 
-    strcpy(dest, alias_path);
-}
+    if (!script->mapped) {
+        script->text = read_script_file(fd, &script->size);
+    }
 
-/* get current working directory where $HOME is replaced by ~ */
-void get_cwd_with_alias_home(char* dest)
-{
-    char cwd[BUF_SIZE];
-    getcwd(cwd, sizeof(cwd));
-    alias_home_path(cwd, cwd);
+    close(fd);
 
-    strcpy(dest, cwd);
+    return script->text != NULL;
 }
 
-/******************************************************************************
- * Parse and execute commands
- *****************************************************************************/
-void kill_process(Command* cmd)
+/* split the script at newlines and compile it line by line, false on a syntax error */
+bool parse_script(Script* script)
 {
+    char* line = script->text;
+    char* end = script->text + script->size;
+    double start;
     int i;
 
-    if (cmd->argc <= 1) {
-        fprintf(stderr, "kill: usage: kill pid");
-
-        return;
-    }
-
-    for (i = 1; i < cmd->argc; i++) {
-        pid_t pid;
-        bool is_job_id;
-        char* arg = cmd->argv[i];
-
-        is_job_id = strstartswith(arg, "%");
+    for (i = 1; line < end; i++) {
+        char* newline = memchr(line, '\n', end - line);
+        char* next = (newline != NULL) ? newline + 1 : end;
+        bool compiled;
 
-        arg = strltrim(arg, "%");  /* trim beginning % */
-        pid = (pid_t)atoi(arg);
+        if (newline != NULL) {
+            *newline = '\0';
+        } else if (script->mapped && script->size % sysconf(_SC_PAGESIZE) == 0) {
+            /* the last line fills the last page, terminate a copy of it */
+            line = arena_strndup(&script->arena, line, end - line);
+        }
+        /* otherwise the page or buffer is zero past the end */
 
-        if (is_job_id) {
-            if (pid > job_list.top && !job_list.data[pid - 1].available) {
-                continue;
-            }
-            pid = job_list.data[pid - 1].pid;
+        start = trace_on ? trace_now() : 0;
+        compiled = compile_line(&script->program, line, i);
+        if (trace_on) {
+            trace_span("parse", start, trace_now(), 0, 0, NULL);
+        }
+        if (!compiled) {
+            /* bash stops reading at the error */
+            return false;
         }
 
-        kill(pid, SIGKILL);
+        line = next;
     }
+    script->linec = i - 1;
+
+    return finish_program(&script->program, i);
 }
 
-bool exec_builtin(Command* cmd)
+/* execute the compiled script, a syntax error stops it like in bash */
+void run_script(Script* script)
 {
-    bool builtin = true;
-    char* command_name;
-
-    if (cmd->argc <= 0) {
-        return false;
-    }
-    
-    command_name = cmd->argv[0];
-    if (strcmp(command_name, "cd") == 0) {
-        char* dir;
-        if (cmd->argc == 1) {
-            char home_dir[BUF_SIZE];
-            get_home_path(home_dir);
-            dir = home_dir;
-        } else {
-            dir = cmd->argv[1];
-        }
-        if (chdir(dir) < 0) {
-            fprintf(stderr, "%s: cd: %s: No such file or directory\n", PROGRAM_NAME, dir);
-        }
-    } else if (strcmp(command_name, "jobs") == 0) {
-        print_job_list(&job_list);
-    } else if (strcmp(command_name, "kill") == 0) {
-        kill_process(cmd);
-    } else if (strcmp(command_name, "pwd") == 0) {
-        char cwd[BUF_SIZE];
-        getcwd(cwd, sizeof(cwd));
+    run_program(&script->program, 0);
+}
 
-        printf("%s\n", cwd);
-    } else if (strcmp(command_name, "exit") == 0) {
-        exit(EXIT_SUCCESS);
+void free_script(Script* script)
+{
+    if (script->mapped) {
+        munmap(script->text, script->size);
     } else {
-        builtin = false;
+        free(script->text);
     }
-
-    return builtin;
+    free_program(&script->program);
+    arena_free(&script->arena);
 }
 
-void exec_command(Command* cmd)
-{
-    if(cmd->argc <= 0) return;
 
-    if(exec_builtin(cmd)){
-        /* Exit child process */
-        exit(EXIT_SUCCESS);
-    }else{
-        /*char command_name[BUF_SIZE]; strcpy(command_name, cmd->argv[0]);
-        if(strchr(command_name, '/') == NULL){
-            char* env_str = getenv("PATH");
-            char* env_dir = strtok(env_str, ":");
-            while(env_dir != NULL){
-                char abs_path[BUF_SIZE]; strcpy(abs_path, env_dir);
-                path_cat(abs_path, command_name);
-                if(path_file_exists(abs_path)){
-                    strcpy(command_name, abs_path);
-                    break;
-                }
-                env_dir = strtok(NULL, ":");
-            }
-        }*/
-        char** argv = (char**)malloc(sizeof(char*) * (cmd->argc + 1));
-        int i;
-        for (i = 0; i < cmd->argc; i++) {
-            argv[i] = cmd->argv[i];
-        }
-        argv[cmd->argc] = NULL;
+/******************************************************************************
+ * Prompt: $PS1 is compiled once into a list of ops, drawing it only copies
+ * the cached user, host and working directory
+ *****************************************************************************/
+#define DEFAULT_PS1 "\\u@\\H:\\w$ "
+#define CONTINUATION_PROMPT "> "  /* bash's $PS2 */
 
-        if (execvp(cmd->argv[0], argv) < 0) {
-            free(argv);
-            exit(EXIT_FAILURE);
-        }
+typedef enum {
+    prompt_text,
+    prompt_user,
+    prompt_host,  /* up to the first . */
+    prompt_full_host,
+    prompt_cwd,
+    prompt_cwd_base,
+    prompt_sign  /* # for root, $ otherwise */
+} PromptOpType;
 
-        free(argv);
+typedef struct {
+    PromptOpType type;
+    char* text;
+} PromptOp;
 
-       /*  if(execv(command_name, cmd->argv) == -1){
-            fprintf(stderr, "%s: command not found\n", cmd->argv[0]);
-            exit(EXIT_FAILURE);
-        } */
-    }
+typedef struct {
+    PromptOp* ops;
+    int opc;
+    char* texts;  /* the literal pieces, each terminated */
+} Prompt;
+
+Prompt prompt;
+
+void free_prompt(Prompt* p)
+{
+    free(p->ops);
+    free(p->texts);
+    p->ops = NULL;
+    p->texts = NULL;
+    p->opc = 0;
 }
 
-void do_child_process(CommandLine* command_line, int idx, int pfd_input, int pfd_output)
+/* supports \u \h \H \w \W \$ \n \e \a \\ and ignores \[ \] */
+void compile_prompt(Prompt* p, const char* ps1)
 {
-    Command* cmd;
-    int pfds[] = {-1, -1};
-    bool is_child_proc = false;
+    const char* ch;
+    char* text;
+    bool in_text = false;
+
+    free_prompt(p);
+
+    /* every char makes at most one op and one byte of text plus its '\0' */
+    p->ops = (PromptOp*)malloc(sizeof(PromptOp) * (strlen(ps1) + 1));
+    p->texts = (char*)malloc(strlen(ps1) * 2 + 1);
+    text = p->texts;
+
+    for (ch = ps1; *ch != '\0'; ch++) {
+        PromptOpType type = prompt_text;
+        char literal = *ch;
+
+        if (*ch == '\\' && ch[1] != '\0') {
+            ch++;
+            switch (*ch) {
+                case 'u': type = prompt_user; break;
+                case 'h': type = prompt_host; break;
+                case 'H': type = prompt_full_host; break;
+                case 'w': type = prompt_cwd; break;
+                case 'W': type = prompt_cwd_base; break;
+                case '$': type = prompt_sign; break;
+                case 'n': literal = '\n'; break;
+                case 'e': literal = '\033'; break;
+                case 'a': literal = '\007'; break;
+                case '[': case ']': continue;
+                default: literal = *ch; break;
+            }
+        }
 
-    /* First leave -1 to initialize with the end command */
-    if(idx < 0) idx = command_line->cmdc - 1;
-    
-    cmd = &command_line->cmdv[idx--];
-    if(idx >= 0){
-        if(pipe(pfds) == 0){
-            is_child_proc = (fork() == 0);
-            if(is_child_proc){
-                do_child_process(command_line, idx, pfds[0], pfds[1]);
+        if (type == prompt_text) {
+            if (!in_text) {
+                p->ops[p->opc].type = prompt_text;
+                p->ops[p->opc++].text = text;
+                in_text = true;
+            }
+            *text++ = literal;
+            *text = '\0';
+        } else {
+            if (in_text) {
+                text++;  /* keep the '\0' of the previous piece */
+                in_text = false;
             }
+            p->ops[p->opc].type = type;
+            p->ops[p->opc++].text = NULL;
         }
     }
-    if(!is_child_proc){
-        char* input_file = cmd->input;
-        char* output_file = cmd->output;
+}
 
-        if(input_file){
-            /*  Input redirection */
-            int input_fd = open(input_file, O_RDONLY);
-            dup2(input_fd, STDIN_FILENO);
-            close(input_fd);
-        }else if(pfds[0] >= 0 && pfds[1] >= 0){
-            /* Pipe stdin from child process */
-            close(pfds[1]);
-            dup2(pfds[0], STDIN_FILENO);
-            close(pfds[0]);
+void print_prompt()
+{
+    int i;
+
+    for (i = 0; i < prompt.opc; i++) {
+        PromptOp* op = &prompt.ops[i];
+        char* slash;
+
+        switch (op->type) {
+            case prompt_text:
+                fputs(op->text, stdout);
+                break;
+            case prompt_user:
+                fputs(shell_info.user, stdout);
+                break;
+            case prompt_host:
+                fwrite(shell_info.host, 1, strcspn(shell_info.host, "."), stdout);
+                break;
+            case prompt_full_host:
+                fputs(shell_info.host, stdout);
+                break;
+            case prompt_cwd:
+                fputs(shell_info.cwd_alias, stdout);
+                break;
+            case prompt_cwd_base:
+                slash = strrchr(shell_info.cwd_alias, '/');
+                fputs((slash != NULL && slash[1] != '\0') ? slash + 1 : shell_info.cwd_alias, stdout);
+                break;
+            case prompt_sign:
+                fputc(shell_info.root ? '#' : '$', stdout);
+                break;
         }
+    }
+}
 
-        if(output_file){
-            /* Ouput redirection */
-            int open_flags = O_RDWR | O_CREAT;
-            int create_mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
-            int output_fd;
-            
-            if (cmd->append) {  /* append mode */
-                open_flags |= O_APPEND;
-            } else {
-                open_flags |= O_TRUNC;
-            }
 
-            output_fd = open(output_file, open_flags, create_mode);
-            dup2(output_fd, STDOUT_FILENO);
-            close(output_fd);
-        }else if(pfd_input >= 0 && pfd_output >= 0){
-            /* Pipe stdout to parent process */
-            close(pfd_input);
-            dup2(pfd_output, STDOUT_FILENO);
-            close(pfd_output);
-        }
-        exec_command(cmd);
+/******************************************************************************
+ * Variables: the shell state derived from a variable is refreshed as soon
+ * as it is assigned, so nothing has to compare values before using them
+ *****************************************************************************/
+void variable_changed(const char* name)
+{
+    const char* value = get_var(&vars, name);
+
+    if (strcmp(name, "PATH") == 0) {
+        check_path_changed(&cmd_hash);
+    } else if (strcmp(name, "PS1") == 0) {
+        compile_prompt(&prompt, value != NULL ? value : "");
+    } else if (strcmp(name, "HOME") == 0) {
+        strncpy(shell_info.home, value != NULL ? value : "", BUF_SIZE - 1);
+        update_cwd();
     }
 }
 
-void handle_line(char* line)
+/* NAME=value words */
+void assign_variables(char** assigns)
 {
-    bool child_process = false;
-    bool free_cmd_ln = true;
-    CommandLine* command_line = (CommandLine*)malloc(sizeof(CommandLine));
+    for (; *assigns != NULL; assigns++) {
+        size_t name_len = assignment_name_len(*assigns);
+        char name[BUF_SIZE];
 
-    parse_command_line(command_line, line);
+        if (name_len >= BUF_SIZE) {
+            continue;
+        }
+        memcpy(name, *assigns, name_len);
+        name[name_len] = '\0';
+        set_var(&vars, name, *assigns + name_len + 1);
+        variable_changed(name);
+    }
+}
 
-    if (command_line->cmdc > 0) {
-        bool single_builtin = (command_line->cmdc == 1) && exec_builtin(&(command_line->cmdv[0]));
+/* export [-p] [NAME[=value] ...] */
+int export_builtin(Command* cmd)
+{
+    int i, status = EXIT_SUCCESS;
 
-        if (!single_builtin) {
-            pid_t pid;
-            
-            fflush(stdout);
-            pid = fork();
-            child_process = (pid == 0);
-            
-            if (child_process) {  /* run in child process */
-                do_child_process(command_line, -1, -1, -1);
-            } else {
-                char cwd[BUF_SIZE];
-                get_cwd_with_alias_home(cwd);
-                
-                if (!command_line->bg) {
-                    int status = 0;
+    if (cmd->argc == 1 || (cmd->argc == 2 && strcmp(cmd->argv[1], "-p") == 0)) {
+        print_exported_vars(&vars);
+        return status;
+    }
 
-                    while (waitpid(pid, &status, 0) < 0) {
-                        /* waiting */
-                    }
-                } else {
-                    free_cmd_ln = false;
-                    /* push a job to job list */
-                    append_job_list(&job_list, pid, command_line, cwd);
-                }
+    for (i = 1; i < cmd->argc; i++) {
+        char* arg = cmd->argv[i];
+        size_t name_len = assignment_name_len(arg);
+        char name[BUF_SIZE];
+
+        if (name_len == 0) {
+            name_len = strlen(arg);
+            if (arg[0] == '\0' || arg[strspn(arg, "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")] != '\0'
+                || !is_var_name_char(arg[0], true)) {
+                fprintf(stderr, "%s: export: `%s': not a valid identifier\n", PROGRAM_NAME, arg);
+                status = EXIT_FAILURE;
+                continue;
             }
         }
+        if (name_len >= BUF_SIZE) {
+            continue;
+        }
 
-        if (free_cmd_ln) {
-            free_command_line(command_line);
-            free(command_line);
+        memcpy(name, arg, name_len);
+        name[name_len] = '\0';
+        if (arg[name_len] == '=') {
+            set_var(&vars, name, arg + name_len + 1);
         }
+        export_var(&vars, name);
+        variable_changed(name);
     }
-}
 
+    return status;
+}
 
-/******************************************************************************
- * Print prompt
- *****************************************************************************/
-void print_prompt()
+/* unset NAME ... */
+int unset_builtin(Command* cmd)
 {
-    char user[BUF_SIZE];
-    char hostname[BUF_SIZE];
-    char cwd[BUF_SIZE];
+    int i;
 
-    /* get username */
-    get_username(user);
-    /* get hostname */
-    gethostname(hostname, sizeof(hostname));
-    /* get current working directory */
-    get_cwd_with_alias_home(cwd);
+    for (i = 1; i < cmd->argc; i++) {
+        unset_var(&vars, cmd->argv[i]);
+        variable_changed(cmd->argv[i]);
+    }
 
-    printf("%s@%s:%s$ ", user, hostname, cwd);
+    return EXIT_SUCCESS;
 }
 
 
@@ -508,61 +3237,109 @@ void print_prompt()
  *****************************************************************************/
 int main(int argc, char* argv[])
 {
-    FILE* file;
     ShellMode sh_mode;
-    char* input_line = NULL;
-    size_t input_line_len = 0;
-    ssize_t read;
+    bool parse_only = false;
+    int argi = 1;
+
+    /* the environment becomes the exported variables */
+    init_vars(&vars, environ);
+    vars.substitute = command_substitution;
+    check_path_changed(&cmd_hash);
+
+    /* resolve user, home and hostname once, and compile the prompt */
+    init_shell_info();
+    compile_prompt(&prompt, get_var(&vars, "PS1") != NULL ? get_var(&vars, "PS1") : DEFAULT_PS1);
 
     /* init job list */
     init_job_list(&job_list);
+    init_history(&history);
+    arena_init(&glob_arena);
+    init_scheduler();
+    init_sigchld();
+
+    /* SIMPLEBASH_TRACE=file records a Chrome trace of the session */
+    if (getenv(TRACE_ENV) != NULL && *getenv(TRACE_ENV) != '\0') {
+        if (trace_open(getenv(TRACE_ENV))) {
+            atexit(trace_close);
+        } else {
+            fprintf(stderr, "%s: %s: %s\n", PROGRAM_NAME, getenv(TRACE_ENV), strerror(errno));
+        }
+    }
+
+    if (argi < argc && strcmp(argv[argi], "-n") == 0) {  /* only check the syntax, up to the first error like bash -n */
+        parse_only = true;
+        argi++;
+    }
+
+    /* set mode to interactive when no script is given */
+    sh_mode = (argi < argc) ? noninteractive : interactive;
+
+    if (sh_mode == interactive) {
+        char* input_line = NULL;
+        Arena line_arena;  /* recycled from line to line */
+        Program program;
+        Editor editor;  /* falls back to plain reads when stdin is no terminal */
+
+        arena_init(&line_arena);
+        init_program(&program, &line_arena);
+        tty_input = isatty(STDIN_FILENO);
+        if (tty_input) {
+            open_history_file();
+        }
+        init_editor(&editor, &history, builtin_names, print_prompt);
+
+        do {
+            if (input_line != NULL) {
+                /* handle input line */
+                handle_line(&program, input_line);
+            }
+
+            /* collect finished background jobs, announcing them */
+            reap_children(true);
+
+            /* print prompt, or the one of a continued construct */
+            if (program_complete(&program)) {
+                print_prompt();
+            } else {
+                fputs(CONTINUATION_PROMPT, stdout);
+            }
+        } while ((input_line = edit_line(&editor)) != NULL);
+
+        if (!program_complete(&program)) {
+            /* the input ran out inside a construct or here-document: its error, or the code cut off */
+            finish_program(&program, 0);
+            run_program(&program, 0);
+        }
+        free_editor(&editor);
+        free_program(&program);
+        arena_free(&line_arena);
+    } else {
+        Script script;
+        char* filename = argv[argi];
 
-    if (argc <= 1) {  /* interactive mode */
-        /* set mode to interactive */
-        sh_mode = interactive;
-        /* receive input from stdin */
-        file = stdin;
-    } else {  /* non-interactive mode */
-        char* filename;
-
-        /* set mode to non-interactive */
-        sh_mode = noninteractive;
-        
-        /* open input file */
-        filename = argv[1];
-        file = fopen(filename, "r");
-
-        /* failed to open file */
-        if (file == NULL) {
+        if (!load_script(&script, filename)) {
             /* not found message */
             fprintf(stderr, "%s: %s: No such file or directory\n", PROGRAM_NAME, filename);
-            /* close file */
-            fclose(file);
 
             exit(EXIT_FAILURE);
         }
-    }
 
-    do {
-        if (input_line != NULL) {
-            /* handle input line */
-            handle_line(input_line);
-        }
+        if (!parse_script(&script) && parse_only) {
+            report_syntax_error(script.program.error, script.program.error_line);
+            free_script(&script);
 
-        /* print prompt in interactive mode */
-        if (sh_mode == interactive) {
-            print_prompt();
-        }
-    } while ((read = getline(&input_line, &input_line_len, file)) != -1);
+            return 2;
+        } else if (parse_only) {
+            free_script(&script);
 
+            return 0;
+        }
 
-    /* close input file in noninteractive mode */
-    if (sh_mode == noninteractive) {
-        free(input_line);
-        fclose(file);
+        run_script(&script);
+        free_script(&script);
     }
 
-    return 0;
+    return last_status();
 }
 
-#endif
\ No newline at end of file
+#endif
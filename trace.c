@@ -0,0 +1,159 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+bool trace_on = false;
+
+static int trace_fd = -1;
+static pid_t trace_owner;  /* forked children carry a copy of the buffer, only this pid writes it */
+static struct timespec trace_start;
+static char trace_buffer[TRACE_BUFFER_SIZE];
+static size_t trace_used = 0;
+static bool trace_first = true;  /* no comma before the first event */
+
+static void trace_flush()
+{
+    size_t done = 0;
+
+    while (done < trace_used) {
+        ssize_t count = write(trace_fd, trace_buffer + done, trace_used - done);
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  /* the trace is lost, the shell goes on */
+        }
+        done += count;
+    }
+    trace_used = 0;
+}
+
+static void trace_write(const char* str, size_t len)
+{
+    if (trace_used + len > TRACE_BUFFER_SIZE) {
+        trace_flush();
+    }
+    if (len > TRACE_BUFFER_SIZE) {
+        return;
+    }
+    memcpy(trace_buffer + trace_used, str, len);
+    trace_used += len;
+}
+
+static void trace_puts(const char* str)
+{
+    trace_write(str, strlen(str));
+}
+
+/* str as a JSON string literal */
+static void trace_put_string(const char* str)
+{
+    char escape[8];
+
+    trace_puts("\"");
+    for (; *str != '\0'; str++) {
+        unsigned char ch = (unsigned char)*str;
+
+        if (ch == '"' || ch == '\\') {
+            escape[0] = '\\';
+            escape[1] = ch;
+            trace_write(escape, 2);
+        } else if (ch < 0x20) {
+            sprintf(escape, "\\u%04x", ch);
+            trace_write(escape, 6);
+        } else {
+            trace_write((const char*)&ch, 1);
+        }
+    }
+    trace_puts("\"");
+}
+
+bool trace_open(const char* path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (trace_fd < 0) {
+        return false;
+    }
+    if (trace_fd < SHELL_FD_BASE) {
+        /* out of the way of `exec 3>file` */
+        int fd = fcntl(trace_fd, F_DUPFD_CLOEXEC, SHELL_FD_BASE);
+
+        close(trace_fd);
+        trace_fd = fd;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    trace_owner = getpid();
+    trace_on = true;
+    trace_puts("[\n");
+
+    return true;
+}
+
+void trace_close()
+{
+    if (!trace_on || getpid() != trace_owner) {
+        return;
+    }
+
+    trace_puts("\n]\n");
+    trace_flush();
+    close(trace_fd);
+    trace_fd = -1;
+    trace_on = false;
+}
+
+double trace_time(const struct timespec* ts)
+{
+    return (ts->tv_sec - trace_start.tv_sec) * 1e6 + (ts->tv_nsec - trace_start.tv_nsec) / 1e3;
+}
+
+double trace_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return trace_time(&now);
+}
+
+void trace_span(const char* name, double start, double end, long pid, int job, const char* cmd)
+{
+    char buf[160];
+
+    if (!trace_on) {
+        return;
+    }
+
+    trace_puts(trace_first ? "" : ",\n");
+    trace_first = false;
+
+    trace_puts("{\"name\":");
+    trace_put_string(name);
+    sprintf(buf, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld,\"args\":{",
+        pid > 0 ? "child" : "shell", start, end - start, (long)trace_owner, pid > 0 ? pid : (long)trace_owner);
+    trace_puts(buf);
+
+    buf[0] = '\0';
+    if (pid > 0) {
+        sprintf(buf, "\"pid\":%ld", pid);
+    }
+    if (job > 0) {
+        sprintf(buf + strlen(buf), "%s\"job\":%d", pid > 0 ? "," : "", job);
+    }
+    trace_puts(buf);
+    if (cmd != NULL) {
+        trace_puts(pid > 0 || job > 0 ? ",\"cmd\":" : "\"cmd\":");
+        trace_put_string(cmd);
+    }
+    trace_puts("}}");
+}
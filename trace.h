@@ -0,0 +1,32 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <time.h>
+
+#include "parse.h"
+
+/******************************************************************************
+ * Execution tracing in the Chrome trace_event format: every phase becomes
+ * one complete event ("ph":"X"), timed in microseconds since the trace
+ * started. Events are collected in a buffer and written when it fills up,
+ * and once more when the shell exits.
+ *****************************************************************************/
+#define TRACE_ENV           "SIMPLEBASH_TRACE"
+#define TRACE_BUFFER_SIZE   65536
+
+extern bool trace_on;
+
+bool trace_open(const char* path);
+void trace_close();
+
+double trace_now();
+double trace_time(const struct timespec* ts);
+
+/*
+ * Record the span [start, end] named name. A span about a child process runs
+ * on the row of that pid, anything else on the row of the shell. job (0 for
+ * none) and cmd (NULL for none) are added as arguments.
+ */
+void trace_span(const char* name, double start, double end, long pid, int job, const char* cmd);
+
+#endif /* _TRACE_H_ */
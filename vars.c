@@ -0,0 +1,646 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "vars.h"
+
+#define VARS_INITIAL_BUCKETS    64
+#define FIELD_SEPARATORS        " \t\n"
+
+extern char** environ;
+
+/******************************************************************************
+ * Hash map
+ *****************************************************************************/
+static char* make_entry(const char* name, const char* value)
+{
+    size_t name_len = strlen(name);
+    char* entry = (char*)malloc(name_len + strlen(value) + 2);
+
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    strcpy(entry + name_len + 1, value);
+    return entry;
+}
+
+static void grow_buckets(VarStore* store)
+{
+    size_t count = store->bucket_count * 2;
+    Variable** buckets = (Variable**)calloc(count, sizeof(Variable*));
+    size_t i;
+
+    for (i = 0; i < store->bucket_count; i++) {
+        Variable* var = store->buckets[i];
+
+        while (var != NULL) {
+            Variable* next = var->next;
+            size_t bucket = strhash(var->name) % count;
+
+            var->next = buckets[bucket];
+            buckets[bucket] = var;
+            var = next;
+        }
+    }
+
+    free(store->buckets);
+    store->buckets = buckets;
+    store->bucket_count = count;
+}
+
+/* append entry to envp, owned by var (NULL for entries the shell cannot name) */
+static void add_env_entry(VarStore* store, char* entry, Variable* var)
+{
+    if (store->envc + 1 >= store->env_capacity) {
+        store->env_capacity *= 2;
+        store->envp = (char**)realloc(store->envp, sizeof(char*) * store->env_capacity);
+        store->env_vars = (Variable**)realloc(store->env_vars, sizeof(Variable*) * store->env_capacity);
+    }
+
+    if (var != NULL) {
+        var->entry = entry;
+        var->env_index = store->envc;
+    }
+    store->envp[store->envc] = entry;
+    store->env_vars[store->envc] = var;
+    store->envc++;
+    store->envp[store->envc] = NULL;
+
+    /* getenv() and the libc functions using it see the same environment */
+    environ = store->envp;
+}
+
+/* drop the entry of var from envp, moving the last one into its slot */
+static void remove_env_entry(VarStore* store, Variable* var)
+{
+    int last = store->envc - 1;
+
+    if (var->env_index < 0) {
+        return;
+    }
+
+    if (var->env_index != last) {
+        store->envp[var->env_index] = store->envp[last];
+        store->env_vars[var->env_index] = store->env_vars[last];
+        if (store->env_vars[last] != NULL) {
+            store->env_vars[last]->env_index = var->env_index;
+        }
+    }
+    store->envc--;
+    store->envp[store->envc] = NULL;
+
+    free(var->entry);
+    var->entry = NULL;
+    var->env_index = -1;
+}
+
+void init_vars(VarStore* store, char** env)
+{
+    memset(store, 0, sizeof(VarStore));
+    store->bucket_count = VARS_INITIAL_BUCKETS;
+    store->buckets = (Variable**)calloc(store->bucket_count, sizeof(Variable*));
+    store->env_capacity = 64;
+    store->envp = (char**)malloc(sizeof(char*) * store->env_capacity);
+    store->env_vars = (Variable**)malloc(sizeof(Variable*) * store->env_capacity);
+    store->envp[0] = NULL;
+    store->shell_pid = getpid();
+
+    for (; env != NULL && *env != NULL; env++) {
+        size_t name_len = assignment_name_len(*env);
+
+        if (name_len > 0) {
+            char* name = (char*)malloc(name_len + 1);
+
+            memcpy(name, *env, name_len);
+            name[name_len] = '\0';
+            set_var(store, name, *env + name_len + 1);
+            export_var(store, name);
+            free(name);
+        } else {
+            /* passed on to commands as it is */
+            char* entry = (char*)malloc(strlen(*env) + 1);
+
+            strcpy(entry, *env);
+            add_env_entry(store, entry, NULL);
+        }
+    }
+
+    environ = store->envp;
+}
+
+Variable* find_var(VarStore* store, const char* name)
+{
+    Variable* var;
+
+    for (var = store->buckets[strhash(name) % store->bucket_count]; var != NULL; var = var->next) {
+        if (strcmp(var->name, name) == 0) {
+            return var;
+        }
+    }
+
+    return NULL;
+}
+
+const char* get_var(VarStore* store, const char* name)
+{
+    Variable* var = find_var(store, name);
+
+    return var != NULL ? var->value : NULL;
+}
+
+static Variable* add_var(VarStore* store, const char* name)
+{
+    Variable* var = find_var(store, name);
+    size_t bucket;
+
+    if (var != NULL) {
+        return var;
+    }
+
+    if (store->count + 1 > store->bucket_count / 4 * 3) {
+        grow_buckets(store);
+    }
+
+    var = (Variable*)calloc(1, sizeof(Variable));
+    var->name = (char*)malloc(strlen(name) + 1);
+    strcpy(var->name, name);
+    var->env_index = -1;
+
+    bucket = strhash(name) % store->bucket_count;
+    var->next = store->buckets[bucket];
+    store->buckets[bucket] = var;
+    store->count++;
+
+    return var;
+}
+
+void set_var(VarStore* store, const char* name, const char* value)
+{
+    Variable* var = add_var(store, name);
+
+    free(var->value);
+    var->value = (char*)malloc(strlen(value) + 1);
+    strcpy(var->value, value);
+
+    if (var->exported) {
+        char* entry = make_entry(name, value);
+
+        if (var->env_index >= 0) {
+            /* same slot, only the string changes */
+            free(var->entry);
+            var->entry = entry;
+            store->envp[var->env_index] = entry;
+        } else {
+            add_env_entry(store, entry, var);
+        }
+    }
+}
+
+void export_var(VarStore* store, const char* name)
+{
+    Variable* var = add_var(store, name);
+
+    var->exported = true;
+    if (var->value != NULL && var->env_index < 0) {
+        add_env_entry(store, make_entry(name, var->value), var);
+    }
+}
+
+void unset_var(VarStore* store, const char* name)
+{
+    Variable** slot = &store->buckets[strhash(name) % store->bucket_count];
+
+    for (; *slot != NULL; slot = &(*slot)->next) {
+        Variable* var = *slot;
+
+        if (strcmp(var->name, name) == 0) {
+            remove_env_entry(store, var);
+            *slot = var->next;
+            store->count--;
+            free(var->name);
+            free(var->value);
+            free(var);
+            return;
+        }
+    }
+}
+
+char** overlay_envp(VarStore* store, char** assigns, Arena* arena)
+{
+    char** envp;
+    int count = 0, envc = store->envc;
+    int i, j;
+
+    while (assigns[count] != NULL) {
+        count++;
+    }
+
+    envp = (char**)arena_alloc(arena, sizeof(char*) * (envc + count + 1));
+    memcpy(envp, store->envp, sizeof(char*) * envc);
+
+    for (i = 0; i < count; i++) {
+        size_t name_len = assignment_name_len(assigns[i]) + 1;  /* with the = */
+
+        for (j = 0; j < envc; j++) {
+            if (strncmp(envp[j], assigns[i], name_len) == 0) {
+                break;
+            }
+        }
+        envp[j] = assigns[i];
+        if (j == envc) {
+            envc++;
+        }
+    }
+    envp[envc] = NULL;
+
+    return envp;
+}
+
+static int compare_var_names(const void* a, const void* b)
+{
+    return strcmp((*(Variable* const*)a)->name, (*(Variable* const*)b)->name);
+}
+
+void print_exported_vars(VarStore* store)
+{
+    Variable** vars = (Variable**)malloc(sizeof(Variable*) * (store->count + 1));
+    size_t i, count = 0;
+
+    for (i = 0; i < store->bucket_count; i++) {
+        Variable* var;
+
+        for (var = store->buckets[i]; var != NULL; var = var->next) {
+            if (var->exported) {
+                vars[count++] = var;
+            }
+        }
+    }
+    qsort(vars, count, sizeof(Variable*), compare_var_names);
+
+    for (i = 0; i < count; i++) {
+        const char* ch;
+
+        printf("declare -x %s", vars[i]->name);
+        if (vars[i]->value != NULL) {
+            putchar('=');
+            putchar('"');
+            for (ch = vars[i]->value; *ch != '\0'; ch++) {
+                if (strchr("\"\\$`", *ch) != NULL) {
+                    putchar('\\');
+                }
+                putchar(*ch);
+            }
+            putchar('"');
+        }
+        putchar('\n');
+    }
+
+    free(vars);
+}
+
+
+/******************************************************************************
+ * Expansion
+ *****************************************************************************/
+typedef struct {
+    char* buf;  /* the field being built */
+    size_t len;
+    size_t capacity;
+    bool started;  /* the field exists even if empty, as after "" */
+    bool pattern;  /* it has an active glob character */
+
+    char** fields;  /* finished fields, in the arena */
+    bool* patterns;
+    int count;
+    int capacity_fields;
+} FieldList;
+
+static void field_putc(FieldList* list, char ch)
+{
+    if (list->len + 1 >= list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : 64;
+        list->buf = (char*)realloc(list->buf, list->capacity);
+    }
+    list->buf[list->len++] = ch;
+    list->started = true;
+}
+
+/* append a character which never acts as a glob character */
+static void field_put_literal(FieldList* list, char ch)
+{
+    const char* glob = strchr(GLOB_CHARS, ch);
+
+    field_putc(list, (ch != '\0' && glob != NULL) ? QUOTED_GLOB_CHARS[glob - GLOB_CHARS] : ch);
+}
+
+static void end_field(FieldList* list, Arena* arena)
+{
+    char* field;
+
+    if (!list->started) {
+        return;
+    }
+
+    if (list->count + 1 >= list->capacity_fields) {
+        list->capacity_fields = list->capacity_fields > 0 ? list->capacity_fields * 2 : 16;
+        list->fields = (char**)realloc(list->fields, sizeof(char*) * list->capacity_fields);
+        list->patterns = (bool*)realloc(list->patterns, sizeof(bool) * list->capacity_fields);
+    }
+
+    field = arena_strndup(arena, list->buf != NULL ? list->buf : "", list->len);
+    if (!list->pattern) {
+        unquote_pattern(field, field);
+    }
+    list->fields[list->count] = field;
+    list->patterns[list->count] = list->pattern;
+    list->count++;
+
+    list->len = 0;
+    list->started = false;
+    list->pattern = false;
+}
+
+static bool is_var_name(const char* name, size_t len)
+{
+    size_t i;
+
+    if (len == 1 && (name[0] == '?' || name[0] == '$')) {
+        return true;
+    }
+    for (i = 0; i < len; i++) {
+        if (!is_var_name_char(name[i], i == 0)) {
+            return false;
+        }
+    }
+    return len > 0;
+}
+
+/*
+ * Resolve the reference after the mark at ref into value, NULL for an unset
+ * variable. Its length, mark included, goes to ref_len. A malformed ${...}
+ * is reported and fails.
+ */
+static bool reference_value(VarStore* store, const char* ref, size_t* ref_len, const char** value, int status, char* number)
+{
+    char name[BUF_SIZE];
+    size_t len;
+
+    if (ref[1] == '{') {
+        const char* end = strchr(ref + 2, '}');
+
+        len = (end != NULL) ? (size_t)(end - ref - 2) : strlen(ref + 2);
+        if (end == NULL || len >= BUF_SIZE || !is_var_name(ref + 2, len)) {
+            fprintf(stderr, "%s: $%.*s: bad substitution\n", PROGRAM_NAME, (int)(len + (end != NULL ? 2 : 1)), ref + 1);
+            return false;
+        }
+        memcpy(name, ref + 2, len);
+        *ref_len = len + 3;
+    } else if (ref[1] == '?' || ref[1] == '$') {
+        name[0] = ref[1];
+        len = 1;
+        *ref_len = 2;
+    } else {
+        for (len = 0; is_var_name_char(ref[1 + len], len == 0) && len + 1 < BUF_SIZE; len++) {
+            name[len] = ref[1 + len];
+        }
+        *ref_len = len + 1;
+    }
+    name[len] = '\0';
+
+    if (strcmp(name, "?") == 0) {
+        sprintf(number, "%d", status);
+        *value = number;
+    } else if (strcmp(name, "$") == 0) {
+        sprintf(number, "%ld", (long)store->shell_pid);
+        *value = number;
+    } else {
+        *value = get_var(store, name);
+    }
+    return true;
+}
+
+/*
+ * Append the value of an expansion. Unless quoted or not split, it is cut
+ * into fields at blanks and its glob characters take effect.
+ */
+static void append_value(FieldList* list, const char* value, bool quoted, bool split, Arena* arena)
+{
+    if (quoted) {
+        list->started = true;
+    }
+    for (; value != NULL && *value != '\0'; value++) {
+        if (quoted || !split) {
+            field_put_literal(list, *value);
+        } else if (strchr(FIELD_SEPARATORS, *value) != NULL) {
+            end_field(list, arena);
+        } else {
+            if (strchr(GLOB_CHARS, *value) != NULL) {
+                list->pattern = true;
+            }
+            field_putc(list, *value);
+        }
+    }
+}
+
+/*
+ * Expand word into list. With split, an unquoted value is cut into fields
+ * at blanks and its glob characters take effect; otherwise the result is
+ * one field. pattern tells whether the word's own glob characters are live.
+ */
+static bool expand_word(VarStore* store, const char* word, bool pattern, bool split, FieldList* list, Arena* arena, int status)
+{
+    char number[32];
+
+    if (strpbrk(word, EXPANSION_MARKS) == NULL) {
+        /* kept as it is, even empty as after "" */
+        list->started = true;
+    }
+
+    for (; *word != '\0'; word++) {
+        if (*word == VAR_MARK || *word == QUOTED_VAR_MARK) {
+            size_t ref_len;
+            const char* value;
+
+            if (!reference_value(store, word, &ref_len, &value, status, number)) {
+                return false;
+            }
+            append_value(list, value, *word == QUOTED_VAR_MARK, split, arena);
+            word += ref_len - 1;
+        } else if (*word == SUBST_MARK || *word == QUOTED_SUBST_MARK) {
+            const char* end = strchr(word, SUBST_END);
+            char* output = NULL;
+
+            if (store->substitute != NULL) {
+                output = store->substitute(word + 1, end - word - 1);
+            }
+            append_value(list, output, *word == QUOTED_SUBST_MARK, split, arena);
+            free(output);
+            word = end;
+        } else if (*word == VAR_END) {
+            continue;
+        } else if (pattern) {
+            if (strchr(GLOB_CHARS, *word) != NULL) {
+                list->pattern = true;
+            }
+            field_putc(list, *word);
+        } else {
+            field_put_literal(list, *word);
+        }
+    }
+
+    if (!split) {
+        list->started = true;
+    }
+    end_field(list, arena);
+    return true;
+}
+
+/* the word as typed, for error messages */
+static void print_word(const char* word)
+{
+    for (; *word != '\0'; word++) {
+        if (*word == SUBST_MARK || *word == QUOTED_SUBST_MARK) {
+            const char* end = strchr(word, SUBST_END);
+
+            fprintf(stderr, "$(%.*s)", (int)(end - word - 1), word + 1);
+            word = end;
+        } else if (*word != VAR_END) {
+            fputc((*word == VAR_MARK || *word == QUOTED_VAR_MARK) ? '$' : *word, stderr);
+        }
+    }
+}
+
+/* expand a redirection target, which must stay one word */
+static bool expand_target(VarStore* store, char** target, FieldList* list, Arena* arena, int status)
+{
+    int first = list->count;
+
+    if (*target == NULL || strpbrk(*target, EXPANSION_MARKS) == NULL) {
+        return true;
+    }
+    if (!expand_word(store, *target, false, true, list, arena, status)) {
+        return false;
+    }
+    if (list->count - first != 1) {
+        fprintf(stderr, "%s: ", PROGRAM_NAME);
+        print_word(*target);
+        fputs(": ambiguous redirect\n", stderr);
+        return false;
+    }
+    *target = list->fields[first];
+    unquote_pattern(*target, *target);
+    return true;
+}
+
+/* expand the text of a here-document or here-string into one field, never split */
+static bool expand_here(VarStore* store, HereDoc** here, FieldList* list, Arena* arena, int status)
+{
+    HereDoc* expanded;
+
+    if ((*here)->literal || (*here)->text == NULL || strpbrk((*here)->text, EXPANSION_MARKS) == NULL) {
+        return true;
+    }
+    if (!expand_word(store, (*here)->text, false, false, list, arena, status)) {
+        return false;
+    }
+    expanded = (HereDoc*)arena_alloc(arena, sizeof(HereDoc));
+    *expanded = **here;
+    expanded->text = list->fields[list->count - 1];
+    *here = expanded;
+    return true;
+}
+
+bool has_references(CommandLine* command_line)
+{
+    int i;
+
+    for (i = 0; i < command_line->cmdc; i++) {
+        if (command_line->cmdv[i].expand) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+CommandLine* expand_variables(VarStore* store, CommandLine* src, CommandLine* dest, Arena* arena, int status)
+{
+    FieldList list;
+    bool ok = true;
+    int i, j;
+
+    memset(&list, 0, sizeof(FieldList));
+
+    *dest = *src;
+    dest->cmdv = (Command*)arena_alloc(arena, sizeof(Command) * src->cmdc);
+    memcpy(dest->cmdv, src->cmdv, sizeof(Command) * src->cmdc);
+
+    for (i = 0; i < dest->cmdc && ok; i++) {
+        Command* cmd = &dest->cmdv[i];
+        bool any_pattern = false;
+
+        if (!cmd->expand) {
+            continue;
+        }
+
+        if (cmd->assigns != NULL) {
+            char** assigns;
+            int count = 0;
+
+            while (cmd->assigns[count] != NULL) {
+                count++;
+            }
+            assigns = (char**)arena_alloc(arena, sizeof(char*) * (count + 1));
+            for (j = 0; j < count && ok; j++) {
+                ok = expand_word(store, cmd->assigns[j], false, false, &list, arena, status);
+                assigns[j] = ok ? list.fields[list.count - 1] : NULL;
+            }
+            assigns[count] = NULL;
+            cmd->assigns = assigns;
+        }
+
+        list.count = 0;
+        for (j = 0; j < cmd->argc && ok; j++) {
+            ok = expand_word(store, cmd->argv[j], cmd->patterns != NULL && cmd->patterns[j], true, &list, arena, status);
+        }
+
+        cmd->argv = (char**)arena_alloc(arena, sizeof(char*) * (list.count + 1));
+        cmd->patterns = (bool*)arena_alloc(arena, sizeof(bool) * (list.count + 1));
+        for (j = 0; j < list.count; j++) {
+            cmd->argv[j] = list.fields[j];
+            cmd->patterns[j] = list.patterns[j];
+            any_pattern = any_pattern || list.patterns[j];
+        }
+        cmd->argv[list.count] = NULL;
+        cmd->argc = list.count;
+        if (!any_pattern) {
+            cmd->patterns = NULL;
+        }
+
+        if (cmd->redirc > 0) {
+            Redirect* redirects = (Redirect*)arena_alloc(arena, sizeof(Redirect) * cmd->redirc);
+
+            memcpy(redirects, cmd->redirects, sizeof(Redirect) * cmd->redirc);
+            for (j = 0; j < cmd->redirc && ok; j++) {
+                if (redirects[j].here != NULL) {
+                    ok = expand_here(store, &redirects[j].here, &list, arena, status);
+                } else {
+                    ok = expand_target(store, &redirects[j].target, &list, arena, status);
+                }
+            }
+            cmd->redirects = redirects;
+        }
+        cmd->expand = false;
+        list.count = 0;
+    }
+
+    free(list.buf);
+    free(list.fields);
+    free(list.patterns);
+
+    return ok ? dest : NULL;
+}
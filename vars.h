@@ -0,0 +1,61 @@
+#ifndef _VARS_H_
+#define _VARS_H_
+
+#include <sys/types.h>
+
+#include "parse.h"
+
+/******************************************************************************
+ * Shell variables: a hash map from name to value. The exported ones also
+ * own a NAME=value string in envp, which is updated in place whenever one
+ * of them changes, so launching a command passes envp as it is.
+ *****************************************************************************/
+typedef struct Variable {
+    struct Variable* next;  /* in the same bucket */
+    char* name;
+    char* value;  /* NULL for a name only exported so far */
+    bool exported;
+    char* entry;  /* NAME=value in envp, NULL while not exported or unset */
+    int env_index;  /* slot in envp, -1 without entry */
+} Variable;
+
+typedef struct {
+    Variable** buckets;
+    size_t bucket_count;
+    size_t count;
+
+    char** envp;  /* NULL terminated, in no particular order */
+    Variable** env_vars;  /* owner of each envp slot */
+    int envc;
+    int env_capacity;
+
+    pid_t shell_pid;  /* $$, kept by the children of substitutions */
+
+    /* runs the command of a substitution, returns its output without the trailing newlines */
+    char* (*substitute)(const char* command, size_t len);
+} VarStore;
+
+void init_vars(VarStore* store, char** env);
+
+Variable* find_var(VarStore* store, const char* name);
+const char* get_var(VarStore* store, const char* name);
+void set_var(VarStore* store, const char* name, const char* value);
+void export_var(VarStore* store, const char* name);
+void unset_var(VarStore* store, const char* name);
+
+/* envp with some NAME=value entries overriding the store's, for a single command */
+char** overlay_envp(VarStore* store, char** assigns, Arena* arena);
+
+void print_exported_vars(VarStore* store);
+
+bool has_references(CommandLine* command_line);
+
+/*
+ * Expand the variable references and command substitutions the lexer
+ * marked in the words of src. Unquoted expansions are split into fields
+ * at blanks. Commands without any are shared with src; the rest is built
+ * in dest and arena.
+ */
+CommandLine* expand_variables(VarStore* store, CommandLine* src, CommandLine* dest, Arena* arena, int status);
+
+#endif /* _VARS_H_ */